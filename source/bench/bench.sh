@@ -0,0 +1,114 @@
+#!/usr/bin/env bash
+#
+# End-to-end benchmark harness.
+#
+# Builds the server and the load generator, then runs the server once for
+# every combination of the settings below and drives it with the load
+# generator over the real socket protocol. Each run prints one JSON line
+# with the settings, consumer throughput, consume latency (from the load
+# generator) and produce-to-consume latency (from the server's shutdown
+# latency dump), so results from different builds can be diffed or loaded
+# into a spreadsheet.
+#
+# Usage:
+#   source/bench/bench.sh [-o results.jsonl] [-d seconds]
+#
+# The matrix is set with space-separated lists in the environment:
+#   BUFFER_SIZES     buffer sizes                 (default "1 16 256")
+#   PRODUCERS        producer counts              (default "1 4 16")
+#   CONSUMERS        consumer connections         (default "10 100")
+#   CONSUME_DELAYS   consumeDelay values          (default "0")
+#   CONSUMER_RESTS   consumerRest values          (default "0")
+#   PRODUCE_DELAY    produceDelay for every run   (default 0)
+#   PRODUCER_REST    producerRest for every run   (default 0)
+#   RATE             target consume rate, 0 = as fast as possible (default 0)
+
+set -e
+
+cd "$(dirname "$0")/../.."
+ROOT=$(pwd)
+
+OUTPUT=/dev/stdout
+DURATION=10
+while getopts "o:d:" opt; do
+    case $opt in
+        o) OUTPUT=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        *) echo "usage: $0 [-o results.jsonl] [-d seconds]" >&2; exit 1 ;;
+    esac
+done
+
+BUFFER_SIZES=${BUFFER_SIZES:-"1 16 256"}
+PRODUCERS=${PRODUCERS:-"1 4 16"}
+CONSUMERS=${CONSUMERS:-"10 100"}
+CONSUME_DELAYS=${CONSUME_DELAYS:-"0"}
+CONSUMER_RESTS=${CONSUMER_RESTS:-"0"}
+PRODUCE_DELAY=${PRODUCE_DELAY:-0}
+PRODUCER_REST=${PRODUCER_REST:-0}
+RATE=${RATE:-0}
+
+SERVER_PORT=60118
+METRICS_PORT=60119
+
+# build -------------------------------------------------------------------
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+CFLAGS=${CFLAGS:-"-O2"}
+gcc $CFLAGS -fcommon $(xml2-config --cflags) -o "$BUILD/server" \
+    "$ROOT"/source/server/*.c -lpthread -lm $(xml2-config --libs)
+gcc $CFLAGS -o "$BUILD/loadgen" \
+    "$ROOT"/source/client/loadgen/*.c
+REVISION=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+# wait until something is listening on the given local port
+wait_for_port() {
+    for _ in $(seq 100); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.05
+    done
+    return 1
+}
+
+# print "p50 p99 p999" for one histogram from a server latency dump
+dump_percentiles() {
+    awk -v name="$2" '$1 == name { print $3, $4, $5 }' "$1"
+}
+
+# run ---------------------------------------------------------------------
+for buffer_size in $BUFFER_SIZES; do
+for producers in $PRODUCERS; do
+for consumers in $CONSUMERS; do
+for consume_delay in $CONSUME_DELAYS; do
+for consumer_rest in $CONSUMER_RESTS; do
+    log="$BUILD/server.log"
+    "$BUILD/server" "$buffer_size" "$producers" "$consume_delay" "$consumer_rest" \
+        "$PRODUCE_DELAY" "$PRODUCER_REST" > "$log" 2>&1 &
+    server=$!
+    if ! wait_for_port $METRICS_PORT || ! wait_for_port $SERVER_PORT; then
+        echo "server did not start:" >&2
+        cat "$log" >&2
+        kill "$server" 2>/dev/null || true
+        exit 1
+    fi
+
+    load=$("$BUILD/loadgen" -j -c "$consumers" -r "$RATE" -d "$DURATION" 2>/dev/null)
+
+    kill -INT "$server"
+    wait "$server" || true
+
+    read -r p2c_p50 p2c_p99 p2c_p999 <<< "$(dump_percentiles "$log" produce_to_consume)"
+    read -r hold_p50 hold_p99 hold_p999 <<< "$(dump_percentiles "$log" consumer_hold)"
+
+    printf '{"revision":"%s","buffer_size":%s,"producers":%s,"consume_delay":%s,"consumer_rest":%s,"produce_delay":%s,"producer_rest":%s,' \
+        "$REVISION" "$buffer_size" "$producers" "$consume_delay" "$consumer_rest" \
+        "$PRODUCE_DELAY" "$PRODUCER_REST" >> "$OUTPUT"
+    printf '"p2c_p50_ns":%s,"p2c_p99_ns":%s,"p2c_p999_ns":%s,"consumer_hold_p50_ns":%s,"consumer_hold_p99_ns":%s,"consumer_hold_p999_ns":%s,%s\n' \
+        "${p2c_p50:-0}" "${p2c_p99:-0}" "${p2c_p999:-0}" \
+        "${hold_p50:-0}" "${hold_p99:-0}" "${hold_p999:-0}" "${load#\{}" >> "$OUTPUT"
+done
+done
+done
+done
+done
@@ -0,0 +1,300 @@
+/**
+ * @file
+ *
+ * Microbenchmark for the ResourceBuffer on its own, without sockets.
+ * N producer threads and M consumer threads drive resource_buffer_enqueue()
+ * and resource_buffer_dequeue() directly, using the same buffer mutex and
+ * condition variable protocol as producer_produce() and
+ * consumer_service_get_resource(), for each of a list of buffer sizes.
+ *
+ * For each size this reports:
+ *   ops/sec          resources moved through the buffer per second
+ *   cache misses     hardware cache misses per op (perf_event_open), or
+ *                    -1 when perf events aren't available
+ *   fairness         Jain's fairness index of per-thread op counts, from
+ *                    1/n (one thread did everything) to 1.0 (all equal)
+ *
+ * Monitor pushes and stats publishing are stubbed out so that only the
+ * queue and its locking are measured.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -fcommon -Isource/server -o buffer_bench source/bench/buffer_bench.c \
+ *       source/server/resourceBuffer.c source/server/partition.c source/server/events.c \
+ *       source/server/log.c source/server/timing.c \
+ *       -lpthread -lm
+ *
+ * Usage:
+ *   buffer_bench [-p producers] [-c consumers] [-s size,size,...] [-d seconds] [-a] [-j]
+ *
+ * -a pins thread i to CPU i (modulo the CPU count). -j prints one JSON line
+ * per buffer size.
+ */
+
+#define _GNU_SOURCE
+#include "server.h"
+#include <unistd.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+typedef struct _BenchThread BenchThread;
+struct _BenchThread {
+    pthread_t thread;
+    int index;
+    int producer;
+    uint64_t ops;
+    int64_t cache_misses;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct {
+    int producers;
+    int consumers;
+    double duration;
+    int pin;
+    int json;
+} bench;
+
+static ResourceBuffer *benchBuffer;
+static _Atomic int benchStop;
+
+// the bench measures the queue, not the monitor or stats machinery
+void monitor_push_reports() {
+}
+
+void stats_buffer(ResourceBuffer *rb) {
+}
+
+/**
+ * Open a per-thread hardware cache miss counter. Returns -1 if perf
+ * events aren't available (e.g. perf_event_paranoid or a container).
+ */
+static int bench_perf_open() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Pin the calling thread to one CPU.
+ */
+static void bench_pin(int index) {
+    cpu_set_t cpus;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&cpus);
+    CPU_SET(index % ncpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+/**
+ * Producer or consumer loop, following the same locking protocol as
+ * the server until benchStop is set.
+ */
+void *bench_thread(void *tp) {
+    BenchThread *t = (BenchThread *)tp;
+    Resource *r;
+    int perf;
+
+    if (bench.pin) {
+        bench_pin(t->index);
+    }
+    perf = bench_perf_open();
+    if (perf >= 0) {
+        ioctl(perf, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    while (!atomic_load_explicit(&benchStop, memory_order_relaxed)) {
+        pthread_mutex_lock(&benchBuffer->mutex);
+        if (t->producer) {
+            while (benchBuffer->count >= benchBuffer->size && !benchStop) {
+                pthread_cond_wait(&benchBuffer->hasRoom, &benchBuffer->mutex);
+            }
+            if (!benchStop) {
+                resource_buffer_enqueue(benchBuffer, resource_new(t->index));
+                t->ops++;
+                pthread_cond_signal(&benchBuffer->notEmpty);
+            }
+            pthread_mutex_unlock(&benchBuffer->mutex);
+        }
+        else {
+            while (benchBuffer->count == 0 && !benchStop) {
+                pthread_cond_wait(&benchBuffer->notEmpty, &benchBuffer->mutex);
+            }
+            r = NULL;
+            if (!benchStop && resource_buffer_dequeue(benchBuffer, &r) == 0) {
+                t->ops++;
+                pthread_cond_signal(&benchBuffer->hasRoom);
+            }
+            pthread_mutex_unlock(&benchBuffer->mutex);
+            free(r);
+        }
+    }
+
+    t->cache_misses = -1;
+    if (perf >= 0) {
+        long long misses;
+        ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf, &misses, sizeof(misses)) == sizeof(misses)) {
+            t->cache_misses = misses;
+        }
+        close(perf);
+    }
+    return NULL;
+}
+
+/**
+ * Jain's fairness index of the op counts of threads [from, to).
+ */
+static double bench_fairness(BenchThread *threads, int from, int to) {
+    double sum = 0, squares = 0;
+    int i;
+
+    for (i = from; i < to; i++) {
+        sum += threads[i].ops;
+        squares += (double)threads[i].ops * threads[i].ops;
+    }
+    return squares > 0 ? (sum * sum) / ((to - from) * squares) : 0;
+}
+
+/**
+ * Run one timed round at the given buffer size and print its results.
+ */
+static void bench_run(int size) {
+    int n = bench.producers + bench.consumers;
+    BenchThread *threads;
+    uint64_t start, elapsed, produced = 0, consumed = 0;
+    int64_t misses = 0;
+    Resource *r;
+    int i;
+
+    benchBuffer = resource_buffer_new(size);
+    atomic_store(&benchStop, 0);
+    if (posix_memalign((void **)&threads, CACHE_LINE_SIZE, n * sizeof(*threads)) != 0) {
+        return;
+    }
+    memset(threads, 0, n * sizeof(*threads));
+
+    start = monotonic_ns();
+    for (i = 0; i < n; i++) {
+        threads[i].index = i;
+        threads[i].producer = i < bench.producers;
+        pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+    }
+
+    delay_sleep_ns((uint64_t)(bench.duration * 1e9));
+
+    pthread_mutex_lock(&benchBuffer->mutex);
+    atomic_store(&benchStop, 1);
+    pthread_cond_broadcast(&benchBuffer->hasRoom);
+    pthread_cond_broadcast(&benchBuffer->notEmpty);
+    pthread_mutex_unlock(&benchBuffer->mutex);
+
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].producer) {
+            produced += threads[i].ops;
+        }
+        else {
+            consumed += threads[i].ops;
+        }
+        if (misses >= 0) {
+            misses = threads[i].cache_misses < 0 ? -1 : misses + threads[i].cache_misses;
+        }
+    }
+    elapsed = monotonic_ns() - start;
+
+    if (bench.json) {
+        printf("{\"size\":%d,\"producers\":%d,\"consumers\":%d,\"pinned\":%d,"
+            "\"ops_per_sec\":%.0f,\"cache_misses_per_op\":%.2f,"
+            "\"producer_fairness\":%.4f,\"consumer_fairness\":%.4f}\n",
+            size, bench.producers, bench.consumers, bench.pin,
+            consumed / (elapsed / 1e9),
+            misses < 0 || consumed == 0 ? -1.0 : (double)misses / (produced + consumed),
+            bench_fairness(threads, 0, bench.producers),
+            bench_fairness(threads, bench.producers, n));
+    }
+    else {
+        printf("%10d %14.0f %14.2f %10.4f %10.4f\n",
+            size, consumed / (elapsed / 1e9),
+            misses < 0 || consumed == 0 ? -1.0 : (double)misses / (produced + consumed),
+            bench_fairness(threads, 0, bench.producers),
+            bench_fairness(threads, bench.producers, n));
+    }
+    fflush(stdout);
+
+    // drain and free whatever is left
+    while (resource_buffer_dequeue(benchBuffer, &r) == 0) {
+        free(r);
+    }
+    free(benchBuffer);
+    free(threads);
+}
+
+int main(int argc, char **argv) {
+    char *sizes = "1,16,256,4096,65536,1048576";
+    char *size;
+    int opt;
+
+    bench.producers = 4;
+    bench.consumers = 4;
+    bench.duration = 2;
+    bench.pin = 0;
+    bench.json = 0;
+
+    while ((opt = getopt(argc, argv, "p:c:s:d:aj")) != -1) {
+        switch (opt) {
+            case 'p':
+                bench.producers = atoi(optarg);
+                break;
+            case 'c':
+                bench.consumers = atoi(optarg);
+                break;
+            case 's':
+                sizes = optarg;
+                break;
+            case 'd':
+                bench.duration = atof(optarg);
+                break;
+            case 'a':
+                bench.pin = 1;
+                break;
+            case 'j':
+                bench.json = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p producers] [-c consumers] "
+                    "[-s size,size,...] [-d seconds] [-a] [-j]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (bench.producers < 1 || bench.consumers < 1) {
+        fprintf(stderr, "need at least one producer and one consumer\n");
+        return 1;
+    }
+
+    logLevel = LOG_LEVEL_ERROR;
+
+    if (!bench.json) {
+        printf("%d producers, %d consumers, %.1fs per size%s\n",
+            bench.producers, bench.consumers, bench.duration,
+            bench.pin ? ", pinned" : "");
+        printf("%10s %14s %14s %10s %10s\n",
+            "size", "ops/sec", "misses/op", "p-fair", "c-fair");
+    }
+
+    sizes = strdup(sizes);
+    for (size = strtok(sizes, ","); size != NULL; size = strtok(NULL, ",")) {
+        bench_run(atoi(size));
+    }
+    free(sizes);
+    return 0;
+}
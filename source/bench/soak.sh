@@ -0,0 +1,168 @@
+#!/usr/bin/env bash
+#
+# Long-running soak test with invariant checking.
+#
+# Builds the server and the load generator, starts the server with its
+# watchdog, and drives it for hours with a mix of two loads:
+#
+#   - a verifying load generator (-V) with CONNECTIONS closed-loop
+#     connections, which checks that no resource id reaches it twice and
+#     that no request goes unanswered for STALL seconds
+#   - an open-loop load generator at RATE requests per second over
+#     OPEN_CONNECTIONS connections, competing for the same buffer
+#
+# Meanwhile the server's watchdog checks that the buffer count stays in
+# bounds, that every resource produced is consumed exactly once or is
+# still in the buffer, and that no thread misses its wakeup. Metrics are
+# scraped every WINDOW seconds into the log, and throughput per window
+# gives the drift over the run.
+#
+# Prints one JSON line with the results. Exits with status 1 if any
+# invariant was violated, or if throughput drifted by more than MAX_DRIFT
+# percent (when MAX_DRIFT is set).
+#
+# Usage:
+#   source/bench/soak.sh [-d seconds] [-o results.jsonl] [-l logdir]
+#
+# Settings come from the environment:
+#   BUFFER_SIZE        buffer size                      (default 16)
+#   PRODUCERS          producer count                   (default 8)
+#   CONSUME_DELAY      consumeDelay                     (default 0)
+#   CONSUMER_REST      consumerRest                     (default 0)
+#   PRODUCE_DELAY      produceDelay                     (default exp:20us)
+#   PRODUCER_REST      producerRest                     (default burst:8:1ms)
+#   CONNECTIONS        verifying connections            (default 200)
+#   OPEN_CONNECTIONS   open-loop connections            (default 100)
+#   RATE               open-loop request rate           (default 10000)
+#   WINDOW             throughput window, seconds       (default 60)
+#   STALL              unanswered request limit, s      (default 30)
+#   MAX_DRIFT          allowed drift in percent         (default unset)
+
+set -e
+
+cd "$(dirname "$0")/../.."
+ROOT=$(pwd)
+
+OUTPUT=/dev/stdout
+DURATION=3600
+LOGDIR=
+while getopts "d:o:l:" opt; do
+    case $opt in
+        d) DURATION=$OPTARG ;;
+        o) OUTPUT=$OPTARG ;;
+        l) LOGDIR=$OPTARG ;;
+        *) echo "usage: $0 [-d seconds] [-o results.jsonl] [-l logdir]" >&2; exit 1 ;;
+    esac
+done
+
+BUFFER_SIZE=${BUFFER_SIZE:-16}
+PRODUCERS=${PRODUCERS:-8}
+CONSUME_DELAY=${CONSUME_DELAY:-0}
+CONSUMER_REST=${CONSUMER_REST:-0}
+PRODUCE_DELAY=${PRODUCE_DELAY:-exp:20us}
+PRODUCER_REST=${PRODUCER_REST:-burst:8:1ms}
+CONNECTIONS=${CONNECTIONS:-200}
+OPEN_CONNECTIONS=${OPEN_CONNECTIONS:-100}
+RATE=${RATE:-10000}
+WINDOW=${WINDOW:-60}
+STALL=${STALL:-30}
+MAX_DRIFT=${MAX_DRIFT:-}
+
+SERVER_PORT=60118
+METRICS_PORT=60119
+
+# build -------------------------------------------------------------------
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+LOGDIR=${LOGDIR:-$BUILD}
+mkdir -p "$LOGDIR"
+CFLAGS=${CFLAGS:-"-O2"}
+gcc $CFLAGS -fcommon $(xml2-config --cflags) -o "$BUILD/server" \
+    "$ROOT"/source/server/*.c -lpthread -lm $(xml2-config --libs)
+gcc $CFLAGS -o "$BUILD/loadgen" \
+    "$ROOT"/source/client/loadgen/*.c
+REVISION=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+# wait until something is listening on the given local port
+wait_for_port() {
+    for _ in $(seq 100); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.05
+    done
+    return 1
+}
+
+# print the value of one metric from the server
+scrape() {
+    exec 3<>"/dev/tcp/127.0.0.1/$METRICS_PORT"
+    printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+    awk -v name="$1" '$1 == name { print $2 }' <&3
+    exec 3>&-
+}
+
+# pull one numeric field out of a JSON line
+json_field() {
+    sed -n "s/.*\"$2\":\\([-0-9.]*\\).*/\\1/p" <<< "$1"
+}
+
+# run ---------------------------------------------------------------------
+"$BUILD/server" "$BUFFER_SIZE" "$PRODUCERS" "$CONSUME_DELAY" "$CONSUMER_REST" \
+    "$PRODUCE_DELAY" "$PRODUCER_REST" --watchdog=1s > "$LOGDIR/server.log" 2>&1 &
+server=$!
+if ! wait_for_port $METRICS_PORT || ! wait_for_port $SERVER_PORT; then
+    echo "server did not start:" >&2
+    cat "$LOGDIR/server.log" >&2
+    kill "$server" 2>/dev/null || true
+    exit 1
+fi
+
+"$BUILD/loadgen" -c "$OPEN_CONNECTIONS" -r "$RATE" -d "$DURATION" -w "$WINDOW" \
+    > "$LOGDIR/open.log" 2>&1 &
+open_load=$!
+
+"$BUILD/loadgen" -j -V -c "$CONNECTIONS" -d "$DURATION" -w "$WINDOW" -s "$STALL" \
+    > "$LOGDIR/verify.json" 2> "$LOGDIR/verify.log" &
+verify_load=$!
+
+# scrape the watchdog's count while the load runs, so a violation shows
+# up in the log near the time it happened
+while kill -0 "$verify_load" 2>/dev/null; do
+    echo "$(date +%s) violations $(scrape pc_invariant_violations_total) depth $(scrape pc_buffer_depth)" \
+        >> "$LOGDIR/metrics.log"
+    sleep "$WINDOW"
+done
+
+verify_status=0
+wait "$verify_load" || verify_status=$?
+wait "$open_load" || true
+
+violations=$(scrape pc_invariant_violations_total)
+kill -INT "$server"
+wait "$server" || true
+
+result=$(cat "$LOGDIR/verify.json")
+drift=$(json_field "$result" drift_pct)
+
+# ids can be missing from the verifying stream because the open-loop
+# connections took them, so only the server's watchdog judges losses
+failed=0
+if [ "$verify_status" -ne 0 ] || [ "${violations:-1}" -ne 0 ]; then
+    failed=1
+fi
+if [ -n "$MAX_DRIFT" ] && awk -v d="${drift:-0}" -v m="$MAX_DRIFT" 'BEGIN { exit !(d > m || d < -m) }'; then
+    failed=1
+fi
+
+printf '{"revision":"%s","buffer_size":%s,"producers":%s,"open_connections":%s,"open_rate":%s,' \
+    "$REVISION" "$BUFFER_SIZE" "$PRODUCERS" "$OPEN_CONNECTIONS" "$RATE" >> "$OUTPUT"
+printf '"violations":%s,"passed":%s,%s\n' \
+    "${violations:-null}" "$([ $failed -eq 0 ] && echo true || echo false)" "${result#\{}" >> "$OUTPUT"
+
+if [ $failed -ne 0 ]; then
+    echo "soak failed; logs are in $LOGDIR" >&2
+    grep watchdog "$LOGDIR/server.log" | head -20 >&2 || true
+    [ "$LOGDIR" = "$BUILD" ] && trap - EXIT
+fi
+exit $failed
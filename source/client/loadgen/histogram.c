@@ -0,0 +1,68 @@
+/**
+ * @file
+ *
+ * Log-linear latency histogram. Each power of two is split into 16 linear
+ * buckets, which keeps every value to within about 6% while covering
+ * nanoseconds to hours in a fixed array. This is the same bucketing the
+ * server uses for its own latency histograms.
+ */
+#include "loadgen.h"
+
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+
+static int histogram_bucket(uint64_t v) {
+	int e;
+	if (v < SUB_BUCKETS) {
+		return (int)v;
+	}
+	e = 63 - __builtin_clzll(v);
+	return (e - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+		+ (int)((v >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t histogram_bucket_value(int idx) {
+	int e, sub;
+	if (idx < SUB_BUCKETS) {
+		return (uint64_t)idx;
+	}
+	e = idx / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	sub = idx % SUB_BUCKETS;
+	return (((uint64_t)(SUB_BUCKETS + sub + 1)) << (e - SUB_BUCKET_BITS)) - 1;
+}
+
+/**
+ * Record one value
+ */
+void histogram_record(Histogram *h, uint64_t v) {
+	h->counts[histogram_bucket(v)]++;
+	h->count++;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+/**
+ * Return the value at quantile q (0.0 - 1.0), reported as the upper bound
+ * of the bucket it falls in
+ */
+uint64_t histogram_percentile(Histogram *h, double q) {
+	uint64_t rank, seen = 0;
+	int b;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	rank = (uint64_t)(q * h->count);
+	if (rank >= h->count) {
+		rank = h->count - 1;
+	}
+	for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen > rank) {
+			uint64_t v = histogram_bucket_value(b);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file
+ *
+ * Header for the Linux load generator. The load generator opens many
+ * "handshake:consumer" connections to the server from a single epoll
+ * loop and issues "consume" requests at a target rate, recording the
+ * latency of every request.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 60118
+
+// Load settings, filled in from the command line
+typedef struct _Settings Settings;
+struct _Settings {
+	const char *host;
+	int port;
+	int connections;
+	double rate;
+	double duration;
+	int json;
+	int verify;
+	double window;
+	double stall;
+	// the topic to consume from, or NULL for the server's default
+	const char *topic;
+	// ack each resource, for a server run with --ack-timeout
+	int ack;
+};
+extern Settings settings;
+
+// Latency histogram (log-linear buckets, nanosecond values)
+#define HISTOGRAM_BUCKETS 976
+typedef struct _Histogram Histogram;
+struct _Histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t max;
+};
+void histogram_record(Histogram *, uint64_t);
+uint64_t histogram_percentile(Histogram *, double);
+
+// Delivery checks (-V): every resource id should arrive exactly once
+typedef struct _Verify Verify;
+struct _Verify {
+	uint8_t *seen;
+	uint64_t capacity;
+	int64_t max_rid;
+	uint64_t unique;
+	uint64_t duplicates;
+	uint64_t malformed;
+	uint64_t stalled;
+};
+void verify_record(Verify *, const char *response);
+uint64_t verify_missing(Verify *);
+
+// Throughput over successive windows, to spot drift in long runs
+typedef struct _Windows Windows;
+struct _Windows {
+	double *rates;
+	int count;
+	int capacity;
+};
+void windows_add(Windows *, double rate);
+double windows_drift(Windows *);
+
+// Totals gathered by the event loop
+typedef struct _LoadStats LoadStats;
+struct _LoadStats {
+	uint64_t connected;
+	uint64_t failed;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t backlogged;
+	Histogram latency;
+	Verify verify;
+	Windows windows;
+};
+
+// Primary load function
+int loadgen_run(LoadStats *);
+uint64_t loadgen_now_ns();
+
+// should debug statements be printed to console?
+typedef struct _Debug Debug;
+struct _Debug {
+	unsigned int print : 1;
+};
+extern Debug debug;
@@ -0,0 +1,183 @@
+/**
+ * @file
+ *
+ * This is the load generator main function. It parses the command line,
+ * runs the load and prints a summary of throughput and consume latency.
+ *
+ * Build:
+ *   gcc -O2 -o loadgen main.c socket.c histogram.c verify.c
+ *
+ * Usage:
+ *   loadgen [-h host] [-p port] [-c connections] [-r rate] [-d seconds]
+ *           [-w seconds] [-V] [-s seconds] [-t topic] [-a] [-j] [-v]
+ *
+ * -r is the target number of "consume" requests per second across every
+ * connection. Without it each connection sends as fast as the server
+ * answers. -w sets the throughput window used to measure drift (default
+ * 10s). -V verifies deliveries: every resource id must arrive only once,
+ * and a request unanswered for -s seconds (default 10) counts as stalled.
+ * With -V the exit status is 1 if a check failed. -t consumes from a named
+ * topic instead of the default one. -a acks every resource, for a server
+ * run with --ack-timeout. -j prints the summary as a single
+ * JSON object.
+ */
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include "loadgen.h"
+
+Settings settings;
+Debug debug;
+
+/**
+ * Raise the open file limit so thousands of connections fit
+ */
+static void loadgen_raise_fd_limit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int main(int argc, char **argv) {
+	LoadStats *stats;
+	int opt, failed;
+
+	debug.print = 0;
+	settings.host = DEFAULT_HOST;
+	settings.port = DEFAULT_PORT;
+	settings.connections = 100;
+	settings.rate = 0;
+	settings.duration = 10;
+	settings.json = 0;
+	settings.verify = 0;
+	settings.window = 10;
+	settings.stall = 10;
+	settings.topic = NULL;
+	settings.ack = 0;
+
+	while ((opt = getopt(argc, argv, "h:p:c:r:d:w:s:t:aVjv")) != -1) {
+		switch (opt) {
+			case 'h':
+				settings.host = optarg;
+				break;
+			case 'p':
+				settings.port = atoi(optarg);
+				break;
+			case 'c':
+				settings.connections = atoi(optarg);
+				break;
+			case 'r':
+				settings.rate = atof(optarg);
+				break;
+			case 'd':
+				settings.duration = atof(optarg);
+				break;
+			case 'w':
+				settings.window = atof(optarg);
+				break;
+			case 's':
+				settings.stall = atof(optarg);
+				break;
+			case 't':
+				settings.topic = optarg;
+				break;
+			case 'a':
+				settings.ack = 1;
+				break;
+			case 'V':
+				settings.verify = 1;
+				break;
+			case 'j':
+				settings.json = 1;
+				break;
+			case 'v':
+				debug.print = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] "
+					"[-r rate] [-d seconds] [-w seconds] [-V] [-s seconds] [-t topic] [-a] [-j] [-v]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (settings.connections < 1) {
+		settings.connections = 1;
+	}
+	if (settings.window <= 0) {
+		settings.window = 10;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	loadgen_raise_fd_limit();
+
+	stats = calloc(1, sizeof(*stats));
+	if (loadgen_run(stats) != 0) {
+		return 1;
+	}
+
+	// with -V, any duplicate, unreadable or unanswered request fails the run
+	failed = settings.verify && (stats->verify.duplicates > 0
+		|| stats->verify.malformed > 0 || stats->verify.stalled > 0);
+
+	if (settings.json) {
+		printf("{\"connections\":%d,\"rate\":%.1f,\"duration\":%.1f,"
+			"\"connected\":%llu,\"failed\":%llu,\"sent\":%llu,\"received\":%llu,"
+			"\"backlogged\":%llu,\"items_per_sec\":%.1f,"
+			"\"consume_p50_ns\":%llu,\"consume_p99_ns\":%llu,"
+			"\"consume_p999_ns\":%llu,\"consume_max_ns\":%llu,\"drift_pct\":%.1f",
+			settings.connections, settings.rate, settings.duration,
+			(unsigned long long)stats->connected,
+			(unsigned long long)stats->failed,
+			(unsigned long long)stats->sent,
+			(unsigned long long)stats->received,
+			(unsigned long long)stats->backlogged,
+			stats->received / settings.duration,
+			(unsigned long long)histogram_percentile(&stats->latency, 0.50),
+			(unsigned long long)histogram_percentile(&stats->latency, 0.99),
+			(unsigned long long)histogram_percentile(&stats->latency, 0.999),
+			(unsigned long long)stats->latency.max,
+			windows_drift(&stats->windows));
+		if (settings.verify) {
+			printf(",\"unique\":%llu,\"duplicates\":%llu,\"missing\":%llu,"
+				"\"malformed\":%llu,\"stalled\":%llu",
+				(unsigned long long)stats->verify.unique,
+				(unsigned long long)stats->verify.duplicates,
+				(unsigned long long)verify_missing(&stats->verify),
+				(unsigned long long)stats->verify.malformed,
+				(unsigned long long)stats->verify.stalled);
+		}
+		printf("}\n");
+		free(stats);
+		return failed;
+	}
+
+	printf("connections:  %llu connected, %llu failed\n"
+		"requests:     %llu sent, %llu received, %llu backlogged\n"
+		"throughput:   %.1f/s, drift %+.1f%% over %d windows\n"
+		"latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+		(unsigned long long)stats->connected,
+		(unsigned long long)stats->failed,
+		(unsigned long long)stats->sent,
+		(unsigned long long)stats->received,
+		(unsigned long long)stats->backlogged,
+		stats->received / settings.duration,
+		windows_drift(&stats->windows), stats->windows.count,
+		histogram_percentile(&stats->latency, 0.50) / 1e3,
+		histogram_percentile(&stats->latency, 0.90) / 1e3,
+		histogram_percentile(&stats->latency, 0.99) / 1e3,
+		histogram_percentile(&stats->latency, 0.999) / 1e3,
+		stats->latency.max / 1e3);
+	if (settings.verify) {
+		printf("verify:       %llu unique, %llu duplicates, %llu missing, "
+			"%llu malformed, %llu stalled\n",
+			(unsigned long long)stats->verify.unique,
+			(unsigned long long)stats->verify.duplicates,
+			(unsigned long long)verify_missing(&stats->verify),
+			(unsigned long long)stats->verify.malformed,
+			(unsigned long long)stats->verify.stalled);
+	}
+
+	free(stats);
+	return failed;
+}
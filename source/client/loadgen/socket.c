@@ -0,0 +1,374 @@
+/**
+ * @file
+ *
+ * This socket.c file runs the load generator's epoll loop. Every
+ * connection is a non-blocking socket that goes through connect,
+ * handshake and then repeated "consume" requests.
+ *
+ * With a target rate, requests are scheduled open-loop: a request is due
+ * every 1/rate seconds whether or not the server is keeping up, and its
+ * latency is measured from when it was due, not from when an idle
+ * connection finally became free to send it. This keeps a slow server
+ * from hiding its own queueing delay (coordinated omission). With no
+ * target rate every connection sends its next request as soon as the
+ * previous one is answered.
+ *
+ * With -a each request also acks the resource the previous one got, as
+ * "ack:<rid>;consume", for a server that redelivers unacked resources.
+ */
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "loadgen.h"
+
+enum { CONN_CONNECTING, CONN_HANDSHAKE, CONN_IDLE, CONN_BUSY, CONN_CLOSED };
+
+typedef struct _Connection Connection;
+struct _Connection {
+	int fd;
+	int state;
+	uint64_t sent_at;
+	uint64_t written_at;
+	int stalled;
+	// the rid still to be acked, or -1
+	int unacked;
+	int length;
+	char buffer[256];
+};
+
+// FIFO of unsigned 64 bit values (idle connection indices, due times)
+typedef struct _Queue Queue;
+struct _Queue {
+	uint64_t *items;
+	size_t capacity;
+	size_t head;
+	size_t count;
+};
+
+#define MAX_EVENTS 1024
+#define MAX_PENDING (1 << 20)
+#define CONNECTS_PER_PASS 256
+
+static Connection *connections;
+static Queue idle;
+static Queue pending;
+
+/**
+ * Current CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t loadgen_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int queue_push(Queue *q, uint64_t v) {
+	if (q->count == q->capacity) {
+		return -1;
+	}
+	q->items[(q->head + q->count) % q->capacity] = v;
+	q->count++;
+	return 0;
+}
+
+static uint64_t queue_pop(Queue *q) {
+	uint64_t v = q->items[q->head];
+	q->head = (q->head + 1) % q->capacity;
+	q->count--;
+	return v;
+}
+
+/**
+ * Start a non-blocking connect for connection i
+ */
+static int loadgen_connect(int epfd, struct sockaddr_in *server, int i) {
+	Connection *c = &connections[i];
+	struct epoll_event ev;
+	int one = 1;
+
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->fd < 0) {
+		if (debug.print) perror("socket");
+		c->state = CONN_CLOSED;
+		return -1;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->state = CONN_CONNECTING;
+	c->length = 0;
+	c->unacked = -1;
+
+	if (connect(c->fd, (struct sockaddr *)server, sizeof(*server)) < 0 && errno != EINPROGRESS) {
+		if (debug.print) perror("connect");
+		close(c->fd);
+		c->state = CONN_CLOSED;
+		return -1;
+	}
+
+	ev.events = EPOLLOUT;
+	ev.data.u32 = i;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	return 0;
+}
+
+/**
+ * Close connection i and stop watching it
+ */
+static void loadgen_close(int epfd, int i) {
+	Connection *c = &connections[i];
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->state = CONN_CLOSED;
+}
+
+/**
+ * Send a "consume" request on connection i, due at the given time
+ */
+static int loadgen_send(int i, uint64_t due) {
+	Connection *c = &connections[i];
+	char request[64];
+	int length;
+
+	if (c->unacked >= 0) {
+		length = snprintf(request, sizeof(request), "ack:%d;consume", c->unacked);
+	}
+	else {
+		length = snprintf(request, sizeof(request), "consume");
+	}
+	if (write(c->fd, request, length) != length) {
+		return -1;
+	}
+	c->unacked = -1;
+	c->state = CONN_BUSY;
+	c->sent_at = due;
+	c->written_at = loadgen_now_ns();
+	c->stalled = 0;
+	return 0;
+}
+
+/**
+ * Read whatever the server sent on connection i and advance its state.
+ * Returns -1 if the connection closed or failed.
+ */
+static int loadgen_read(int i, LoadStats *stats) {
+	Connection *c = &connections[i];
+	char *end;
+	int n;
+
+	n = read(c->fd, c->buffer + c->length, sizeof(c->buffer) - c->length - 1);
+	if (n <= 0) {
+		return (n < 0 && errno == EAGAIN) ? 0 : -1;
+	}
+	c->length += n;
+	c->buffer[c->length] = '\0';
+
+	if (c->state == CONN_HANDSHAKE) {
+		if (strstr(c->buffer, "handshake:consumer") == NULL) {
+			return 0;
+		}
+		c->length = 0;
+		c->state = CONN_IDLE;
+		stats->connected++;
+		queue_push(&idle, i);
+		return 0;
+	}
+
+	// a complete response looks like "rid:N;produced_by:N;"
+	end = strstr(c->buffer, "produced_by:");
+	if (c->state == CONN_BUSY && end != NULL && strchr(end, ';') != NULL) {
+		histogram_record(&stats->latency, loadgen_now_ns() - c->sent_at);
+		stats->received++;
+		if (settings.verify) {
+			verify_record(&stats->verify, c->buffer);
+		}
+		if (settings.ack) {
+			sscanf(c->buffer, "rid:%d", &c->unacked);
+		}
+		if (debug.print) printf("%s\n", c->buffer);
+		c->length = 0;
+		c->state = CONN_IDLE;
+		queue_push(&idle, i);
+	}
+	return 0;
+}
+
+/**
+ * Count requests that have waited more than settings.stall seconds for an
+ * answer. Each request is counted once.
+ */
+static void loadgen_check_stalls(int opened, uint64_t now, LoadStats *stats) {
+	uint64_t limit = (uint64_t)(settings.stall * 1e9);
+	int i;
+
+	for (i = 0; i < opened; i++) {
+		Connection *c = &connections[i];
+		if (c->state == CONN_BUSY && !c->stalled && now > c->written_at + limit) {
+			c->stalled = 1;
+			stats->verify.stalled++;
+			fprintf(stderr, "connection %d has had no answer for %.0fs\n", i, settings.stall);
+		}
+	}
+}
+
+/**
+ * Run the load described by settings, filling in stats.
+ */
+int loadgen_run(LoadStats *stats) {
+	struct epoll_event events[MAX_EVENTS];
+	struct sockaddr_in server;
+	uint64_t start, end, now, interval = 0, next_due, next_report, next_window;
+	uint64_t last_received = 0, window_received = 0;
+	int epfd, opened = 0, open = 0, i, n;
+	char handshake[256];
+
+	// a named topic is asked for in the handshake
+	if (settings.topic != NULL) {
+		snprintf(handshake, sizeof(handshake), "handshake:consumer:%s", settings.topic);
+	}
+	else {
+		snprintf(handshake, sizeof(handshake), "handshake:consumer");
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(settings.port);
+	if (inet_pton(AF_INET, settings.host, &server.sin_addr) != 1) {
+		fprintf(stderr, "invalid host address: %s\n", settings.host);
+		return 1;
+	}
+
+	connections = calloc(settings.connections, sizeof(*connections));
+	idle.capacity = settings.connections;
+	idle.items = calloc(idle.capacity, sizeof(*idle.items));
+	pending.capacity = MAX_PENDING;
+	pending.items = calloc(pending.capacity, sizeof(*pending.items));
+
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	start = loadgen_now_ns();
+	end = start + (uint64_t)(settings.duration * 1e9);
+	next_report = start + 1000000000ull;
+	next_window = start + (uint64_t)(settings.window * 1e9);
+	if (settings.rate > 0) {
+		interval = (uint64_t)(1e9 / settings.rate);
+		if (interval == 0) {
+			interval = 1;
+		}
+	}
+	next_due = start;
+
+	while ((now = loadgen_now_ns()) < end) {
+		int timeout = 100;
+
+		// open connections a batch at a time so the listen queue keeps up
+		for (n = 0; opened < settings.connections && n < CONNECTS_PER_PASS; n++, opened++) {
+			if (loadgen_connect(epfd, &server, opened) == 0) {
+				open++;
+			}
+			else {
+				stats->failed++;
+			}
+		}
+
+		// schedule every request that has come due
+		if (interval > 0) {
+			for (; next_due <= now; next_due += interval) {
+				if (queue_push(&pending, next_due) < 0) {
+					stats->backlogged++;
+				}
+			}
+			timeout = (int)((next_due - now) / 1000000);
+		}
+		if (opened < settings.connections) {
+			timeout = 0;
+		}
+
+		// hand due requests to idle connections
+		while (idle.count > 0 && (interval == 0 || pending.count > 0)) {
+			uint64_t due = interval > 0 ? queue_pop(&pending) : now;
+			i = (int)queue_pop(&idle);
+			if (loadgen_send(i, due) == 0) {
+				stats->sent++;
+			}
+			else {
+				loadgen_close(epfd, i);
+				open--;
+			}
+		}
+
+		n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		for (int e = 0; e < n; e++) {
+			Connection *c;
+			i = events[e].data.u32;
+			c = &connections[i];
+
+			if (c->state == CONN_CONNECTING) {
+				struct epoll_event ev;
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0 || (events[e].events & (EPOLLERR | EPOLLHUP))) {
+					stats->failed++;
+					loadgen_close(epfd, i);
+					open--;
+					continue;
+				}
+				write(c->fd, handshake, strlen(handshake));
+				c->state = CONN_HANDSHAKE;
+				ev.events = EPOLLIN;
+				ev.data.u32 = i;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+				continue;
+			}
+
+			if (loadgen_read(i, stats) < 0) {
+				if (debug.print) printf("connection %d closed\n", i);
+				loadgen_close(epfd, i);
+				open--;
+			}
+		}
+
+		// progress report, once a second
+		if (now >= next_report) {
+			fprintf(stderr, "%6.1fs  open %6d  sent %10llu  received %10llu  (%llu/s)\n",
+				(now - start) / 1e9, open,
+				(unsigned long long)stats->sent,
+				(unsigned long long)stats->received,
+				(unsigned long long)(stats->received - last_received));
+			last_received = stats->received;
+			next_report += 1000000000ull;
+			if (settings.verify) {
+				loadgen_check_stalls(opened, now, stats);
+			}
+		}
+
+		// throughput per window, for drift
+		if (now >= next_window) {
+			double rate = (stats->received - window_received) / settings.window;
+			windows_add(&stats->windows, rate);
+			fprintf(stderr, "window %d: %.1f/s\n", stats->windows.count, rate);
+			window_received = stats->received;
+			next_window += (uint64_t)(settings.window * 1e9);
+		}
+	}
+
+	for (i = 0; i < opened; i++) {
+		if (connections[i].state != CONN_CLOSED) {
+			close(connections[i].fd);
+		}
+	}
+	close(epfd);
+	free(connections);
+	free(idle.items);
+	free(pending.items);
+	return 0;
+}
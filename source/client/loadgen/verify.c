@@ -0,0 +1,91 @@
+/**
+ * @file
+ *
+ * Checks for long soak runs. In verify mode every response's resource id
+ * is marked in a bitmap, so a resource delivered twice is caught the
+ * moment it arrives, and ids that never arrived can be counted at the
+ * end. Throughput is also kept per window, so a slow drift over hours
+ * shows up next to any correctness problem.
+ */
+#include "loadgen.h"
+
+/**
+ * Mark the resource id in a "rid:N;produced_by:N;" response as seen
+ */
+void verify_record(Verify *v, const char *response) {
+	const char *rid = strstr(response, "rid:");
+	char *end;
+	long id;
+
+	if (rid == NULL) {
+		v->malformed++;
+		return;
+	}
+	id = strtol(rid + 4, &end, 10);
+	if (end == rid + 4 || *end != ';' || id < 0) {
+		v->malformed++;
+		return;
+	}
+
+	if ((uint64_t)id >= v->capacity) {
+		uint64_t capacity = v->capacity > 0 ? v->capacity : 1 << 20;
+		while (capacity <= (uint64_t)id) {
+			capacity *= 2;
+		}
+		v->seen = realloc(v->seen, capacity / 8);
+		memset(v->seen + v->capacity / 8, 0, (capacity - v->capacity) / 8);
+		v->capacity = capacity;
+	}
+
+	if (v->seen[id / 8] & (1 << (id % 8))) {
+		v->duplicates++;
+		fprintf(stderr, "resource %ld delivered more than once\n", id);
+		return;
+	}
+	v->seen[id / 8] |= 1 << (id % 8);
+	v->unique++;
+	if (id > v->max_rid) {
+		v->max_rid = id;
+	}
+}
+
+/**
+ * Return how many ids below the highest one seen never arrived. Some of
+ * these may simply have been in the buffer or in flight when the run
+ * ended, or been taken by another consumer.
+ */
+uint64_t verify_missing(Verify *v) {
+	if (v->unique == 0) {
+		return 0;
+	}
+	return (uint64_t)(v->max_rid + 1) - v->unique;
+}
+
+/**
+ * Add the throughput of one finished window
+ */
+void windows_add(Windows *w, double rate) {
+	if (w->count == w->capacity) {
+		w->capacity = w->capacity > 0 ? w->capacity * 2 : 64;
+		w->rates = realloc(w->rates, w->capacity * sizeof(*w->rates));
+	}
+	w->rates[w->count++] = rate;
+}
+
+/**
+ * Return the change in throughput from the first window to the last, as
+ * a percentage of the first. The first window includes startup, so when
+ * there are enough windows the second one is used as the baseline.
+ */
+double windows_drift(Windows *w) {
+	double base;
+
+	if (w->count < 2) {
+		return 0;
+	}
+	base = w->count > 2 ? w->rates[1] : w->rates[0];
+	if (base <= 0) {
+		return 0;
+	}
+	return 100.0 * (w->rates[w->count - 1] - base) / base;
+}
@@ -14,7 +14,7 @@
 #include <libxml/tree.h>
 
 // producer states
-static char *producer_states[] = { "sleep", "producing", "export", "waiting" };
+static char *producer_states[] = { "sleep", "producing", "export", "waiting", "throttled", "paused" };
 
 // consumer states
 static char *consumer_states[] = { "sleep", "hungry", "consuming" };
@@ -119,6 +119,7 @@ struct consumer {
 	xmlChar *id;
 	xmlChar *status;
 	xmlChar *resources_consumed;
+	xmlChar *cpu;
 };
 struct resource {
 	xmlChar *id;
@@ -128,6 +129,7 @@ struct producer {
 	xmlChar *id;
 	xmlChar *status;
 	xmlChar *count;
+	xmlChar *cpu;
 };
 
 /**
@@ -137,6 +139,7 @@ void monitor_xml_parse_consumer(xmlNode * a_node) {
 	int count = 0;
 	xmlNode *cur_node = NULL;
 	struct consumer *c = malloc(sizeof(*c));
+	c->cpu = NULL;
 	memset(consumer_line, '\0', sizeof(consumer_line));
 	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
 		if (cur_node->type == XML_ELEMENT_NODE) {
@@ -152,6 +155,10 @@ void monitor_xml_parse_consumer(xmlNode * a_node) {
 				c->resources_consumed = xmlNodeGetContent(cur_node);
 				count++;
 			}
+			// older servers don't report the cpu
+			if (strcmp(cur_node->name, "cpu") == 0) {
+				c->cpu = xmlNodeGetContent(cur_node);
+			}
 		}
 	}
 	if (count % 3 != 0) {
@@ -161,8 +168,9 @@ void monitor_xml_parse_consumer(xmlNode * a_node) {
 	if (count == 0) {
 		return;
 	}
-	sprintf_s(consumer_line, sizeof(consumer_line), "consumer %s:\n   resources consumed:%s\n   status: %s\n-----------\n",
-		c->id, c->resources_consumed, consumer_states[atoi(c->status)]);
+	sprintf_s(consumer_line, sizeof(consumer_line), "consumer %s:\n   resources consumed:%s\n   status: %s\n   cpu: %s\n-----------\n",
+		c->id, c->resources_consumed, consumer_states[atoi(c->status)], c->cpu != NULL ? (char *)c->cpu : "?");
+	xmlFree(c->cpu);
 	xmlFree(c->id);
 	xmlFree(c->resources_consumed);
 	xmlFree(c->status);
@@ -210,6 +218,7 @@ void monitor_xml_parse_producer(xmlNode * a_node) {
 	xmlNode *cur_node = NULL;
 	int count = 0;
 	struct producer *c = malloc(sizeof(*c));
+	c->cpu = NULL;
 	memset(producer_line, '\0', sizeof(producer_line));
 	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
 		if (cur_node->type == XML_ELEMENT_NODE) {
@@ -225,6 +234,10 @@ void monitor_xml_parse_producer(xmlNode * a_node) {
 				c->count = xmlNodeGetContent(cur_node);
 				count++;
 			}
+			// older servers don't report the cpu
+			if (strcmp(cur_node->name, "cpu") == 0) {
+				c->cpu = xmlNodeGetContent(cur_node);
+			}
 		}
 	}
 	if (count % 3 != 0) {
@@ -233,8 +246,9 @@ void monitor_xml_parse_producer(xmlNode * a_node) {
 	if (count == 0) {
 		return;
 	}
-	sprintf_s(producer_line, sizeof(producer_line), "producer %s:\n   resources produced:%s\n   status: %s\n-----------\n",
-		c->id, c->count, producer_states[atoi(c->status)]);
+	sprintf_s(producer_line, sizeof(producer_line), "producer %s:\n   resources produced:%s\n   status: %s\n   cpu: %s\n-----------\n",
+		c->id, c->count, producer_states[atoi(c->status)], c->cpu != NULL ? (char *)c->cpu : "?");
+	xmlFree(c->cpu);
 	xmlFree(c->id);
 	xmlFree(c->count);
 	xmlFree(c->status);
@@ -262,15 +276,24 @@ void monitor_xml_parse_consumers(xmlNode * a_node) {
 }
 
 /**
-* Parse a <buffer> into the buffer_report buffer
+* Parse a <buffer> into the buffer_report buffer. The server sends one
+* <buffer> per topic, so each is appended under its topic's name.
 */
-void monitor_xml_parse_buffer(xmlNode * a_node) {
+void monitor_xml_parse_buffer(xmlNode * buffer_node) {
+	xmlNode *a_node = buffer_node->children;
+	xmlChar *name = xmlGetProp(buffer_node, BAD_CAST "name");
+	char header[256];
+
+	// older servers have a single buffer with no name
+	if (name != NULL) {
+		sprintf_s(header, sizeof(header), "topic %s:\n", (char *)name);
+		strcat_s(buffer_report, sizeof(buffer_report), header);
+		xmlFree(name);
+	}
 	if (a_node == NULL) {
-		memset(buffer_report, '\0', sizeof(buffer_report));
-		strcat_s(buffer_report, sizeof(buffer_report), "No resources.");
+		strcat_s(buffer_report, sizeof(buffer_report), "No resources.\n");
 	}
 	else {
-		memset(buffer_report, '\0', sizeof(buffer_report));
 		xmlNode *cur_node = NULL;
 		for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
 			if (cur_node->type == XML_ELEMENT_NODE) {
@@ -320,7 +343,7 @@ void monitor_xml_parse_report_recursive(xmlNode * a_node)
 				monitor_xml_parse_consumers(cur_node->children);
 			}
 			if (strcmp(cur_node->name, "buffer") == 0) {
-				monitor_xml_parse_buffer(cur_node->children);
+				monitor_xml_parse_buffer(cur_node);
 			}
 			if (strcmp(cur_node->name, "producers") == 0) {
 				monitor_xml_parse_producers(cur_node->children);
@@ -361,7 +384,8 @@ int monitor_xml_parse_report(char *message) {
 	// get the root element node
 	root_element = xmlDocGetRootElement(doc);
 
-	// parse the XML into char arrays
+	// parse the XML into char arrays; topics' buffers are appended in turn
+	memset(buffer_report, '\0', sizeof(buffer_report));
 	monitor_xml_parse_report_recursive(root_element);
 
 	// update the view panes
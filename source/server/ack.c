@@ -0,0 +1,199 @@
+/**
+ * @file
+ *
+ * Acknowledgements make delivery to clients at-least-once. In ack mode a
+ * resource written to a client isn't freed: it goes into the in-flight
+ * table until the client acks it with "ack:<id>[,<id>...];". If the ack
+ * doesn't come within ackTimeout, or the client disconnects first, the
+ * resource goes back to the head of its buffer to be delivered again.
+ * In a partitioned buffer its partition stays busy until then, so the
+ * rest of its key waits behind it (see partition.c).
+ *
+ * The in-flight table is split into INFLIGHT_SHARDS shards by resource
+ * id, each with its own lock on its own cache line, so acks from many
+ * consumers neither contend with each other nor touch a buffer's mutex.
+ * Only redelivery takes the buffer's mutex, to put a resource back.
+ *
+ * A reaper thread sweeps the table every quarter of ackTimeout for
+ * resources whose deadline has passed, so a resource is redelivered
+ * between ackTimeout and 1.25 ackTimeout after it was delivered.
+ */
+
+#include "server.h"
+
+#define INFLIGHT_SHARDS 64
+#define INFLIGHT_BUCKETS 256
+
+// resources in flight, hashed by id and chained through their next
+static struct {
+    pthread_mutex_t mutex;
+    int count;  // updated under the mutex, read without it
+    Resource *buckets[INFLIGHT_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) inflight[INFLIGHT_SHARDS];
+
+/**
+ * Return the bucket that a resource id hashes to, in its shard.
+ */
+static Resource **inflight_bucket(int id) {
+    unsigned u = (unsigned)id;
+    return &inflight[u % INFLIGHT_SHARDS].buckets[(u / INFLIGHT_SHARDS) % INFLIGHT_BUCKETS];
+}
+
+/**
+ * Put a list of resources, linked by next, back in their buffers.
+ */
+static void inflight_requeue(Resource *list) {
+    Resource *r;
+    ResourceBuffer *rb;
+
+    while ((r = list) != NULL) {
+        list = r->next;
+        rb = r->bufferp;
+        pthread_mutex_lock(&rb->mutex);
+        resource_buffer_requeue(rb, r);
+        counter_add(&serverCounters->redelivered.value, 1);
+        if (rb->partitions == 0) {
+            pthread_cond_signal(&rb->notEmpty);
+        }
+        pthread_mutex_unlock(&rb->mutex);
+    }
+}
+
+/**
+ * Hold a resource that was just delivered to a client until the client
+ * acks it. The caller must not touch the resource afterwards: once it is
+ * in the table, another thread may redeliver or free it.
+ */
+void inflight_add(ConsumerService *cs, Resource *r) {
+    int shard = (unsigned)r->id % INFLIGHT_SHARDS;
+    Resource **bucket = inflight_bucket(r->id);
+
+    r->consumed_by = cs->id;
+    r->bufferp = cs->bufferp;
+    r->deadline = monotonic_ns() + ackTimeout;
+    pthread_mutex_lock(&inflight[shard].mutex);
+    r->next = *bucket;
+    *bucket = r;
+    __atomic_add_fetch(&inflight[shard].count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&inflight[shard].mutex);
+}
+
+/**
+ * Ack a resource delivered to the consumer, and free it. Returns -1 if
+ * the consumer doesn't hold it, because it was never delivered to this
+ * consumer or because it has already been put back for redelivery.
+ */
+int inflight_ack(ConsumerService *cs, int id) {
+    int shard = (unsigned)id % INFLIGHT_SHARDS;
+    Resource **rp, *r;
+
+    pthread_mutex_lock(&inflight[shard].mutex);
+    for (rp = inflight_bucket(id); (r = *rp) != NULL; rp = &r->next) {
+        if (r->id == id && r->consumed_by == cs->id) {
+            *rp = r->next;
+            __atomic_sub_fetch(&inflight[shard].count, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inflight[shard].mutex);
+
+    if (r == NULL) {
+        log_debug("CS-%d acked r%d, which it doesn't hold", cs->id, id);
+        return -1;
+    }
+    counter_add(&serverCounters->acked.value, 1);
+    partition_ack(r->bufferp, r);
+    wal_consume(r->bufferp, r);
+    free(r);
+    return 0;
+}
+
+/**
+ * Take the resources that match out of the table: the ones held by the
+ * given consumer, or if cs is NULL the ones whose deadline is before now.
+ * Returns them as a list linked by next.
+ */
+static Resource *inflight_take(ConsumerService *cs, uint64_t now) {
+    Resource *list = NULL, **rp, *r;
+    int shard, bucket;
+
+    for (shard = 0; shard < INFLIGHT_SHARDS; shard++) {
+        if (__atomic_load_n(&inflight[shard].count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        pthread_mutex_lock(&inflight[shard].mutex);
+        for (bucket = 0; bucket < INFLIGHT_BUCKETS; bucket++) {
+            rp = &inflight[shard].buckets[bucket];
+            while ((r = *rp) != NULL) {
+                if (cs != NULL ? r->consumed_by != cs->id : r->deadline > now) {
+                    rp = &r->next;
+                    continue;
+                }
+                *rp = r->next;
+                __atomic_sub_fetch(&inflight[shard].count, 1, __ATOMIC_RELAXED);
+                r->next = list;
+                list = r;
+            }
+        }
+        pthread_mutex_unlock(&inflight[shard].mutex);
+    }
+    return list;
+}
+
+/**
+ * Put every resource a consumer holds back for redelivery. Called when
+ * the consumer disconnects.
+ */
+void inflight_requeue_consumer(ConsumerService *cs) {
+    inflight_requeue(inflight_take(cs, 0));
+}
+
+/**
+ * Return the number of resources in flight.
+ */
+int inflight_count() {
+    int shard, count = 0;
+
+    for (shard = 0; shard < INFLIGHT_SHARDS; shard++) {
+        count += __atomic_load_n(&inflight[shard].count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+/**
+ * Reaper loop. Puts back resources whose ack is overdue.
+ */
+static void *ack_reaper_handler(void *unused) {
+    uint64_t period = ackTimeout / 4 > 1000000 ? ackTimeout / 4 : 1000000;
+    Resource *list;
+
+    while (1) {
+        delay_sleep_ns(period);
+        if ((list = inflight_take(NULL, monotonic_ns())) != NULL) {
+            log_debug("ack timeout: redelivering r%d and any others", list->id);
+            inflight_requeue(list);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Set up the in-flight table and start the reaper, if ackTimeout is set.
+ */
+int ack_start() {
+    pthread_t thread;
+    int shard;
+
+    for (shard = 0; shard < INFLIGHT_SHARDS; shard++) {
+        pthread_mutex_init(&inflight[shard].mutex, NULL);
+    }
+    if (ackTimeout == 0) {
+        return 0;
+    }
+    if (pthread_create(&thread, NULL, ack_reaper_handler, NULL) < 0) {
+        log_error("could not create ack reaper thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file
+ *
+ * The AdminService lets an operator tune the server while it runs. An
+ * admin connects with "handshake:admin" and then sends one command per
+ * line, each answered with "ok" or "error: <reason>":
+ *
+ *   set <name> <delay>   change produceDelay, producerRest, consumeDelay
+ *                        or consumerRest; <delay> is anything accepted
+ *                        on the command line, e.g. "250ms" or "exp:10ms"
+ *   trace on|off         log at trace level, or go back to the level
+ *                        logged at before
+ *   pause                hold every producer before its next batch
+ *   resume               let paused producers carry on
+ *   resize <n>           resize the buffer
+ *   show                 list the current settings, one per line
+ *
+ * New delays are published with delay_publish(), so producers and
+ * consumers pick them up at their next delay without any lock.
+ */
+
+#include "server.h"
+#include <unistd.h>
+
+// serializes commands from concurrent admin connections
+static pthread_mutex_t adminMutex = PTHREAD_MUTEX_INITIALIZER;
+// the log level to go back to when tracing is turned off, or -1
+static int untracedLevel = -1;
+
+static struct {
+    const char *name;
+    Delay *delay;
+} tunables[] = {
+    { "produceDelay", &produceDelay },
+    { "producerRest", &producerRest },
+    { "consumeDelay", &consumeDelay },
+    { "consumerRest", &consumerRest },
+};
+
+/**
+ * Write a reply to the admin.
+ */
+static void admin_reply(int sock, const char *reply) {
+    write(sock, reply, strlen(reply));
+}
+
+/**
+ * Write the current settings to the admin.
+ */
+static void admin_show(int sock) {
+    ResourceBuffer *rb = globalResourceBuffer;
+    char line[128], delay[48];
+    size_t i;
+    int size;
+
+    for (i = 0; i < sizeof(tunables) / sizeof(tunables[0]); i++) {
+        snprintf(line, sizeof(line), "%s %s\n", tunables[i].name,
+            delay_format(tunables[i].delay, delay, sizeof(delay)));
+        admin_reply(sock, line);
+    }
+    pthread_mutex_lock(&rb->mutex);
+    size = rb->size;
+    pthread_mutex_unlock(&rb->mutex);
+    snprintf(line, sizeof(line), "bufferSize %d\ntrace %s\npaused %d\n", size,
+        untracedLevel >= 0 ? "on" : "off",
+        atomic_load_explicit(&producersPaused, memory_order_relaxed));
+    admin_reply(sock, line);
+}
+
+/**
+ * Run one command line. Returns the reply.
+ */
+static const char *admin_command(int sock, char *line) {
+    char *cmd, *arg, *value, *save;
+    size_t i;
+    Delay d;
+    char formatted[48];
+
+    if ((cmd = strtok_r(line, " \t\r", &save)) == NULL) {
+        return NULL;
+    }
+    arg = strtok_r(NULL, " \t\r", &save);
+    value = strtok_r(NULL, " \t\r", &save);
+
+    if (strcmp(cmd, "set") == 0) {
+        for (i = 0; i < sizeof(tunables) / sizeof(tunables[0]); i++) {
+            if (arg != NULL && strcmp(arg, tunables[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(tunables) / sizeof(tunables[0])) {
+            return "error: unknown setting\n";
+        }
+        if (value == NULL || delay_parse(value, &d) < 0) {
+            return "error: invalid delay\n";
+        }
+        delay_publish(tunables[i].delay, &d);
+        log_info("admin set %s to %s", tunables[i].name,
+            delay_format(&d, formatted, sizeof(formatted)));
+        return "ok\n";
+    }
+    if (strcmp(cmd, "trace") == 0) {
+        if (arg != NULL && strcmp(arg, "on") == 0) {
+            if (untracedLevel < 0) {
+                untracedLevel = atomic_exchange(&logLevel, LOG_LEVEL_TRACE);
+            }
+            return "ok\n";
+        }
+        if (arg != NULL && strcmp(arg, "off") == 0) {
+            if (untracedLevel >= 0) {
+                atomic_store(&logLevel, untracedLevel);
+                untracedLevel = -1;
+            }
+            return "ok\n";
+        }
+        return "error: expected on or off\n";
+    }
+    if (strcmp(cmd, "pause") == 0) {
+        producer_pause(1);
+        log_info("admin paused producers");
+        return "ok\n";
+    }
+    if (strcmp(cmd, "resume") == 0) {
+        producer_pause(0);
+        log_info("admin resumed producers");
+        return "ok\n";
+    }
+    if (strcmp(cmd, "resize") == 0) {
+        int size = arg != NULL ? atoi(arg) : 0;
+        if (size < 1) {
+            return "error: invalid size\n";
+        }
+        reset(size);
+        return "ok\n";
+    }
+    if (strcmp(cmd, "show") == 0) {
+        admin_show(sock);
+        return "ok\n";
+    }
+    return "error: unknown command\n";
+}
+
+/**
+ * Thread handler for an admin connection. Reads command lines until the
+ * admin disconnects.
+ */
+static void *admin_service_connection_handler(void *sockp) {
+    int sock = (int)(intptr_t)sockp;
+    char buff[1025], *line, *end;
+    const char *reply;
+    int used = 0, recvSize;
+
+    admin_reply(sock, "handshake:admin");
+
+    while ((recvSize = read(sock, buff + used, sizeof(buff) - 1 - used)) > 0) {
+        used += recvSize;
+        buff[used] = '\0';
+
+        // run every complete line, and keep the rest for the next read
+        line = buff;
+        while ((end = strchr(line, '\n')) != NULL) {
+            *end = '\0';
+            pthread_mutex_lock(&adminMutex);
+            reply = admin_command(sock, line);
+            pthread_mutex_unlock(&adminMutex);
+            if (reply != NULL) {
+                admin_reply(sock, reply);
+            }
+            line = end + 1;
+        }
+        used -= line - buff;
+        memmove(buff, line, used);
+        if (used == sizeof(buff) - 1) {
+            admin_reply(sock, "error: line too long\n");
+            used = 0;
+        }
+    }
+
+    log_trace("admin disconnect");
+    close(sock);
+    return NULL;
+}
+
+/**
+ * Start a thread to serve a new admin connection.
+ */
+int admin_service_new(Environment *env, int client_sock) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, admin_service_connection_handler,
+        (void *)(intptr_t)client_sock) != 0) {
+        log_error("could not create admin service thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
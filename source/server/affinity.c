@@ -0,0 +1,251 @@
+/**
+ * @file
+ *
+ * Affinity places the server's threads on cores. Cores are split into
+ * housekeeping cores, for the threads that only watch the server (logging,
+ * metrics, monitors, the watchdog and the like), and worker cores, for
+ * producers and consumers, which touch the buffer. The placement policy
+ * decides how workers use their cores:
+ *
+ *   none     threads float freely (the default)
+ *   spread   each producer and consumer is pinned to one worker core,
+ *            round-robin over all of them
+ *   compact  as spread, but only over the worker cores on the NUMA node
+ *            of the first one, so the buffer and the resources in it
+ *            stay in one node's caches and memory
+ *   split    producers share the first half of the worker cores and
+ *            consumers the second half, so the two sides don't preempt
+ *            each other
+ *
+ * The main thread pins itself to the housekeeping cores before it starts
+ * any other thread, so every thread starts there, and producers and
+ * consumers move themselves to worker cores with affinity_place().
+ * Threads they start for housekeeping move back with affinity_housekeep().
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include "server.h"
+
+static struct {
+    // worker cores, in the order they are handed out
+    int *cpus;
+    int count;
+    // the split between producer and consumer cores
+    int producers;
+    cpu_set_t housekeeping;
+} placement;
+
+/**
+ * Parse a cpu list such as "0", "0-3" or "0,2,4-7" into a cpu_set_t.
+ * Returns -1 if the string isn't a cpu list.
+ */
+static int cpulist_parse(const char *s, cpu_set_t *set) {
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    while (*s != '\0' && *s != '\n') {
+        first = strtol(s, &end, 10);
+        if (end == s || first < 0) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) {
+                return -1;
+            }
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        s = end;
+        if (*s == ',') {
+            s++;
+        }
+        else if (*s != '\0' && *s != '\n') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/**
+ * Parse a placement policy name. Returns -1 for an unknown policy.
+ */
+int affinity_parse(const char *s) {
+    if (strcmp(s, "none") == 0) {
+        affinity.policy = AFFINITY_NONE;
+    }
+    else if (strcmp(s, "spread") == 0) {
+        affinity.policy = AFFINITY_SPREAD;
+    }
+    else if (strcmp(s, "compact") == 0) {
+        affinity.policy = AFFINITY_COMPACT;
+    }
+    else if (strcmp(s, "split") == 0) {
+        affinity.policy = AFFINITY_SPLIT;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the cores of the NUMA node that the given cpu belongs to. Without
+ * NUMA information in sysfs, every core counts as one node.
+ */
+static void affinity_node_cpus(int cpu, cpu_set_t *node) {
+    char path[64], line[1024];
+    FILE *f;
+    int n;
+
+    for (n = 0; n < 1024; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if ((f = fopen(path, "r")) == NULL) {
+            break;
+        }
+        if (fgets(line, sizeof(line), f) != NULL && cpulist_parse(line, node) == 0
+            && CPU_ISSET(cpu, node)) {
+            fclose(f);
+            return;
+        }
+        fclose(f);
+    }
+    CPU_ZERO(node);
+    for (n = 0; n < CPU_SETSIZE; n++) {
+        CPU_SET(n, node);
+    }
+}
+
+/**
+ * Work out the housekeeping and worker cores for the chosen policy, and
+ * move the calling thread to the housekeeping cores. Called by the main
+ * thread before it starts any other thread.
+ */
+int affinity_init() {
+    cpu_set_t allowed, housekeeping, node;
+    int cpu;
+
+    if (affinity.policy == AFFINITY_NONE) {
+        return 0;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+
+    // by default the first core does the housekeeping, if there is more
+    // than one
+    if (affinity.housekeeping != NULL) {
+        if (cpulist_parse(affinity.housekeeping, &housekeeping) < 0) {
+            fprintf(stderr, "invalid housekeeping cpu list: %s\n", affinity.housekeeping);
+            return -1;
+        }
+    }
+    else {
+        CPU_ZERO(&housekeeping);
+        for (cpu = 0; cpu < CPU_SETSIZE && CPU_COUNT(&allowed) > 1; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                CPU_SET(cpu, &housekeeping);
+                break;
+            }
+        }
+    }
+    CPU_AND(&placement.housekeeping, &housekeeping, &allowed);
+
+    // workers get whatever is left
+    placement.cpus = malloc(CPU_SETSIZE * sizeof(*placement.cpus));
+    placement.count = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &placement.housekeeping)) {
+            placement.cpus[placement.count++] = cpu;
+        }
+    }
+    if (placement.count == 0) {
+        // too few cores to set any aside; everything shares them
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                placement.cpus[placement.count++] = cpu;
+            }
+        }
+    }
+    if (CPU_COUNT(&placement.housekeeping) == 0) {
+        // and housekeeping threads float over all of them
+        placement.housekeeping = allowed;
+    }
+
+    // compact keeps only the worker cores on the first one's node
+    if (affinity.policy == AFFINITY_COMPACT) {
+        int i, n = 0;
+        affinity_node_cpus(placement.cpus[0], &node);
+        for (i = 0; i < placement.count; i++) {
+            if (CPU_ISSET(placement.cpus[i], &node)) {
+                placement.cpus[n++] = placement.cpus[i];
+            }
+        }
+        placement.count = n;
+    }
+    placement.producers = placement.count > 1 ? placement.count / 2 : placement.count;
+
+    if (CPU_COUNT(&placement.housekeeping) > 0
+        && pthread_setaffinity_np(pthread_self(), sizeof(placement.housekeeping), &placement.housekeeping) != 0) {
+        log_error("could not move to the housekeeping cores");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Move the calling thread to its worker cores. A producer or consumer
+ * passes its id to pick its core; task workers pass their index.
+ */
+void affinity_place(int role, int index) {
+    cpu_set_t set;
+    int i, first = 0, count = placement.count;
+
+    if (affinity.policy == AFFINITY_NONE || count == 0) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    if (affinity.policy == AFFINITY_SPLIT) {
+        // producers take the first part, consumers the rest
+        if (count > 1) {
+            first = role == AFFINITY_PRODUCER ? 0 : placement.producers;
+            count = role == AFFINITY_PRODUCER ? placement.producers : count - placement.producers;
+        }
+        for (i = first; i < first + count; i++) {
+            CPU_SET(placement.cpus[i], &set);
+        }
+    }
+    else {
+        CPU_SET(placement.cpus[index % count], &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        log_error("could not set the affinity of %s %d",
+            role == AFFINITY_PRODUCER ? "producer" : "consumer", index);
+    }
+}
+
+/**
+ * Move the calling thread to the housekeeping cores. For threads that are
+ * started by producers or consumers but only watch the server, such as
+ * monitor pushes, which would otherwise inherit a worker core.
+ */
+void affinity_housekeep() {
+    if (affinity.policy == AFFINITY_NONE || CPU_COUNT(&placement.housekeeping) == 0) {
+        return;
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(placement.housekeeping), &placement.housekeeping);
+}
+
+/**
+ * Return the core the calling thread is running on, or -1 if unknown.
+ */
+int affinity_cpu() {
+    return sched_getcpu();
+}
@@ -0,0 +1,158 @@
+/**
+ * @file
+ *
+ * The autoscaler adds and retires producers at runtime to match demand.
+ * Every autoscale.interval it looks at how full the buffer is and whether
+ * consumers had to wait for resources:
+ *
+ *   - the buffer is under AUTOSCALE_LOW full and consumers are waiting:
+ *     production can't keep up, so add a producer
+ *   - the buffer is over AUTOSCALE_HIGH full and no consumer waited:
+ *     producers are idling on a full buffer, so retire one
+ *
+ * A condition must hold for AUTOSCALE_STREAK intervals in a row before
+ * the autoscaler acts, and after each change it waits AUTOSCALE_COOLDOWN
+ * intervals for the buffer to settle, so that it doesn't flap. The
+ * producer count stays between autoscale.min and autoscale.max.
+ *
+ * The autoscaler looks after the default topic only; producers and
+ * consumers of named topics are left alone.
+ */
+
+#include "server.h"
+
+// buffer occupancy thresholds, in percent
+#define AUTOSCALE_LOW 25
+#define AUTOSCALE_HIGH 75
+// intervals a condition must hold before acting
+#define AUTOSCALE_STREAK 3
+// intervals to wait after a change
+#define AUTOSCALE_COOLDOWN 2
+
+/**
+ * Return the number of times consumers have waited for a resource, and set
+ * waiting if a consumer of the given topic is waiting right now.
+ */
+static uint64_t autoscale_consumer_waits(ResourceBuffer *rb, int *waiting) {
+    uint64_t waits;
+    ConsumerService *cs;
+
+    *waiting = 0;
+    pthread_mutex_lock(&consumerListMutex);
+    waits = counter_get(&serverCounters->consumer_waits_retired.value);
+    for (cs = consumerList->head; cs != NULL; cs = cs->next) {
+        if (cs->bufferp != rb) {
+            continue;
+        }
+        waits += counter_get(&cs->counters->waits);
+        if (atomic_load_explicit(&cs->waiting_since, memory_order_relaxed) != 0) {
+            *waiting = 1;
+        }
+    }
+    pthread_mutex_unlock(&consumerListMutex);
+    return waits;
+}
+
+/**
+ * Retire the given topic's newest producer that isn't already retiring.
+ * Returns -1 if there is none.
+ */
+static int autoscale_retire_one(ResourceBuffer *rb) {
+    Producer *p;
+
+    pthread_mutex_lock(&producerListMutex);
+    for (p = producerList->tail; p != NULL; p = p->prev) {
+        if (p->bufferp == rb && !atomic_load_explicit(&p->retiring, memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (p == NULL) {
+        pthread_mutex_unlock(&producerListMutex);
+        return -1;
+    }
+    // the producer can't free itself while we hold the list
+    producer_retire(p);
+    pthread_mutex_unlock(&producerListMutex);
+    return 0;
+}
+
+/**
+ * Return the number of the given topic's producers that are not retiring.
+ */
+static int autoscale_active_producers(ResourceBuffer *rb) {
+    Producer *p;
+    int count = 0;
+
+    pthread_mutex_lock(&producerListMutex);
+    for (p = producerList->head; p != NULL; p = p->next) {
+        if (p->bufferp == rb && !atomic_load_explicit(&p->retiring, memory_order_relaxed)) {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&producerListMutex);
+    return count;
+}
+
+/**
+ * Autoscaler loop.
+ */
+void *autoscale_handler(void *rbp) {
+    ResourceBuffer *rb = (ResourceBuffer *)rbp;
+    uint64_t waits, last_waits;
+    int up = 0, down = 0, cooldown = 0, waiting, occupancy, active;
+
+    last_waits = autoscale_consumer_waits(rb, &waiting);
+    while (1) {
+        delay_sleep_ns(autoscale.interval);
+
+        occupancy = 100 * __atomic_load_n(&rb->count, __ATOMIC_RELAXED) / rb->size;
+        waits = autoscale_consumer_waits(rb, &waiting);
+        waiting = waiting || waits != last_waits;
+        last_waits = waits;
+
+        // count how long each condition has held
+        up = occupancy < AUTOSCALE_LOW && waiting ? up + 1 : 0;
+        down = occupancy > AUTOSCALE_HIGH && !waiting ? down + 1 : 0;
+        if (cooldown > 0) {
+            cooldown--;
+            continue;
+        }
+
+        active = autoscale_active_producers(rb);
+        if (up >= AUTOSCALE_STREAK && active < autoscale.max) {
+            log_info("autoscale: buffer %d%% full with consumers waiting, adding a producer (%d)",
+                occupancy, active + 1);
+            producer_new(rb);
+        }
+        else if (down >= AUTOSCALE_STREAK && active > autoscale.min) {
+            log_info("autoscale: buffer %d%% full with no consumer waiting, retiring a producer (%d)",
+                occupancy, active - 1);
+            if (autoscale_retire_one(rb) < 0) {
+                continue;
+            }
+        }
+        else {
+            continue;
+        }
+        up = down = 0;
+        cooldown = AUTOSCALE_COOLDOWN;
+    }
+    return NULL;
+}
+
+/**
+ * Start the autoscaler thread, if autoscale.max is set.
+ */
+int autoscale_start(ResourceBuffer *rb) {
+    pthread_t thread;
+
+    if (autoscale.max == 0) {
+        return 0;
+    }
+    if (pthread_create(&thread, NULL, autoscale_handler, (void *)rb) < 0) {
+        log_error("could not create autoscale thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -20,6 +20,20 @@
 
 int connection_handshake(Environment *, int);
 
+/**
+ * Whether the peer of a connected socket is on the loopback interface.
+ */
+static int connection_is_loopback(int sock) {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+
+    if (getpeername(sock, (struct sockaddr *)&peer, &len) < 0
+        || peer.sin_family != AF_INET) {
+        return 0;
+    }
+    return (ntohl(peer.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+}
+
 /**
  * Primary server listener loop.
  * Wait infinitely for connections to the server (until an error occurs)
@@ -27,6 +41,7 @@ int connection_handshake(Environment *, int);
  */
 int server_listen(Environment *env) {
     struct sockaddr_in server;
+    int opt = 1;
      
     // create the socket
     env->socket_desc = socket(AF_INET, SOCK_STREAM, 0);
@@ -34,6 +49,9 @@ int server_listen(Environment *env) {
         if (debug.print) puts("Could not create socket");
     }
     if (debug.print) puts("Socket created");
+
+    // allow a restarted server to rebind while old connections linger
+    setsockopt(env->socket_desc, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
      
     // prepare the sockaddr_in structure
     server.sin_family = AF_INET;
@@ -48,23 +66,70 @@ int server_listen(Environment *env) {
     }
     if (debug.print) puts("bind done");
      
-    // listen
-    listen(env->socket_desc, 3);
+    // listen, with room for bursts of connections from load generators
+    listen(env->socket_desc, SOMAXCONN);
     if (debug.print) puts("Waiting for incoming connections...");
 
 
     // let user know we have a connection
+    char consume_delay[48], consumer_rest[48], produce_delay[48], producer_rest[48];
     printf("Server process listening on port %d\n"
         "Buffer size:%8d\n"
         "Producers:%10d\n"
-        "Consumption time:%3d\n"
-        "Consumer rest:%6d\n"
-        "Production time:%4d\n"
-        "Producer rest:%6d\n"
-        "Debugging:%10d\n",
-        APPLICATION_PORT, bufferSize, numProducers,
-        consumeDelay, consumerRest, produceDelay, producerRest,
-        debug.print);
+        "Virtual consumers:%2d\n"
+        "Consumption time: %s\n"
+        "Consumer rest: %s\n"
+        "Production time: %s\n"
+        "Producer rest: %s\n"
+        "Debugging:%10d\n"
+        "Metrics port:%7d\n",
+        APPLICATION_PORT, bufferSize, numProducers, virtualConsumers,
+        delay_format(&consumeDelay, consume_delay, sizeof(consume_delay)),
+        delay_format(&consumerRest, consumer_rest, sizeof(consumer_rest)),
+        delay_format(&produceDelay, produce_delay, sizeof(produce_delay)),
+        delay_format(&producerRest, producer_rest, sizeof(producer_rest)),
+        debug.print, METRICS_PORT);
+    if (stats_name() != NULL) {
+        printf("Stats page: /dev/shm%s\n", stats_name());
+    }
+    if (productionRate.rate > 0) {
+        printf("Production rate: %.0f/s\n", productionRate.rate);
+    }
+    if (producerRate.rate > 0) {
+        printf("Producer rate: %.0f/s\n", producerRate.rate);
+    }
+    if (affinity.policy != AFFINITY_NONE) {
+        static const char *policies[] = { "none", "spread", "compact", "split" };
+        printf("Affinity: %s\n", policies[affinity.policy]);
+    }
+    if (partitionCount > 0) {
+        printf("Partitions:%9d\n", partitionCount);
+    }
+    if (ackTimeout > 0) {
+        char ack_timeout[48];
+        Delay d = { 0 };
+        delay_set(&d, ackTimeout);
+        printf("Ack timeout: %s\n", delay_format(&d, ack_timeout, sizeof(ack_timeout)));
+    }
+    if (wal.path != NULL) {
+        printf("Write-ahead log: %s\n", wal.path);
+    }
+    if (replication.port > 0) {
+        printf("Replication port: %d\n", replication.port);
+    }
+    if (produceBatch > 1) {
+        printf("Batch size:%9d\n", produceBatch);
+    }
+    if (producerTasks.workers > 0) {
+        printf("Producer workers:%3d\n", producerTasks.workers);
+    }
+    if (autoscale.max > 0) {
+        printf("Autoscaling:%5d to %d producers\n", autoscale.min, autoscale.max);
+    }
+    ResourceBuffer *rb;
+    for (rb = topics->next; rb != NULL; rb = rb->next) {
+        printf("Topic %s: buffer size %d, %d producers\n", rb->name, rb->size, rb->producers);
+    }
 
     // accept incoming connections forever (until error occurs)
     int client_sock;
@@ -101,6 +166,7 @@ int connection_handshake(Environment *env, int client_sock) {
     if (recvSize == 0) {
         // Client has disconnected
         if (debug.print) printf("Client disconnect\n");
+        close(client_sock);
         return -1;
     }
     else if (recvSize < 0) {
@@ -110,13 +176,24 @@ int connection_handshake(Environment *env, int client_sock) {
     }
     else {
         if( strcmp(recvBuff,"handshake:consumer") == 0 ) {
-            // incoming connection is new consumer
-            return consumer_service_new(env, client_sock);
+            // incoming connection is new consumer of the default topic
+            return consumer_service_new(env, client_sock, env->bufferp);
+        }
+        else if( strncmp(recvBuff,"handshake:consumer:",19) == 0
+            && resource_buffer_find(recvBuff + 19) != NULL ) {
+            // incoming connection is new consumer of a named topic
+            return consumer_service_new(env, client_sock, resource_buffer_find(recvBuff + 19));
         }
         else if( strcmp(recvBuff,"handshake:monitor") == 0 ) {
             // incoming connection is new monitor
             return monitor_service_new(env, client_sock);
         }
+        else if( strcmp(recvBuff,"handshake:admin") == 0
+            && connection_is_loopback(client_sock) ) {
+            // incoming connection is an admin tuning the server, which is
+            // only accepted from this host
+            return admin_service_new(env, client_sock);
+        }
         else {
             if (debug.print) printf("invalid request from client:\n%s\n", recvBuff);
             message = "invalid request\n";
@@ -7,29 +7,33 @@
  */
 
 #include "server.h"
-
-enum { SLEEPING, HUNGRY, CONSUMING };
+#include <unistd.h>
 
 int consumer_service_await_and_handle_message(ConsumerService*);
+int consumer_service_consume(ConsumerService*);
 void *consumer_service_connection_handler(void *);
+void *consumer_service_virtual_handler(void *);
+static int consumer_service_take_partitioned(ConsumerService *, Resource **, uint64_t *);
+static int consumer_service_handle_tokens(ConsumerService *, char *, int);
 
 /**
  * Create a new ConsumerService struct, and begin the corresponding thread.
  * This new struct is added to the global linked list of ConsumerService
  * structs.  This is a doubly-linked list with a tail. The list helps us
  * track any existing consumer connections.
+ *
+ * A client_sock of -1 starts a virtual consumer: an in-process thread that
+ * takes resources from the buffer on its own, without a client. The
+ * consumer takes resources from the given topic's buffer.
  */
-int consumer_service_new(Environment *env, int client_sock) {
-    ConsumerService *cs = malloc(sizeof(*cs));
-    cs->client_sock = client_sock;
-    cs->env = env;
-    cs->id = consumerList->idx++;
-    cs->status = SLEEPING;
-    cs->resources_consumed = 0;
-    if (debug.print) printf("consumer service struct ready\n");
-
-    if( pthread_create(&(cs->thread), NULL, consumer_service_connection_handler, (void*)cs) < 0) {
-        if (debug.print) printf("could not create consumer service thread\n");
+int consumer_service_new(Environment *env, int client_sock, ResourceBuffer *rb) {
+    void *(*handler)(void *);
+    ConsumerService *cs = consumer_service_init(env, client_sock, rb);
+
+    handler = client_sock < 0 ? consumer_service_virtual_handler : consumer_service_connection_handler;
+    if( pthread_create(&(cs->thread), NULL, handler, (void*)cs) < 0) {
+        log_error("could not create consumer service thread");
+        thread_counters_free(cs->counters);
         free(cs);
         return -1;
     }
@@ -37,10 +41,43 @@ int consumer_service_new(Environment *env, int client_sock) {
     // notify of new consumer
     monitor_push_reports();
 
-    if (debug.print) puts("consumer service handler assigned");
+    log_trace("consumer service handler assigned");
     return 0;
 }
 
+/**
+ * Allocate and initialize a ConsumerService struct, without starting
+ * a thread for it or adding it to the consumerList.
+ */
+ConsumerService *consumer_service_init(Environment *env, int client_sock, ResourceBuffer *rb) {
+    ConsumerService *cs = malloc(sizeof(*cs));
+    cs->client_sock = client_sock;
+    cs->bufferp = rb;
+    cs->next = NULL;
+    cs->prev = NULL;
+    cs->env = env;
+    cs->id = consumerList->idx++;
+    cs->resources_consumed = 0;
+    cs->waiting_since = 0;
+    cs->partition = -1;
+    pthread_cond_init(&cs->partitionReady, NULL);
+    cs->counters = thread_counters_new(STATS_CONSUMER, cs->id);
+    delay_state_init(&cs->delays, monotonic_ns() ^ ((uint64_t)cs->id << 32) ^ 0x5bd1e995);
+    consumer_service_set_status(cs, SLEEPING);
+    counter_add(&serverCounters->consumer_connections.value, 1);
+    log_trace("consumer service struct ready");
+    return cs;
+}
+
+/**
+ * Set the ConsumerService's status, and publish it in the stats page.
+ */
+void consumer_service_set_status(ConsumerService *cs, int status) {
+    cs->status = status;
+    cs->cpu = affinity_cpu();
+    thread_counters_set_status(cs->counters, status);
+}
+
 /**
  * Remove a ConsumerService from the global linked list of ConsumerService
  * structs. This should be called when a Consumer disconnects
@@ -55,20 +92,20 @@ int consumer_service_remove(ConsumerService *cs) {
 
     // remove from linked list
     if (consumerList->count == 0) {
-        if (debug.print) printf("unable to remove CS-%d from empty list (%d)\n", cs->id, consumerList->count);
+        log_trace("unable to remove CS-%d from empty list (%d)", cs->id, consumerList->count);
     }
     else if (consumerList->count == 1) {
         consumerList->head = NULL;
         consumerList->tail = NULL;
         consumerList->count = 0;
-        if (debug.print) printf("CS-%d removed from singleton list (%d)\n", cs->id, consumerList->count);
+        log_trace("CS-%d removed from singleton list (%d)", cs->id, consumerList->count);
     }
     else {
         if (cs->id == consumerList->head->id) {
             consumerList->head = consumerList->head->next;
             consumerList->head->prev = NULL;
             consumerList->count--;
-            if (debug.print) printf("CS-%d removed from head of large list (%d)\n", cs->id, consumerList->count);
+            log_trace("CS-%d removed from head of large list (%d)", cs->id, consumerList->count);
         }
         else {
             ConsumerService *temp;
@@ -81,23 +118,40 @@ int consumer_service_remove(ConsumerService *cs) {
                     temp->next->next->prev = temp;
                     temp->next = temp->next->next;
                     consumerList->count--;
-                    if (debug.print) printf("CS-%d removed large list (%d)\n", cs->id, consumerList->count);
+                    log_trace("CS-%d removed large list (%d)", cs->id, consumerList->count);
                 }
                 else {
                     consumerList->tail = temp;
                     temp->next = NULL;
                     consumerList->count--;
-                    if (debug.print) printf("CS-%d removed from end of large list (%d)\n", cs->id, consumerList->count);
+                    log_trace("CS-%d removed from end of large list (%d)", cs->id, consumerList->count);
                 }
             }
             else {
-                if (debug.print) printf("unable to remove CS-%d from non-empty list (%d)\n", cs->id, consumerList->count);
+                log_trace("unable to remove CS-%d from non-empty list (%d)", cs->id, consumerList->count);
                 // service not in list
             }
         }
     }
+    event_record(EVENT_DISCONNECT, EVENT_SOURCE_CONSUMER, cs->id, -1);
+
+    // hand the departing consumer's partitions to the ones that are left
+    pthread_mutex_lock(&cs->bufferp->mutex);
+    partition_rebalance(cs->bufferp);
+    pthread_mutex_unlock(&cs->bufferp->mutex);
+    pthread_cond_destroy(&cs->partitionReady);
+
+    // anything the departing consumer never acked goes to another one
+    if (ackTimeout > 0) {
+        inflight_requeue_consumer(cs);
+    }
+
+    // keep the departing consumer's counts for metrics
+    counter_add(&serverCounters->consumed_retired.value, counter_get(&cs->counters->consumed));
+    counter_add(&serverCounters->consumer_waits_retired.value, counter_get(&cs->counters->waits));
+    thread_counters_free(cs->counters);
     free(cs);
-    if (debug.print) printf("consumer struct freed from memory\n");
+    log_trace("consumer struct freed from memory");
 
 
     // END CRITICAL SECTION---------------------------------------
@@ -115,54 +169,113 @@ int consumer_service_remove(ConsumerService *cs) {
  * This will pull a resource off of the buffer for a client process.
  * Any waiting producers are notified that the buffer now has room.
  */
-int consumer_service_get_resource(Environment *env, Resource **r) {
+int consumer_service_get_resource(ConsumerService *cs, Resource **r) {
+    ResourceBuffer *rb = cs->bufferp;
     int dequeued = 0;
+    uint64_t held, waited;
     
-    // acquire bufferMutex
-    if (debug.print) printf("consumer attempting buffer mutex\n");
-    pthread_mutex_lock(&bufferMutex);
-    if (debug.print) printf("consumer has buffer mutex\n");
+    // acquire the buffer's mutex
+    log_trace("consumer attempting buffer mutex");
+    pthread_mutex_lock(&rb->mutex);
+    held = monotonic_ns();
+    log_trace("consumer has buffer mutex");
 
     // CRITICAL SECTION-------------------------------------------
 
-    // buffer is full
-    if (debug.print) printf("checking env->bufferp->count\n");
-    if (env->bufferp->count == env->bufferp->size) {
-        // signal producers that we are making room in the buffer
-        pthread_cond_signal(&bufferHasRoom);
+    if (rb->partitions > 0) {
+        dequeued = consumer_service_take_partitioned(cs, r, &held);
+        latency_record(LATENCY_CONSUMER_HOLD, monotonic_ns() - held);
+        pthread_mutex_unlock(&rb->mutex);
+        return dequeued;
     }
-    if (env->bufferp->count == 0) {
-        // make sure producers know there is room in the buffer
-        pthread_cond_signal(&bufferHasRoom);
-        
+
+    log_trace("checking rb->count");
+    if (rb->count == 0) {
         // let monitors know about the condition
         monitor_push_reports();
 
         // wait until there are resources
-        pthread_cond_wait(&bufferNotEmpty, &bufferMutex);
+        event_record(EVENT_WAIT_START, EVENT_SOURCE_CONSUMER, cs->id, -1);
+        counter_add(&cs->counters->waits, 1);
+        waited = monotonic_ns();
+        atomic_store_explicit(&cs->waiting_since, waited, memory_order_relaxed);
+
+        // a wakeup doesn't promise a resource: it may be spurious, or another
+        // consumer may have taken it first, so check again after each one
+        while (rb->count == 0) {
+            pthread_cond_wait(&rb->notEmpty, &rb->mutex);
+        }
+        atomic_store_explicit(&cs->waiting_since, 0, memory_order_relaxed);
+        event_record(EVENT_WAIT_END, EVENT_SOURCE_CONSUMER, cs->id, -1);
+
+        // the mutex was released while waiting, so restart the hold clock
+        held = monotonic_ns();
+        latency_record(LATENCY_CONSUMER_WAIT, held - waited);
     }
 
     // dequeue resource from buffer
-    if (debug.print) printf("calling dequeue\n");
-    dequeued = resource_buffer_dequeue(env->bufferp, r);
+    log_trace("calling dequeue");
+    dequeued = resource_buffer_dequeue(rb, r);
+    if (dequeued == 0) {
+        counter_add(&cs->counters->consumed, 1);
+        event_record(EVENT_CONSUME, EVENT_SOURCE_CONSUMER, cs->id, (*r)->id);
+
+        // signal producers that there is room in the buffer. This has to
+        // happen on every dequeue: signalling only when the buffer was full
+        // woke one producer per full buffer, and left the rest waiting
+        // when several consumers emptied it before that one ran
+        pthread_cond_signal(&rb->hasRoom);
+        producer_tasks_wake(rb);
+    }
 
     // END CRITICAL SECTION---------------------------------------
     
-    // release bufferMutex
-    pthread_mutex_unlock(&bufferMutex);
+    // release the buffer's mutex
+    latency_record(LATENCY_CONSUMER_HOLD, monotonic_ns() - held);
+    pthread_mutex_unlock(&rb->mutex);
 
     return dequeued;
 }
 
 /**
- * This will notify the client that the connection is established 
- * between the client process and the server thread. Note that 
- * access to the global consumerList is protected by mutex in this function.
+ * Take a resource from one of the consumer's partitions, waiting until one
+ * of them has a resource that it may take. Called with the buffer's mutex
+ * held since *held, which restarts if the mutex is let go to wait.
  */
-void *consumer_service_connection_handler(void *tp) {
-    char *message;
-    ConsumerService *cs = (ConsumerService *)tp;
-    
+static int consumer_service_take_partitioned(ConsumerService *cs, Resource **r, uint64_t *held) {
+    ResourceBuffer *rb = cs->bufferp;
+    uint64_t waited;
+
+    if (partition_take(rb, cs, r) < 0) {
+        monitor_push_reports();
+
+        // wait until a partition the consumer owns has a resource that
+        // isn't held back behind one still being consumed
+        event_record(EVENT_WAIT_START, EVENT_SOURCE_CONSUMER, cs->id, -1);
+        counter_add(&cs->counters->waits, 1);
+        waited = monotonic_ns();
+        atomic_store_explicit(&cs->waiting_since, waited, memory_order_relaxed);
+        while (partition_take(rb, cs, r) < 0) {
+            pthread_cond_wait(&cs->partitionReady, &rb->mutex);
+        }
+        atomic_store_explicit(&cs->waiting_since, 0, memory_order_relaxed);
+        event_record(EVENT_WAIT_END, EVENT_SOURCE_CONSUMER, cs->id, -1);
+        *held = monotonic_ns();
+        latency_record(LATENCY_CONSUMER_WAIT, *held - waited);
+    }
+
+    counter_add(&cs->counters->consumed, 1);
+    event_record(EVENT_CONSUME, EVENT_SOURCE_CONSUMER, cs->id, (*r)->id);
+    pthread_cond_signal(&rb->hasRoom);
+    producer_tasks_wake(rb);
+    return 0;
+}
+
+/**
+ * Add a ConsumerService to the global linked list of ConsumerService
+ * structs. Access to the list is protected by mutex in this function.
+ */
+void consumer_service_add(ConsumerService *cs) {
     // acquire consumerListMutex
     pthread_mutex_lock(&consumerListMutex);
 
@@ -173,23 +286,41 @@ void *consumer_service_connection_handler(void *tp) {
         consumerList->head = cs;
         consumerList->tail = cs;
         consumerList->count++;
-        if (debug.print) printf("CS-%d added to list at head (%d)\n", cs->id, consumerList->count);
+        log_trace("CS-%d added to list at head (%d)", cs->id, consumerList->count);
     }
     else {
         consumerList->tail->next = cs;
         cs->prev = consumerList->tail;
         consumerList->tail = cs;
         consumerList->count++;
-        if (debug.print) printf("CS-%d added to list (%d)\n", cs->id, consumerList->count);
+        log_trace("CS-%d added to list (%d)", cs->id, consumerList->count);
     }
 
+    // give the new consumer its share of the partitions
+    pthread_mutex_lock(&cs->bufferp->mutex);
+    partition_rebalance(cs->bufferp);
+    pthread_mutex_unlock(&cs->bufferp->mutex);
+
     // END CRITICAL SECTION---------------------------------------
 
     // release consumerListMutex
     pthread_mutex_unlock(&consumerListMutex);
+    event_record(EVENT_CONNECT, EVENT_SOURCE_CONSUMER, cs->id, -1);
+}
+
+/**
+ * This will notify the client that the connection is established 
+ * between the client process and the server thread.
+ */
+void *consumer_service_connection_handler(void *tp) {
+    char *message;
+    ConsumerService *cs = (ConsumerService *)tp;
+
+    affinity_place(AFFINITY_CONSUMER, cs->id);
+    consumer_service_add(cs);
 
     // Notify client that a thread has taken the connection
-    if (debug.print) printf("Write to sock %d\n",cs->client_sock);
+    log_trace("Write to sock %d",cs->client_sock);
     message = "handshake:consumer";
     write(cs->client_sock , message , strlen(message));
 
@@ -215,85 +346,195 @@ int consumer_service_await_and_handle_message(ConsumerService *t) {
     char recvBuff[1025];
 
     // simulate non-ravenousness
-    sleep(consumerRest);
+    delay_sleep(&consumerRest, &t->delays);
 
     // clear recvBuff
     memset(recvBuff, '\0', sizeof(recvBuff));
 
     // read a message from the client
-    if (debug.print) printf("Attempt to read sock %d\n",t->client_sock);
+    log_trace("Attempt to read sock %d",t->client_sock);
     recvSize = read(t->client_sock, recvBuff, 1024);
     if (recvSize == 0) {
         // Client has disconnected
-        if (debug.print) printf("Client disconnect\n");
+        log_trace("Client disconnect");
         fflush(stdout);
         return -1;
     }
     else if (recvSize < 0) {
         // Error reading message
-        if (debug.print) printf("ERROR reading from socket\n");
+        log_error("CS-%d ERROR reading from socket", t->id);
         return -1;
     }
     else {
         // Valid message from client
-        if (debug.print) printf("Message from client: %s\n",recvBuff);
+        log_trace("CS-%d message from client (%d bytes)", t->id, recvSize);
+
+        // acks ride along with consume requests, so split the message up
+        if (ackTimeout > 0) {
+            return consumer_service_handle_tokens(t, recvBuff, recvSize);
+        }
 
         // limit recvBuff size to 7, to eliminate duplicate "consumeconsume" commands
         // TODO: why do some messages come through duplicated? (need message framing...)
         strncpy(recvBuff, recvBuff, 6);
         recvBuff[7] = '\0';
-        if (debug.print) printf("Message from client cleaned: %s\n",recvBuff);
 
         // consume message from the client
         if( strcmp(recvBuff,"consume") == 0 ) {
-            if (debug.print) printf("attempting to consume.\n");
-            Resource *r;
-            t->status = HUNGRY;
-            
-            // try to get a resource for the client
-            // NOTE: consumer_service_get_resource() will wait until resources are ready
-            if (consumer_service_get_resource(t->env, &r) == 0) {
-                // construct a message for the client now that we have a resource
-                char resource_data[1024];
-                if (debug.print) printf("about to write about dequeued resource\n");
-                if (debug.print) printf("consumed r%d\n", r->id);
-                sprintf(resource_data, "rid:%d;produced_by:%d;", r->id, r->produced_by);
-
-                // send the message to the client
-                write(t->client_sock, resource_data, strlen(resource_data));
-
-                // update this service's thread data
-                t->resources_consumed++;
-                t->status = CONSUMING;
-                
-                // free the resource memory
-                free(r);
-
-                // push reports out to listening monitors
-                monitor_push_reports();
-
-                // sleep for given consumer delay to simulate consumption time
-                sleep(consumeDelay);
-
-                t->status = SLEEPING;
-
-                // push reports out to listening monitors
-                monitor_push_reports();
-            }
-            else {
+            if (consumer_service_consume(t) < 0) {
                 /** 
                  * consumer_service_get_resource() should have waited until
                  * it got a resource from the buffer, this shouldn't be a 
                  * reachable code block.
                  */
-                if (debug.print) printf("ERROR: no resource after wait for client.\n");
+                log_error("ERROR: no resource after wait for client.");
                 pthread_exit(NULL);
                 return -1;
             }
         }
         else {
-            if (debug.print) printf("unrecognized client command.\n");
+            log_trace("unrecognized client command.");
+        }
+    }
+    return 0;
+}
+
+/**
+ * Handle a message from a client in ack mode, where it is a run of
+ * "consume" and "ack:<id>[,<id>...];" tokens. A token cut short by the
+ * end of the message is completed from the next read. Returns -1 if the
+ * client disconnects.
+ */
+static int consumer_service_handle_tokens(ConsumerService *t, char *buff, int used) {
+    char *p = buff, *end, *id, *save;
+    int recvSize;
+
+    while (1) {
+        if (strncmp(p, "consume", 7) == 0) {
+            if (consumer_service_consume(t) < 0) {
+                log_error("ERROR: no resource after wait for client.");
+                return -1;
+            }
+            p += 7;
+            continue;
+        }
+        if (strncmp(p, "ack:", 4) == 0 && (end = strchr(p, ';')) != NULL) {
+            *end = '\0';
+            for (id = strtok_r(p + 4, ",", &save); id != NULL; id = strtok_r(NULL, ",", &save)) {
+                inflight_ack(t, atoi(id));
+            }
+            p = end + 1;
+            continue;
+        }
+        if (*p == '\0') {
+            return 0;
         }
+        if (strncmp(p, "consume", strlen(p)) != 0 && strncmp(p, "ack:", 4) != 0
+            && strncmp(p, "ack:", strlen(p)) != 0) {
+            log_trace("unrecognized client command.");
+            return 0;
+        }
+
+        // the rest is the start of a token, so read the remainder
+        used = strlen(p);
+        memmove(buff, p, used + 1);
+        p = buff;
+        if (used == 1024) {
+            log_trace("CS-%d token too long", t->id);
+            return 0;
+        }
+        recvSize = read(t->client_sock, buff + used, 1024 - used);
+        if (recvSize <= 0) {
+            return -1;
+        }
+        buff[used + recvSize] = '\0';
+    }
+}
+
+/**
+ * Take one resource from the buffer for this consumer, waiting until one
+ * is ready, and pass it on to the client if there is one. Then spend
+ * consumeDelay consuming it. Returns -1 if no resource was taken.
+ */
+int consumer_service_consume(ConsumerService *t) {
+    Resource *r;
+    int inflight = ackTimeout > 0 && t->client_sock >= 0;
+
+    log_trace("attempting to consume.");
+    consumer_service_set_status(t, HUNGRY);
+
+    // try to get a resource for the client
+    // NOTE: consumer_service_get_resource() will wait until resources are ready
+    if (consumer_service_get_resource(t, &r) < 0) {
+        return -1;
     }
+    log_trace("consumed r%d", r->id);
+
+    if (t->client_sock >= 0) {
+        // construct a message for the client now that we have a resource
+        char resource_data[1024];
+        log_trace("about to write about dequeued resource");
+        sprintf(resource_data, "rid:%d;produced_by:%d;", r->id, r->produced_by);
+
+        // send the message to the client
+        write(t->client_sock, resource_data, strlen(resource_data));
+    }
+    latency_record(LATENCY_PRODUCE_TO_CONSUME, monotonic_ns() - r->produced_at);
+
+    // update this service's thread data
+    t->resources_consumed++;
+    consumer_service_set_status(t, CONSUMING);
+
+    // free the resource memory, or in ack mode hold on to it until the
+    // client acks it. Either way r is gone after this
+    if (inflight) {
+        inflight_add(t, r);
+    }
+    else {
+        wal_consume(t->bufferp, r);
+        free(r);
+    }
+
+    // push reports out to listening monitors
+    monitor_push_reports();
+
+    // sleep for given consumer delay to simulate consumption time
+    delay_sleep(&consumeDelay, &t->delays);
+
+    // the resource is consumed, so the next one with its key may go. One
+    // in flight keeps its partition busy until it is acked or put back
+    if (!inflight) {
+        partition_release(t);
+    }
+
+    consumer_service_set_status(t, SLEEPING);
+
+    // push reports out to listening monitors
+    monitor_push_reports();
     return 0;
 }
+
+/**
+ * Thread for a virtual consumer. It behaves like a client that asks for
+ * a resource after every consumerRest, but skips the socket entirely, so
+ * the producer and buffer side can be loaded without network costs.
+ */
+void *consumer_service_virtual_handler(void *tp) {
+    ConsumerService *cs = (ConsumerService *)tp;
+
+    affinity_place(AFFINITY_CONSUMER, cs->id);
+    consumer_service_add(cs);
+
+    while (1) {
+        // simulate non-ravenousness
+        delay_sleep(&consumerRest, &cs->delays);
+
+        // consumer_service_get_resource() waits until it has a resource,
+        // so this shouldn't happen
+        if (consumer_service_consume(cs) < 0) {
+            log_error("ERROR: no resource after wait for CS-%d.", cs->id);
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file
+ *
+ * The event ring is a fixed-size, in-memory record of producer, consumer
+ * and connection transitions. Each event is stamped with a sequence number
+ * and a monotonic nanosecond timestamp.
+ *
+ * The ring is lock-free. A writer claims a sequence number with a single
+ * atomic increment and publishes its slot with a release store, so
+ * Producers and ConsumerServices never block to record an event (even
+ * while they hold a buffer mutex). Readers copy events out by sequence
+ * number and discard any slot that was overwritten while being copied.
+ */
+
+#include "server.h"
+#include <time.h>
+
+// a slot's seq is 0 while a writer is filling it in
+typedef struct _EventSlot EventSlot;
+struct _EventSlot {
+    _Atomic uint64_t seq;
+    Event event;
+};
+
+static EventSlot eventRing[EVENT_RING_SIZE];
+
+// sequence number of the most recently claimed event (0 = no events yet)
+static _Atomic uint64_t eventSeq;
+
+/**
+ * Return the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Record an event in the ring. This costs one atomic increment and two
+ * atomic stores, and never blocks.
+ */
+void event_record(int type, int source, int actor, int resource) {
+    uint64_t seq;
+    EventSlot *slot;
+
+    seq = atomic_fetch_add_explicit(&eventSeq, 1, memory_order_relaxed) + 1;
+    slot = &eventRing[seq & (EVENT_RING_SIZE - 1)];
+
+    // mark the slot busy before touching its contents
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->event.seq = seq;
+    slot->event.time = monotonic_ns();
+    slot->event.type = type;
+    slot->event.source = source;
+    slot->event.actor = actor;
+    slot->event.resource = resource;
+
+    // publish
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+}
+
+/**
+ * Return the sequence number of the most recently recorded event.
+ */
+uint64_t event_ring_head() {
+    return atomic_load_explicit(&eventSeq, memory_order_acquire);
+}
+
+/**
+ * Copy up to max events with a sequence number greater than since into out.
+ * Events that have already been overwritten are skipped, and the number
+ * skipped is added to *dropped. Copying stops at the first event that is
+ * still being written. *next is set to the cursor the caller should pass
+ * as since on its next call. Returns the number of events copied.
+ */
+int event_ring_read(uint64_t since, Event *out, int max, uint64_t *next, uint64_t *dropped) {
+    uint64_t head, seq;
+    int n = 0;
+
+    head = event_ring_head();
+
+    // anything older than one lap of the ring is gone
+    if (head > EVENT_RING_SIZE && since < head - EVENT_RING_SIZE) {
+        *dropped += head - EVENT_RING_SIZE - since;
+        since = head - EVENT_RING_SIZE;
+    }
+
+    for (seq = since + 1; seq <= head && n < max; seq++) {
+        EventSlot *slot = &eventRing[seq & (EVENT_RING_SIZE - 1)];
+        uint64_t before, after;
+
+        before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (before == 0 || before < seq) {
+            // writer has claimed this seq but not published it yet
+            break;
+        }
+        out[n] = slot->event;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+        if (before != seq || after != seq) {
+            // lapped by a writer while we were reading
+            (*dropped)++;
+            continue;
+        }
+        n++;
+    }
+
+    *next = seq - 1;
+    return n;
+}
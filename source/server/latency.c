@@ -0,0 +1,226 @@
+/**
+ * @file
+ *
+ * Latency histograms track how long threads wait on the buffer condition
+ * variables, how long they hold a buffer mutex, and how long each
+ * resource takes from production to delivery to a consumer.
+ *
+ * Histograms use HDR-style log-linear buckets: each power of two is split
+ * into LATENCY_SUB_BUCKETS linear buckets, so every recorded value is kept
+ * to within about 6% across the full nanosecond to hours range.
+ *
+ * Every thread records into its own set of histograms, so recording never
+ * contends with other threads. The per-thread sets are kept in a list and
+ * merged on demand when a report or dump asks for percentiles. When a
+ * thread exits, its counts are folded into a retired set so they are not
+ * lost.
+ */
+
+#include "server.h"
+
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+// one thread's histograms, with a single writer (the owning thread)
+typedef struct _LatencySet LatencySet;
+struct _LatencySet {
+    _Atomic uint64_t counts[LATENCY_KINDS][LATENCY_BUCKETS];
+    _Atomic uint64_t max[LATENCY_KINDS];
+    LatencySet *next;
+    LatencySet *prev;
+};
+
+const char *latency_names[LATENCY_KINDS] = {
+    "producer_wait", "consumer_wait", "producer_hold", "consumer_hold",
+    "produce_to_consume"
+};
+
+static LatencySet *latencySets;
+static LatencySet retiredLatencySet;
+static pthread_mutex_t latencySetsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t latencySetKey;
+static pthread_once_t latencySetKeyOnce = PTHREAD_ONCE_INIT;
+static __thread LatencySet *localLatencySet;
+
+/**
+ * Map a value to its bucket index.
+ */
+static int latency_bucket(uint64_t v) {
+    int e;
+    if (v < LATENCY_SUB_BUCKETS) {
+        return (int)v;
+    }
+    e = 63 - __builtin_clzll(v);
+    return (e - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS
+        + (int)((v >> (e - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/**
+ * Return the highest value that maps to the given bucket index.
+ */
+static uint64_t latency_bucket_value(int idx) {
+    int e, sub;
+    if (idx < LATENCY_SUB_BUCKETS) {
+        return (uint64_t)idx;
+    }
+    e = idx / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    sub = idx % LATENCY_SUB_BUCKETS;
+    return (((uint64_t)(LATENCY_SUB_BUCKETS + sub + 1)) << (e - LATENCY_SUB_BUCKET_BITS)) - 1;
+}
+
+/**
+ * Fold the histograms of an exiting thread into the retired set.
+ */
+static void latency_set_retire(void *sp) {
+    LatencySet *s = (LatencySet *)sp;
+    int k, b;
+
+    pthread_mutex_lock(&latencySetsMutex);
+    for (k = 0; k < LATENCY_KINDS; k++) {
+        for (b = 0; b < LATENCY_BUCKETS; b++) {
+            retiredLatencySet.counts[k][b] += s->counts[k][b];
+        }
+        if (s->max[k] > retiredLatencySet.max[k]) {
+            retiredLatencySet.max[k] = s->max[k];
+        }
+    }
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    }
+    else {
+        latencySets = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    pthread_mutex_unlock(&latencySetsMutex);
+
+    free(s);
+}
+
+static void latency_key_init() {
+    pthread_key_create(&latencySetKey, latency_set_retire);
+}
+
+/**
+ * Allocate and register the calling thread's histograms.
+ */
+static LatencySet *latency_set_new() {
+    LatencySet *s = calloc(1, sizeof(*s));
+
+    pthread_once(&latencySetKeyOnce, latency_key_init);
+    pthread_setspecific(latencySetKey, s);
+
+    pthread_mutex_lock(&latencySetsMutex);
+    s->next = latencySets;
+    if (latencySets != NULL) {
+        latencySets->prev = s;
+    }
+    latencySets = s;
+    pthread_mutex_unlock(&latencySetsMutex);
+
+    return s;
+}
+
+/**
+ * Record a latency, in nanoseconds, into the calling thread's histogram
+ * of the given kind.
+ */
+void latency_record(int kind, uint64_t ns) {
+    LatencySet *s = localLatencySet;
+    _Atomic uint64_t *bucket;
+
+    if (s == NULL) {
+        s = localLatencySet = latency_set_new();
+    }
+
+    // single writer, so a relaxed load and store is enough
+    bucket = &s->counts[kind][latency_bucket(ns)];
+    atomic_store_explicit(bucket,
+        atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    if (ns > atomic_load_explicit(&s->max[kind], memory_order_relaxed)) {
+        atomic_store_explicit(&s->max[kind], ns, memory_order_relaxed);
+    }
+}
+
+/**
+ * Add one thread's histogram of the given kind into out.
+ */
+static void latency_set_merge(LatencySet *s, int kind, LatencyHistogram *out) {
+    uint64_t c, max;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        c = atomic_load_explicit(&s->counts[kind][b], memory_order_relaxed);
+        out->counts[b] += c;
+        out->count += c;
+    }
+    max = atomic_load_explicit(&s->max[kind], memory_order_relaxed);
+    if (max > out->max) {
+        out->max = max;
+    }
+}
+
+/**
+ * Merge every thread's histogram of the given kind into out.
+ */
+void latency_snapshot(int kind, LatencyHistogram *out) {
+    LatencySet *s;
+
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&latencySetsMutex);
+    latency_set_merge(&retiredLatencySet, kind, out);
+    for (s = latencySets; s != NULL; s = s->next) {
+        latency_set_merge(s, kind, out);
+    }
+    pthread_mutex_unlock(&latencySetsMutex);
+}
+
+/**
+ * Return the value at quantile q (0.0 - 1.0) of the given histogram.
+ * The value reported is the upper bound of the bucket it falls in.
+ */
+uint64_t latency_percentile(LatencyHistogram *h, double q) {
+    uint64_t rank, seen = 0;
+    int b;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    rank = (uint64_t)(q * h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > rank) {
+            uint64_t v = latency_bucket_value(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Print a summary of every histogram to the given stream.
+ * This is called when the server shuts down.
+ */
+void latency_dump(FILE *out) {
+    LatencyHistogram h;
+    int k;
+
+    fprintf(out, "%-18s %12s %12s %12s %12s %12s\n",
+        "latency (ns)", "count", "p50", "p99", "p999", "max");
+    for (k = 0; k < LATENCY_KINDS; k++) {
+        latency_snapshot(k, &h);
+        fprintf(out, "%-18s %12llu %12llu %12llu %12llu %12llu\n",
+            latency_names[k],
+            (unsigned long long)h.count,
+            (unsigned long long)latency_percentile(&h, 0.50),
+            (unsigned long long)latency_percentile(&h, 0.99),
+            (unsigned long long)latency_percentile(&h, 0.999),
+            (unsigned long long)h.max);
+    }
+}
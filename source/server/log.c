@@ -0,0 +1,365 @@
+/**
+ * @file
+ *
+ * The log is an asynchronous, structured binary logger for the hot paths.
+ * A log call doesn't format or print anything. It copies its level, a
+ * timestamp, the format string pointer and up to LOG_MAX_ARGS arguments
+ * into the calling thread's ring, which has a single producer and a single
+ * consumer. A background thread drains every ring and does the formatting
+ * and printing, so Producers and ConsumerServices never touch stdio. This
+ * matters most while they hold a buffer mutex.
+ *
+ * Each argument is read with the type its conversion in the format asks
+ * for, so 64-bit integers, doubles and pointers are kept whole. The
+ * strings for %s are copied into the record, since the caller's may be
+ * gone by the time the record is printed, and cut short if together they
+ * don't fit in LOG_STRING_SIZE. Conversions the log can't carry (a '*'
+ * width, %n, long double and wide characters) and any past LOG_MAX_ARGS
+ * are printed as written, along with the rest of the format.
+ *
+ * If a thread's ring is full, the record is dropped and counted rather
+ * than blocking the caller.
+ *
+ * @see LOG() in server.h for compile-time and run-time level filtering
+ */
+
+#include "server.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 1024
+#define LOG_DRAIN_INTERVAL_NS 1000000
+#define LOG_STRING_SIZE 64
+// longest conversion spec the drainer will print, e.g. "%-+020.10llx"
+#define LOG_SPEC_SIZE 32
+
+// the type of argument a conversion takes
+enum {
+    LOG_ARG_INVALID, LOG_ARG_NONE, LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LLONG,
+    LOG_ARG_SIZE, LOG_ARG_INTMAX, LOG_ARG_PTRDIFF, LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER, LOG_ARG_STRING
+};
+
+typedef union _LogArg LogArg;
+union _LogArg {
+    long long i;
+    double d;
+    const void *p;
+    const char *s;
+};
+
+typedef struct _LogRecord LogRecord;
+struct _LogRecord {
+    uint64_t time;
+    const char *format;
+    int level;
+    int nargs;
+    LogArg args[LOG_MAX_ARGS];
+    // copies of the %s arguments, which args point into
+    char strings[LOG_STRING_SIZE];
+};
+
+// one thread's ring; the owning thread writes head, the drainer writes tail
+typedef struct _LogRing LogRing;
+struct _LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    _Atomic uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t dropped;
+    _Atomic int closed;
+    LogRing *next;
+};
+
+static const char *log_level_names[] = { "ERROR", "INFO", "DEBUG", "TRACE" };
+
+static LogRing *logRings;
+static pthread_mutex_t logRingsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t logRingKey;
+static pthread_once_t logRingKeyOnce = PTHREAD_ONCE_INIT;
+static __thread LogRing *localLogRing;
+
+/**
+ * Mark an exiting thread's ring closed. The drainer frees it once it
+ * has printed what is left in it.
+ */
+static void log_ring_close(void *rp) {
+    LogRing *ring = (LogRing *)rp;
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
+
+static void log_key_init() {
+    pthread_key_create(&logRingKey, log_ring_close);
+}
+
+/**
+ * Allocate and register the calling thread's ring.
+ */
+static LogRing *log_ring_new() {
+    LogRing *ring;
+
+    if (posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(*ring)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+
+    pthread_once(&logRingKeyOnce, log_key_init);
+    pthread_setspecific(logRingKey, ring);
+
+    pthread_mutex_lock(&logRingsMutex);
+    ring->next = logRings;
+    logRings = ring;
+    pthread_mutex_unlock(&logRingsMutex);
+
+    return ring;
+}
+
+/**
+ * Read the conversion spec at p, just after its '%', and set *end to just
+ * after it. Returns the type of argument it takes, LOG_ARG_NONE for "%%",
+ * or LOG_ARG_INVALID if the log can't carry it.
+ */
+static int log_spec(const char *p, const char **end) {
+    int length = 0;
+
+    p += strspn(p, "-+ #0");
+    p += strspn(p, "0123456789");
+    if (*p == '.') {
+        p++;
+        p += strspn(p, "0123456789");
+    }
+    if (*p == 'h') {
+        p += p[1] == 'h' ? 2 : 1;
+    }
+    else if (*p == 'l') {
+        // 'q' stands for ll
+        length = p[1] == 'l' ? 'q' : 'l';
+        p += p[1] == 'l' ? 2 : 1;
+    }
+    else if (*p == 'z' || *p == 'j' || *p == 't' || *p == 'L') {
+        length = *p++;
+    }
+    *end = *p != '\0' ? p + 1 : p;
+
+    switch (*p) {
+        case '%':
+            return LOG_ARG_NONE;
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            switch (length) {
+                case 0: return LOG_ARG_INT;
+                case 'l': return LOG_ARG_LONG;
+                case 'q': return LOG_ARG_LLONG;
+                case 'z': return LOG_ARG_SIZE;
+                case 'j': return LOG_ARG_INTMAX;
+                case 't': return LOG_ARG_PTRDIFF;
+            }
+            return LOG_ARG_INVALID;
+        case 'c':
+            return length == 0 ? LOG_ARG_INT : LOG_ARG_INVALID;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            return length == 0 || length == 'l' ? LOG_ARG_DOUBLE : LOG_ARG_INVALID;
+        case 'p':
+            return length == 0 ? LOG_ARG_POINTER : LOG_ARG_INVALID;
+        case 's':
+            return length == 0 ? LOG_ARG_STRING : LOG_ARG_INVALID;
+    }
+    return LOG_ARG_INVALID;
+}
+
+/**
+ * Copy a log record into the calling thread's ring. nargs arguments
+ * follow the format. Use the LOG() macros rather than calling this.
+ */
+void log_write(int level, int nargs, const char *format, ...) {
+    LogRing *ring = localLogRing;
+    LogRecord *record;
+    uint64_t head;
+    va_list args;
+    const char *p, *string;
+    size_t used = 0, length;
+    int n = 0, type;
+
+    if (ring == NULL) {
+        ring = localLogRing = log_ring_new();
+        if (ring == NULL) {
+            return;
+        }
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->time = monotonic_ns();
+    record->format = format;
+    record->level = level;
+    if (nargs > LOG_MAX_ARGS) {
+        nargs = LOG_MAX_ARGS;
+    }
+    va_start(args, format);
+    for (p = format; (p = strchr(p, '%')) != NULL; ) {
+        type = log_spec(p + 1, &p);
+        if (type == LOG_ARG_NONE) {
+            continue;
+        }
+        if (type == LOG_ARG_INVALID || n == nargs) {
+            break;
+        }
+        switch (type) {
+            case LOG_ARG_INT: record->args[n].i = va_arg(args, int); break;
+            case LOG_ARG_LONG: record->args[n].i = va_arg(args, long); break;
+            case LOG_ARG_LLONG: record->args[n].i = va_arg(args, long long); break;
+            case LOG_ARG_SIZE: record->args[n].i = va_arg(args, size_t); break;
+            case LOG_ARG_INTMAX: record->args[n].i = va_arg(args, intmax_t); break;
+            case LOG_ARG_PTRDIFF: record->args[n].i = va_arg(args, ptrdiff_t); break;
+            case LOG_ARG_DOUBLE: record->args[n].d = va_arg(args, double); break;
+            case LOG_ARG_POINTER: record->args[n].p = va_arg(args, void *); break;
+            case LOG_ARG_STRING:
+                if ((string = va_arg(args, const char *)) == NULL) {
+                    string = "(null)";
+                }
+                // every string gets at least its terminator
+                if (used == LOG_STRING_SIZE) {
+                    used--;
+                }
+                length = strnlen(string, LOG_STRING_SIZE - used - 1);
+                memcpy(record->strings + used, string, length);
+                record->strings[used + length] = '\0';
+                record->args[n].s = record->strings + used;
+                used += length + 1;
+                break;
+        }
+        n++;
+    }
+    va_end(args);
+    record->nargs = n;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Print a record's message, one conversion at a time with the argument
+ * that was copied for it.
+ */
+static void log_record_print(LogRecord *record) {
+    const char *p = record->format, *spec, *end;
+    char conversion[LOG_SPEC_SIZE];
+    LogArg *arg;
+    int n = 0, type;
+
+    while ((spec = strchr(p, '%')) != NULL) {
+        fwrite(p, 1, spec - p, stdout);
+        type = log_spec(spec + 1, &end);
+        if (type == LOG_ARG_NONE) {
+            putchar('%');
+            p = end;
+            continue;
+        }
+        if (type == LOG_ARG_INVALID || n == record->nargs || end - spec >= LOG_SPEC_SIZE) {
+            // print the rest as written
+            p = spec;
+            break;
+        }
+        memcpy(conversion, spec, end - spec);
+        conversion[end - spec] = '\0';
+        arg = &record->args[n++];
+        switch (type) {
+            case LOG_ARG_INT: printf(conversion, (int)arg->i); break;
+            case LOG_ARG_LONG: printf(conversion, (long)arg->i); break;
+            case LOG_ARG_LLONG: printf(conversion, arg->i); break;
+            case LOG_ARG_SIZE: printf(conversion, (size_t)arg->i); break;
+            case LOG_ARG_INTMAX: printf(conversion, (intmax_t)arg->i); break;
+            case LOG_ARG_PTRDIFF: printf(conversion, (ptrdiff_t)arg->i); break;
+            case LOG_ARG_DOUBLE: printf(conversion, arg->d); break;
+            case LOG_ARG_POINTER: printf(conversion, arg->p); break;
+            case LOG_ARG_STRING: printf(conversion, arg->s); break;
+        }
+        p = end;
+    }
+    fputs(p, stdout);
+}
+
+/**
+ * Print every record waiting in the given ring. Returns the number printed.
+ */
+static int log_ring_drain(LogRing *ring) {
+    uint64_t head, tail, dropped;
+    int n = 0;
+
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (; tail != head; tail++, n++) {
+        LogRecord *record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+        printf("[%llu.%09llu] %-5s ",
+            (unsigned long long)(record->time / 1000000000ull),
+            (unsigned long long)(record->time % 1000000000ull),
+            log_level_names[record->level]);
+        log_record_print(record);
+        putchar('\n');
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        printf("[log] %llu records dropped\n", (unsigned long long)dropped);
+    }
+    return n;
+}
+
+/**
+ * Drain every ring once, and free the rings of threads that have exited.
+ * Returns the number of records printed.
+ */
+int log_flush() {
+    LogRing *ring, **link;
+    int n = 0;
+
+    pthread_mutex_lock(&logRingsMutex);
+    link = &logRings;
+    while ((ring = *link) != NULL) {
+        int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        n += log_ring_drain(ring);
+        if (closed) {
+            *link = ring->next;
+            free(ring);
+        }
+        else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&logRingsMutex);
+
+    if (n > 0) {
+        fflush(stdout);
+    }
+    return n;
+}
+
+/**
+ * Background drain loop. Sleeps briefly whenever the rings are empty.
+ */
+void *log_drain_handler(void *unused) {
+    struct timespec interval = { 0, LOG_DRAIN_INTERVAL_NS };
+    while (1) {
+        if (log_flush() == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the background drain thread.
+ */
+int log_start() {
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, log_drain_handler, NULL) < 0) {
+        printf("could not create log thread\n");
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
@@ -7,14 +7,344 @@
  */
 
 #include "server.h"
+#include <signal.h>
+
+/**
+ * Print end-of-run statistics. Called once when the server is asked
+ * to shut down.
+ */
+void server_shutdown() {
+    trace_record_stop();
+    stats_close();
+    log_flush();
+    latency_dump(stdout);
+    fflush(stdout);
+}
+
+/**
+ * Wait for SIGINT or SIGTERM, then shut the server down. Every other
+ * thread has these signals blocked, so they are always delivered here.
+ */
+void *server_signal_handler(void *sp) {
+    sigset_t *signals = (sigset_t *)sp;
+    int sig;
+
+    sigwait(signals, &sig);
+    if (debug.print) printf("caught signal %d, shutting down\n", sig);
+    server_shutdown();
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Apply a "name=value" command line option (the leading "--" already
+ * stripped). Returns -1 for an unknown option or a bad value.
+ *
+ *   --spin=<duration>      busy-wait delays shorter than this
+ *   --simulate=<duration>  run a virtual-time simulation of this long and exit
+ *   --seed=<n>             seed the simulation's random delays
+ *   --consumers=<n>        number of consumers in the simulation
+ *   --virtual-consumers=<n>  start n in-process consumers with no client
+ *   --record=<file>        record produces, consumes and connections to file
+ *   --replay=<file>[:<speed>]  replay a recorded trace instead of running
+ *                          producers, optionally speed times faster
+ *   --watchdog=<duration>  check the server's invariants this often
+ *   --autoscale=<min>:<max>  add and retire producers at runtime to keep
+ *                          up with consumers, within these bounds
+ *   --autoscale-interval=<duration>  how often the autoscaler looks
+ *   --batch=<n>            producers prepare and publish n resources at a time
+ *   --rate=<n>[:<burst>]   limit all producers together to n resources per
+ *                          second, in bursts of up to burst
+ *   --producer-rate=<n>[:<burst>]  limit each producer the same way
+ *   --affinity=<policy>    place producers and consumers on cores: none,
+ *                          spread, compact or split (see affinity.c)
+ *   --housekeeping=<cpus>  cores for logging, metrics and monitoring threads
+ *   --task-workers=<n>     run producers as tasks on n worker threads
+ *                          instead of a thread each
+ *   --task-tick=<duration>  timer resolution for producer tasks
+ *   --topic=<name>:<size>[:<producers>]  add a topic with a buffer of its
+ *                          own and producers of its own (1 by default);
+ *                          consumers pick it with handshake:consumer:<name>
+ *   --partitions=<n>       split each topic into n partitions by producer, so
+ *                          each producer's resources are consumed in order
+ *   --ack-timeout=<duration>  hold each resource sent to a client until the
+ *                          client acks it, and deliver it again if it
+ *                          doesn't within this long (see ack.c)
+ *   --wal=<file>           log the default topic's resources to file, and
+ *                          put the ones left unconsumed back in the buffer
+ *                          on the next start (see wal.c)
+ *   --replicate=<port>     stream the default topic to a standby that
+ *                          attaches on this local port
+ *   --standby=<port>       follow the primary replicating on this local
+ *                          port, and take over from it once neither that
+ *                          port nor the application port answers; a hung
+ *                          primary isn't taken over from (see
+ *                          replication.c). Can't be used with --wal
+ */
+int server_option(char *option) {
+    char *value = strchr(option, '=');
+    Delay d;
+
+    if (value == NULL) {
+        return -1;
+    }
+    value++;
+
+    if (strncmp(option, "spin=", 5) == 0) {
+        if (delay_parse(value, &d) < 0 || d.kind != DELAY_FIXED) {
+            return -1;
+        }
+        spinThreshold = d.mean;
+        return 0;
+    }
+    if (strncmp(option, "simulate=", 9) == 0) {
+        if (delay_parse(value, &d) < 0 || d.kind != DELAY_FIXED || d.mean == 0) {
+            return -1;
+        }
+        simulation.duration = d.mean;
+        return 0;
+    }
+    if (strncmp(option, "seed=", 5) == 0) {
+        simulation.seed = strtoull(value, NULL, 10);
+        return 0;
+    }
+    if (strncmp(option, "virtual-consumers=", 18) == 0) {
+        if ((virtualConsumers = atoi(value)) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "watchdog=", 9) == 0) {
+        if (delay_parse(value, &d) < 0 || d.kind != DELAY_FIXED) {
+            return -1;
+        }
+        watchdogInterval = d.mean;
+        return 0;
+    }
+    if (strncmp(option, "ack-timeout=", 12) == 0) {
+        if (delay_parse(value, &d) < 0 || d.kind != DELAY_FIXED || d.mean == 0) {
+            return -1;
+        }
+        ackTimeout = d.mean;
+        return 0;
+    }
+    if (strncmp(option, "autoscale=", 10) == 0) {
+        if (sscanf(value, "%d:%d", &autoscale.min, &autoscale.max) != 2
+            || autoscale.min < 1 || autoscale.max < autoscale.min) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "autoscale-interval=", 19) == 0) {
+        if (delay_parse(value, &d) < 0 || d.kind != DELAY_FIXED || d.mean == 0) {
+            return -1;
+        }
+        autoscale.interval = d.mean;
+        return 0;
+    }
+    if (strncmp(option, "batch=", 6) == 0) {
+        if ((produceBatch = atoi(value)) < 1) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "rate=", 5) == 0) {
+        double rate;
+        int burst;
+        if (rate_parse(value, &rate, &burst) < 0) {
+            return -1;
+        }
+        rate_limit_init(&productionRate, rate, burst);
+        return 0;
+    }
+    if (strncmp(option, "producer-rate=", 14) == 0) {
+        if (rate_parse(value, &producerRate.rate, &producerRate.burst) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "affinity=", 9) == 0) {
+        return affinity_parse(value);
+    }
+    if (strncmp(option, "housekeeping=", 13) == 0) {
+        affinity.housekeeping = value;
+        return 0;
+    }
+    if (strncmp(option, "task-workers=", 13) == 0) {
+        if ((producerTasks.workers = atoi(value)) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "task-tick=", 10) == 0) {
+        if (delay_parse(value, &d) < 0 || d.kind != DELAY_FIXED || d.mean == 0) {
+            return -1;
+        }
+        producerTasks.tick = d.mean;
+        return 0;
+    }
+    if (strncmp(option, "topic=", 6) == 0) {
+        ResourceBuffer *rb, **tail;
+        char *size = strchr(value, ':'), *producers;
+        if (size == NULL || size == value) {
+            return -1;
+        }
+        *size++ = '\0';
+        if ((producers = strchr(size, ':')) != NULL) {
+            *producers++ = '\0';
+        }
+        for (tail = &topics; *tail != NULL; tail = &(*tail)->next) {
+            if (strcmp((*tail)->name, value) == 0) {
+                return -1;
+            }
+        }
+        if (strcmp(value, "default") == 0 || atoi(size) < 1
+            || (producers != NULL && atoi(producers) < 0)) {
+            return -1;
+        }
+        rb = resource_buffer_new(atoi(size));
+        rb->name = value;
+        rb->producers = producers != NULL ? atoi(producers) : 1;
+        *tail = rb;
+        return 0;
+    }
+    if (strncmp(option, "partitions=", 11) == 0) {
+        if ((partitionCount = atoi(value)) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "replicate=", 10) == 0) {
+        if ((replication.port = atoi(value)) < 1) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "standby=", 8) == 0) {
+        if ((replication.standby = atoi(value)) < 1) {
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(option, "wal=", 4) == 0) {
+        wal.path = value;
+        return 0;
+    }
+    if (strncmp(option, "record=", 7) == 0) {
+        trace.record = value;
+        return 0;
+    }
+    if (strncmp(option, "replay=", 7) == 0) {
+        char *speed = strrchr(value, ':');
+        trace.speed = 1.0;
+        if (speed != NULL) {
+            *speed = '\0';
+            if ((trace.speed = atof(speed + 1)) <= 0) {
+                return -1;
+            }
+        }
+        trace.replay = value;
+        return 0;
+    }
+    if (strncmp(option, "consumers=", 10) == 0) {
+        if ((simulation.consumers = atoi(value)) < 1) {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Resize the running buffer, in one short critical section. Producers and
+ * consumers carry on throughout; see resource_buffer_resize().
+ */
+int reset(int size) {
+    ResourceBuffer *rb = globalResourceBuffer;
+
+    if (size < 1) {
+        return -1;
+    }
+    pthread_mutex_lock(&rb->mutex);
+    resource_buffer_resize(rb, size);
+
+    // a bigger buffer may have room for producers waiting on a full one
+    pthread_cond_broadcast(&rb->hasRoom);
+    producer_tasks_wake(rb);
+    pthread_mutex_unlock(&rb->mutex);
+
+    log_info("buffer resized to %d", size);
+    return 0;
+}
 
 int start() {
-    // initialize buffer
+    // a standby follows the primary until it is gone, then takes over.
+    // Until then it shares nothing with the primary, not even the stats page
+    if (replication.standby > 0 && replication_follow() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // publish counters in shared memory before any threads use them
+    stats_open();
+
+    // initialize the default topic's buffer, ahead of any named topics
     globalResourceBuffer = resource_buffer_new(bufferSize);
+    globalResourceBuffer->name = "default";
+    globalResourceBuffer->producers = numProducers;
+    globalResourceBuffer->next = topics;
+    topics = globalResourceBuffer;
     env->bufferp = globalResourceBuffer;
+    stats_buffer(globalResourceBuffer);
+    if (partitionCount > 0) {
+        ResourceBuffer *rb;
+        for (rb = topics; rb != NULL; rb = rb->next) {
+            partition_init(rb, partitionCount);
+        }
+    }
+
+    // bring back what the primary or the last run left in the buffer (a
+    // standby has no log of its own), log from here, and stream to a
+    // standby
+    replication_restore(globalResourceBuffer);
+    if (wal_start() < 0 || replication_start() < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    // initialize producers
-    initialize_producers(env->bufferp, numProducers);
+    // record events from here on
+    if (trace.record != NULL && trace_record_start(trace.record) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // initialize producers, or let a recorded trace drive production
+    if (trace.replay != NULL) {
+        if (trace_replay_start(env, trace.replay, trace.speed) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        if (producer_tasks_start() < 0) {
+            exit(EXIT_FAILURE);
+        }
+        ResourceBuffer *rb;
+        for (rb = topics; rb != NULL; rb = rb->next) {
+            initialize_producers(rb, rb->producers);
+        }
+        autoscale_start(env->bufferp);
+    }
+
+    // start consumers that don't need a client
+    int i;
+    for (i = 0; i < virtualConsumers; i++) {
+        consumer_service_new(env, -1, env->bufferp);
+    }
+
+    // redeliver resources that clients don't ack in time
+    ack_start();
+
+    // check invariants while we run
+    watchdog_start();
+
+    // serve metrics to local scrapers
+    metrics_start();
 }
 
 /**
@@ -26,16 +356,43 @@ int main(int argc, char** argv) {
     // set behavioral variables
     bufferSize = 3;
     numProducers = 5;
-    consumeDelay = 1;
-    consumerRest = 1;
-    produceDelay = 2;
-    producerRest = 1;
+    produceBatch = 1;
+    rate_limit_init(&productionRate, 0, 1);
+    producerRate.rate = 0;
+    producerRate.burst = 1;
+    affinity.policy = AFFINITY_NONE;
+    affinity.housekeeping = NULL;
+    virtualConsumers = 0;
+    watchdogInterval = 0;
+    ackTimeout = 0;
+    autoscale.min = 0;
+    autoscale.max = 0;
+    autoscale.interval = 500000000ull;
+    producerTasks.workers = 0;
+    producerTasks.tick = 1000000ull;
+    delay_set(&consumeDelay, 1000000000ull);
+    delay_set(&consumerRest, 1000000000ull);
+    delay_set(&produceDelay, 2000000000ull);
+    delay_set(&producerRest, 1000000000ull);
+    spinThreshold = 0;
+    simulation.duration = 0;
+    simulation.seed = 1;
+    simulation.consumers = 5;
 
-    // allow behavior vars to be overridden with command line args
+    // allow behavior vars to be overridden with command line args;
+    // "--name=value" options may appear anywhere among the positional ones
     if (argc > 1) {
-        int i;
+        int i, position = 0;
         for (i = 1; i < argc; i++) {
-            switch (i) {
+            if (strncmp(argv[i], "--", 2) == 0) {
+                if (server_option(argv[i] + 2) < 0) {
+                    fprintf(stderr, "invalid option: %s\n", argv[i]);
+                    return (EXIT_FAILURE);
+                }
+                continue;
+            }
+            position++;
+            switch (position) {
                 case 1:
                     bufferSize = atoi(argv[i]);
                     break;
@@ -43,16 +400,28 @@ int main(int argc, char** argv) {
                     numProducers = atoi(argv[i]);
                     break;
                 case 3:
-                    consumeDelay = atoi(argv[i]);
+                    if (delay_parse(argv[i], &consumeDelay) < 0) {
+                        fprintf(stderr, "invalid consumeDelay: %s\n", argv[i]);
+                        return (EXIT_FAILURE);
+                    }
                     break;
                 case 4:
-                    consumerRest = atoi(argv[i]);
+                    if (delay_parse(argv[i], &consumerRest) < 0) {
+                        fprintf(stderr, "invalid consumerRest: %s\n", argv[i]);
+                        return (EXIT_FAILURE);
+                    }
                     break;
                 case 5:
-                    produceDelay = atoi(argv[i]);
+                    if (delay_parse(argv[i], &produceDelay) < 0) {
+                        fprintf(stderr, "invalid produceDelay: %s\n", argv[i]);
+                        return (EXIT_FAILURE);
+                    }
                     break;
                 case 6:
-                    producerRest = atoi(argv[i]);
+                    if (delay_parse(argv[i], &producerRest) < 0) {
+                        fprintf(stderr, "invalid producerRest: %s\n", argv[i]);
+                        return (EXIT_FAILURE);
+                    }
                     break;
                 case 7:
                     debug.print = atoi(argv[i]);
@@ -61,6 +430,41 @@ int main(int argc, char** argv) {
         }
     }
 
+    // start within the autoscaler's bounds
+    if (autoscale.max > 0) {
+        if (numProducers < autoscale.min) numProducers = autoscale.min;
+        if (numProducers > autoscale.max) numProducers = autoscale.max;
+    }
+
+    // a standby's buffer comes from the primary; replaying a log into
+    // it as well would load every resource twice
+    if (replication.standby > 0 && wal.path != NULL) {
+        fprintf(stderr, "--standby can't be used with --wal\n");
+        return (EXIT_FAILURE);
+    }
+
+    // move to the housekeeping cores before starting any thread
+    if (affinity_init() < 0) {
+        return (EXIT_FAILURE);
+    }
+
+    // route shutdown signals to a dedicated thread; threads created
+    // after this point inherit the blocked signal mask
+    static sigset_t signals;
+    pthread_t signal_thread;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_create(&signal_thread, NULL, server_signal_handler, (void *)&signals);
+
+    // a client that disconnects mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // debugging logs everything; otherwise only errors
+    logLevel = debug.print ? LOG_LEVEL_TRACE : LOG_LEVEL_ERROR;
+    log_start();
+
     // initialize global producer and resource indices
     pidx = 0;
     ridx = 0;
@@ -69,11 +473,17 @@ int main(int argc, char** argv) {
     env = malloc(sizeof(*env));
 
     // initialize global mutexes
-    pthread_mutex_init(&bufferMutex, NULL);
+    pthread_mutex_init(&producerListMutex, NULL);
     pthread_mutex_init(&consumerListMutex, NULL);
     pthread_mutex_init(&monitorListMutex, NULL);
-    pthread_cond_init (&bufferHasRoom, NULL);
-    pthread_cond_init (&bufferNotEmpty, NULL);
+    pthread_mutex_init(&pauseMutex, NULL);
+    pthread_cond_init (&pauseLifted, NULL);
+
+    // initialize producerList
+    producerList = malloc(sizeof(*producerList));
+    producerList->head = NULL;
+    producerList->tail = NULL;
+    producerList->count = 0;
 
     // initialize consumersList
     consumerList = malloc(sizeof(*consumerList));
@@ -83,6 +493,13 @@ int main(int argc, char** argv) {
     monitorList = malloc(sizeof(*monitorList));
     monitorList->count = 0;
 
+    // a simulation runs to completion on this thread instead of serving
+    if (simulation.duration > 0) {
+        simulate_run();
+        log_flush();
+        return (EXIT_SUCCESS);
+    }
+
     // begin producer/buffer threads
     start();
 
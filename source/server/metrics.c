@@ -0,0 +1,246 @@
+/**
+ * @file
+ *
+ * Metrics serves the server's counters and gauges over HTTP in the
+ * Prometheus text exposition format on METRICS_PORT (localhost only).
+ *
+ * Each Producer and ConsumerService counts into its own cache-line
+ * aligned ThreadCounters (@see stats.c), so threads never share a line
+ * with each other while counting. A scrape only reads those counters
+ * (and the buffer counts, with relaxed loads), so it never takes a
+ * buffer's mutex.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include "server.h"
+
+// growable text buffer for building a scrape response
+typedef struct _MetricsText MetricsText;
+struct _MetricsText {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+/**
+ * Add n to a counter. Counters are only ever read for reporting, so
+ * relaxed ordering is enough.
+ */
+void counter_add(_Atomic uint64_t *c, uint64_t n) {
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+/**
+ * Read a counter.
+ */
+uint64_t counter_get(_Atomic uint64_t *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/**
+ * Append formatted text to a MetricsText, growing it as needed.
+ */
+static void metrics_printf(MetricsText *t, const char *format, ...) {
+    va_list args;
+    int n;
+
+    while (1) {
+        va_start(args, format);
+        n = vsnprintf(t->data + t->length, t->capacity - t->length, format, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if (t->length + n < t->capacity) {
+            t->length += n;
+            return;
+        }
+        t->capacity = (t->capacity + n) * 2;
+        t->data = realloc(t->data, t->capacity);
+    }
+}
+
+/**
+ * Write every metric into the given MetricsText.
+ */
+void metrics_write(MetricsText *t) {
+    uint64_t producer_waits, consumer_waits;
+    Producer *p;
+
+    // producers can be retired at runtime, so the list is walked under its
+    // mutex; counts from retired producers are kept in serverCounters
+    metrics_printf(t, "# HELP pc_resources_produced_total Resources produced by each producer.\n"
+        "# TYPE pc_resources_produced_total counter\n");
+    pthread_mutex_lock(&producerListMutex);
+    producer_waits = counter_get(&serverCounters->producer_waits_retired.value);
+    metrics_printf(t, "pc_resources_produced_total{producer=\"retired\"} %llu\n",
+        (unsigned long long)counter_get(&serverCounters->produced_retired.value));
+    for (p = producerList->head; p != NULL; p = p->next) {
+        metrics_printf(t, "pc_resources_produced_total{producer=\"%d\"} %llu\n",
+            p->id, (unsigned long long)counter_get(&p->counters->produced));
+        producer_waits += counter_get(&p->counters->waits);
+    }
+    int producer_count = producerList->count;
+    pthread_mutex_unlock(&producerListMutex);
+
+    // consumers come and go, so the list is walked under its own mutex;
+    // counts from disconnected consumers are kept in serverCounters
+    metrics_printf(t, "# HELP pc_resources_consumed_total Resources consumed by each consumer.\n"
+        "# TYPE pc_resources_consumed_total counter\n");
+    pthread_mutex_lock(&consumerListMutex);
+    consumer_waits = counter_get(&serverCounters->consumer_waits_retired.value);
+    metrics_printf(t, "pc_resources_consumed_total{consumer=\"disconnected\"} %llu\n",
+        (unsigned long long)counter_get(&serverCounters->consumed_retired.value));
+    ConsumerService *cs;
+    for (cs = consumerList->head; cs != NULL; cs = cs->next) {
+        metrics_printf(t, "pc_resources_consumed_total{consumer=\"%d\"} %llu\n",
+            cs->id, (unsigned long long)counter_get(&cs->counters->consumed));
+        consumer_waits += counter_get(&cs->counters->waits);
+    }
+    int consumers = consumerList->count;
+    pthread_mutex_unlock(&consumerListMutex);
+
+    ResourceBuffer *rb;
+    metrics_printf(t, "# HELP pc_buffer_depth Resources currently in each topic's buffer.\n"
+        "# TYPE pc_buffer_depth gauge\n");
+    for (rb = topics; rb != NULL; rb = rb->next) {
+        metrics_printf(t, "pc_buffer_depth{topic=\"%s\"} %d\n", rb->name,
+            __atomic_load_n(&rb->count, __ATOMIC_RELAXED));
+    }
+    metrics_printf(t, "# HELP pc_buffer_capacity Maximum resources each topic's buffer holds.\n"
+        "# TYPE pc_buffer_capacity gauge\n");
+    for (rb = topics; rb != NULL; rb = rb->next) {
+        metrics_printf(t, "pc_buffer_capacity{topic=\"%s\"} %d\n", rb->name,
+            __atomic_load_n(&rb->size, __ATOMIC_RELAXED));
+    }
+
+    metrics_printf(t, "# HELP pc_waits_total Condition variable waits on the buffer.\n"
+        "# TYPE pc_waits_total counter\n"
+        "pc_waits_total{role=\"producer\"} %llu\n"
+        "pc_waits_total{role=\"consumer\"} %llu\n",
+        (unsigned long long)producer_waits, (unsigned long long)consumer_waits);
+
+    metrics_printf(t, "# HELP pc_producers Live producer threads.\n"
+        "# TYPE pc_producers gauge\n"
+        "pc_producers %d\n",
+        producer_count);
+
+    metrics_printf(t, "# HELP pc_connections Live client connections.\n"
+        "# TYPE pc_connections gauge\n"
+        "pc_connections{type=\"consumer\"} %d\n"
+        "pc_connections{type=\"monitor\"} %d\n",
+        consumers, __atomic_load_n(&monitorList->count, __ATOMIC_RELAXED));
+    metrics_printf(t, "# HELP pc_connections_total Client connections accepted.\n"
+        "# TYPE pc_connections_total counter\n"
+        "pc_connections_total{type=\"consumer\"} %llu\n"
+        "pc_connections_total{type=\"monitor\"} %llu\n",
+        (unsigned long long)counter_get(&serverCounters->consumer_connections.value),
+        (unsigned long long)counter_get(&serverCounters->monitor_connections.value));
+
+    metrics_printf(t, "# HELP pc_monitor_report_bytes_total XML report bytes sent to monitors.\n"
+        "# TYPE pc_monitor_report_bytes_total counter\n"
+        "pc_monitor_report_bytes_total %llu\n",
+        (unsigned long long)counter_get(&serverCounters->monitor_report_bytes.value));
+
+    metrics_printf(t, "# HELP pc_inflight Resources sent to clients and not yet acked.\n"
+        "# TYPE pc_inflight gauge\n"
+        "pc_inflight %d\n",
+        inflight_count());
+    metrics_printf(t, "# HELP pc_acked_total Resources acked by clients.\n"
+        "# TYPE pc_acked_total counter\n"
+        "pc_acked_total %llu\n",
+        (unsigned long long)counter_get(&serverCounters->acked.value));
+    metrics_printf(t, "# HELP pc_redelivered_total Resources put back after a missed ack or a disconnect.\n"
+        "# TYPE pc_redelivered_total counter\n"
+        "pc_redelivered_total %llu\n",
+        (unsigned long long)counter_get(&serverCounters->redelivered.value));
+
+    metrics_printf(t, "# HELP pc_wal_commits_total Write-ahead log syncs, each covering every record pending.\n"
+        "# TYPE pc_wal_commits_total counter\n"
+        "pc_wal_commits_total %llu\n",
+        (unsigned long long)counter_get(&serverCounters->wal_commits.value));
+    metrics_printf(t, "# HELP pc_wal_records_total Records synced to the write-ahead log.\n"
+        "# TYPE pc_wal_records_total counter\n"
+        "pc_wal_records_total %llu\n",
+        (unsigned long long)counter_get(&serverCounters->wal_records.value));
+    metrics_printf(t, "# HELP pc_recovered_total Resources put back in the buffer from the write-ahead log at startup.\n"
+        "# TYPE pc_recovered_total counter\n"
+        "pc_recovered_total %llu\n",
+        (unsigned long long)counter_get(&serverCounters->recovered.value));
+
+    metrics_printf(t, "# HELP pc_replication_lag Records not yet sent to the standby.\n"
+        "# TYPE pc_replication_lag gauge\n"
+        "pc_replication_lag %d\n",
+        replication_lag());
+
+    metrics_printf(t, "# HELP pc_invariant_violations_total Problems found by the watchdog.\n"
+        "# TYPE pc_invariant_violations_total counter\n"
+        "pc_invariant_violations_total %llu\n",
+        (unsigned long long)counter_get(&serverCounters->invariant_violations.value));
+}
+
+/**
+ * Metrics listener loop. Every connection gets one HTTP response with the
+ * current metrics, whatever the request path, and is then closed.
+ */
+void *metrics_listen(void *unused) {
+    struct sockaddr_in server;
+    int metrics_sock, client_sock, opt = 1;
+    char recvBuff[1025];
+
+    metrics_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_sock == -1) {
+        if (debug.print) puts("Could not create metrics socket");
+        return NULL;
+    }
+    setsockopt(metrics_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(METRICS_PORT);
+    if (bind(metrics_sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+        perror("metrics bind");
+        close(metrics_sock);
+        return NULL;
+    }
+    listen(metrics_sock, 16);
+
+    while ((client_sock = accept(metrics_sock, NULL, NULL)) >= 0) {
+        MetricsText body = { NULL, 0, 0 };
+        char header[256];
+        int headerSize;
+
+        // the request itself doesn't matter, but read it so the client
+        // doesn't see a reset
+        read(client_sock, recvBuff, 1024);
+
+        metrics_write(&body);
+        headerSize = sprintf(header, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", body.length);
+        write(client_sock, header, headerSize);
+        write(client_sock, body.data, body.length);
+
+        free(body.data);
+        close(client_sock);
+    }
+    return NULL;
+}
+
+/**
+ * Start the metrics listener thread.
+ */
+int metrics_start() {
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, metrics_listen, NULL) < 0) {
+        if (debug.print) printf("could not create metrics thread\n");
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
@@ -8,6 +8,7 @@
  */
 
 #include "server.h"
+#include <unistd.h>
 #include <libxml/parser.h>
 
 
@@ -15,6 +16,7 @@ int monitor_service_await_and_handle_message(MonitorService*);
 void *monitor_service_connection_handler(void *);
 void monitor_service_write_report(MonitorService *);
 void monitor_mark_no_longer_queued_send(MonitorService *);
+void monitor_service_write_events(MonitorService *, xmlNodePtr);
 
 /**
  * Create a new MonitorService struct, and begin the corresponding thread.
@@ -25,13 +27,18 @@ void monitor_mark_no_longer_queued_send(MonitorService *);
 int monitor_service_new(Environment *env, int client_sock) {
     MonitorService *t = malloc(sizeof(*t));
     t->client_sock = client_sock;
+    t->next = NULL;
+    t->prev = NULL;
     t->env = env;
     t->ready = 0;
     t->deleted = 0;
     t->waiting = 0;
     t->has_queued_send = 0;
+    t->events_seq = event_ring_head();
+    t->events = malloc(sizeof(*t->events) * EVENT_RING_SIZE);
     pthread_mutex_init(&(t->hasQueuedSendMutex), NULL);
     t->id = monitorList->idx++;
+    counter_add(&serverCounters->monitor_connections.value, 1);
     pthread_mutex_init(&(t->monitorReadyMutex), NULL);
     pthread_cond_init(&(t->monitorNowReady), NULL);
     if (debug.print) printf("monitor service struct ready\n");
@@ -121,6 +128,7 @@ int monitor_service_remove(MonitorService *ms) {
         }
     }
 
+    free(ms->events);
     free(ms);
     if (debug.print) printf("monitor struct freed from memory\n");
 
@@ -161,7 +169,7 @@ void *monitor_push_reports_handler_for_ms(void *msp) {
     pthread_mutex_lock(&(ms->monitorReadyMutex));
     if (ms->ready == 0 && ms->deleted == 0) {
         // wait until the individual monitor is ready
-        if (debug.print) printf("wait for MS-%d\n",ms->id);
+        log_trace("wait for MS-%d", ms->id);
         ms->waiting = 1;
         pthread_cond_wait(&(ms->monitorNowReady), &(ms->monitorReadyMutex));
     }
@@ -172,7 +180,7 @@ void *monitor_push_reports_handler_for_ms(void *msp) {
     // mark the monitor as not ready, and send report data
     ms->ready = 0;
     if (ms->deleted == 0) {
-        if (debug.print) printf("MS-%d not deleted.\n",ms->id);
+        log_trace("MS-%d not deleted.", ms->id);
         monitor_service_write_report(ms);
     }
     else {
@@ -180,7 +188,7 @@ void *monitor_push_reports_handler_for_ms(void *msp) {
         // because this thread was waiting for this MontiorService.
         // now it's gone, so queue the removal
         // @see: monitor_service_remove()
-        if (debug.print) printf("MS-%d flag for delete.\n", ms->id);
+        log_trace("MS-%d flag for delete.", ms->id);
         pthread_mutex_unlock(&(ms->monitorReadyMutex));
         monitor_service_remove(ms);
         pthread_exit(NULL);
@@ -200,14 +208,17 @@ void *monitor_push_reports_handler_for_ms(void *msp) {
  * "report data."
  */
 void *monitor_push_reports_handler(void *tp) {
-    if (debug.print) printf("push reports\n");
+    // started from a producer or consumer, so off its worker core, along
+    // with the per-monitor threads started from here
+    affinity_housekeep();
+    log_trace("push reports");
 
     // acquire list mutex
     pthread_mutex_lock(&monitorListMutex);
 
     if (monitorList->count == 0) {
         // no monitors
-        if (debug.print) printf("no monitors\n");
+        log_trace("no monitors");
     }
     else {
         // iterate over all MonitorService instances
@@ -235,10 +246,11 @@ void *monitor_push_reports_handler(void *tp) {
             // use yet another thread so we can quickly release the monitorListMutex
             pthread_t thread_id;
             if( pthread_create(&thread_id, NULL, monitor_push_reports_handler_for_ms, (void*)ms) < 0) {
-                if (debug.print) printf("could not create push report thread ms\n");
-                return;
+                log_error("could not create push report thread for MS-%d", ms->id);
+                pthread_mutex_unlock(&monitorListMutex);
+                return NULL;
             }
-            if (debug.print) printf("pushing report for MS-%d\n",ms->id);
+            log_trace("pushing report for MS-%d", ms->id);
 
             ms = ms->next;
         }
@@ -257,11 +269,16 @@ void *monitor_push_reports_handler(void *tp) {
  */
 void monitor_push_reports() {
     pthread_t thread_id;
+
+    // nobody is listening; don't spawn a thread just to find that out
+    if (monitorList->count == 0) {
+        return;
+    }
     if( pthread_create(&thread_id, NULL, monitor_push_reports_handler, NULL) < 0) {
-        if (debug.print) printf("could not create push report thread\n");
+        log_error("could not create push report thread");
         return;
     }
-    if (debug.print) puts("pushing report with thread");
+    log_trace("pushing report with thread");
 }
 
 /**
@@ -349,6 +366,14 @@ int monitor_service_await_and_handle_message(MonitorService *t) {
         // Valid message from client
         if (debug.print) printf("Message from client: %s\n",recvBuff);
 
+        // "events:N" asks for a report with every event since seq N
+        if (strncmp(recvBuff, "events:", 7) == 0) {
+            pthread_mutex_lock(&(t->monitorReadyMutex));
+            t->events_seq = strtoull(recvBuff + 7, NULL, 10);
+            pthread_mutex_unlock(&(t->monitorReadyMutex));
+            strcpy(recvBuff, "report");
+        }
+
         // limit recvBuff size to 6, to eliminate duplicate "reportreport" commands
         // TODO: why do some messages come through duplicated? (need message framing...)
         strncpy(recvBuff, recvBuff, 5);
@@ -407,7 +432,7 @@ void monitor_mark_no_longer_queued_send(MonitorService *ms) {
  */
 void monitor_service_write_report(MonitorService *ms) {
     xmlNodePtr root_node, consumers_node, producers_node;
-    xmlNodePtr buffer_node, events_node;
+    xmlNodePtr buffer_node, events_node, latency_node;
     xmlDocPtr doc;
     xmlChar *xmlbuff;
     int buffersize;
@@ -441,6 +466,17 @@ void monitor_service_write_report(MonitorService *ms) {
             xmlNewChild(consumer, NULL, BAD_CAST "status", 
                 BAD_CAST consumer_data);
 
+            sprintf(consumer_data, "%d", cs->cpu);
+            xmlNewChild(consumer, NULL, BAD_CAST "cpu", 
+                BAD_CAST consumer_data);
+
+            xmlNewChild(consumer, NULL, BAD_CAST "topic", 
+                BAD_CAST cs->bufferp->name);
+
+            if (cs->client_sock < 0) {
+                xmlNewChild(consumer, NULL, BAD_CAST "virtual", BAD_CAST "1");
+            }
+
             cs = cs->next;
         }
     }
@@ -448,37 +484,47 @@ void monitor_service_write_report(MonitorService *ms) {
 
     // print producers as XML
     producers_node = xmlNewChild(root_node, NULL, BAD_CAST "producers", NULL);
-    int p;
-    for (p = 0; p < pidx; p++) {
+    Producer *p;
+    pthread_mutex_lock(&producerListMutex);
+    for (p = producerList->head; p != NULL; p = p->next) {
         xmlNodePtr producer_node;
         char producer_data[1024];
         
         producer_node = xmlNewChild(producers_node, NULL, BAD_CAST "producer", NULL);
         
-        sprintf(producer_data, "%d", producers[p]->id);
+        sprintf(producer_data, "%d", p->id);
         xmlNewChild(producer_node, NULL, BAD_CAST "id", 
             BAD_CAST producer_data);
 
-        sprintf(producer_data, "%d", producers[p]->status);
+        sprintf(producer_data, "%d", p->status);
         xmlNewChild(producer_node, NULL, BAD_CAST "status", 
             BAD_CAST producer_data);
 
-        sprintf(producer_data, "%d", producers[p]->resources_produced);
+        sprintf(producer_data, "%d", p->resources_produced);
         xmlNewChild(producer_node, NULL, BAD_CAST "count", 
             BAD_CAST producer_data);
-    }
 
-    buffer_node = xmlNewChild(root_node, NULL, BAD_CAST "buffer", NULL);
+        sprintf(producer_data, "%d", p->cpu);
+        xmlNewChild(producer_node, NULL, BAD_CAST "cpu", 
+            BAD_CAST producer_data);
 
+        xmlNewChild(producer_node, NULL, BAD_CAST "topic", 
+            BAD_CAST p->bufferp->name);
+    }
+    pthread_mutex_unlock(&producerListMutex);
 
-    // print buffer as XML
+    // print each topic's buffer as XML, the default topic first
     ResourceBuffer *rb;
-    rb = ms->env->bufferp;
-    if (rb->count == 0) {
-        // empty buffer
-    }
-    else {
-        Resource *temp = rb->head;
+    for (rb = topics; rb != NULL; rb = rb->next) {
+        char buffer_size[16];
+
+        buffer_node = xmlNewChild(root_node, NULL, BAD_CAST "buffer", NULL);
+        xmlNewProp(buffer_node, BAD_CAST "name", BAD_CAST rb->name);
+        sprintf(buffer_size, "%d", rb->size);
+        xmlNewProp(buffer_node, BAD_CAST "size", BAD_CAST buffer_size);
+
+        int k;
+        Resource *temp = resource_buffer_walk(rb, NULL, &k);
         while (temp != NULL) {
             xmlNodePtr buffer_resource;
             char resource_data[1024];
@@ -493,11 +539,41 @@ void monitor_service_write_report(MonitorService *ms) {
             xmlNewChild(buffer_resource, NULL, BAD_CAST "producer", 
                 BAD_CAST resource_data);
 
-            temp = temp->next;
+            temp = resource_buffer_walk(rb, temp, &k);
         }
     }
 
+    // print events since this monitor's last report as XML
     events_node = xmlNewChild(root_node, NULL, BAD_CAST "events", NULL);
+    monitor_service_write_events(ms, events_node);
+
+    // print wait and hold latency percentiles as XML
+    latency_node = xmlNewChild(root_node, NULL, BAD_CAST "latency", NULL);
+    int k;
+    for (k = 0; k < LATENCY_KINDS; k++) {
+        xmlNodePtr histogram_node;
+        LatencyHistogram h;
+        char latency_data[64];
+
+        latency_snapshot(k, &h);
+        histogram_node = xmlNewChild(latency_node, NULL, BAD_CAST "histogram", NULL);
+        xmlNewProp(histogram_node, BAD_CAST "name", BAD_CAST latency_names[k]);
+
+        sprintf(latency_data, "%llu", (unsigned long long)h.count);
+        xmlNewChild(histogram_node, NULL, BAD_CAST "count", BAD_CAST latency_data);
+
+        sprintf(latency_data, "%llu", (unsigned long long)latency_percentile(&h, 0.50));
+        xmlNewChild(histogram_node, NULL, BAD_CAST "p50", BAD_CAST latency_data);
+
+        sprintf(latency_data, "%llu", (unsigned long long)latency_percentile(&h, 0.99));
+        xmlNewChild(histogram_node, NULL, BAD_CAST "p99", BAD_CAST latency_data);
+
+        sprintf(latency_data, "%llu", (unsigned long long)latency_percentile(&h, 0.999));
+        xmlNewChild(histogram_node, NULL, BAD_CAST "p999", BAD_CAST latency_data);
+
+        sprintf(latency_data, "%llu", (unsigned long long)h.max);
+        xmlNewChild(histogram_node, NULL, BAD_CAST "max", BAD_CAST latency_data);
+    }
 
 
     /*
@@ -506,6 +582,7 @@ void monitor_service_write_report(MonitorService *ms) {
      */
     xmlDocDumpFormatMemory(doc, &xmlbuff, &buffersize, 1);
     write(ms->client_sock, xmlbuff, buffersize);
+    counter_add(&serverCounters->monitor_report_bytes.value, buffersize);
     // if (debug.print) printf("wrote to socket:\n%s", (char *) xmlbuff);
 
     /*
@@ -514,4 +591,58 @@ void monitor_service_write_report(MonitorService *ms) {
     xmlFree(xmlbuff);
     xmlFreeDoc(doc);
 
-}
\ No newline at end of file
+}
+/**
+ * Add every event recorded since the MonitorService's last report to the
+ * given events node, and advance the MonitorService's event cursor.
+ * The node's "since" and "next" attributes let a monitor resume with
+ * "events:N", and "dropped" counts events that were overwritten in the
+ * ring before they could be sent. Called with the MonitorService's
+ * monitorReadyMutex held, which guards its events buffer.
+ */
+void monitor_service_write_events(MonitorService *ms, xmlNodePtr events_node) {
+    static const char *event_types[] = { "produce", "consume", "wait_start",
+        "wait_end", "connect", "disconnect" };
+    static const char *event_sources[] = { "producer", "consumer" };
+    Event *events = ms->events;
+    uint64_t next, dropped = 0;
+    char event_data[64];
+    int n, i;
+
+    n = event_ring_read(ms->events_seq, events, EVENT_RING_SIZE, &next, &dropped);
+
+    sprintf(event_data, "%llu", (unsigned long long)ms->events_seq);
+    xmlNewProp(events_node, BAD_CAST "since", BAD_CAST event_data);
+    sprintf(event_data, "%llu", (unsigned long long)next);
+    xmlNewProp(events_node, BAD_CAST "next", BAD_CAST event_data);
+    sprintf(event_data, "%llu", (unsigned long long)dropped);
+    xmlNewProp(events_node, BAD_CAST "dropped", BAD_CAST event_data);
+
+    for (i = 0; i < n; i++) {
+        xmlNodePtr event_node;
+
+        event_node = xmlNewChild(events_node, NULL, BAD_CAST "event", NULL);
+
+        sprintf(event_data, "%llu", (unsigned long long)events[i].seq);
+        xmlNewChild(event_node, NULL, BAD_CAST "seq", BAD_CAST event_data);
+
+        sprintf(event_data, "%llu", (unsigned long long)events[i].time);
+        xmlNewChild(event_node, NULL, BAD_CAST "time", BAD_CAST event_data);
+
+        xmlNewChild(event_node, NULL, BAD_CAST "type",
+            BAD_CAST event_types[events[i].type]);
+
+        xmlNewChild(event_node, NULL, BAD_CAST "source",
+            BAD_CAST event_sources[events[i].source]);
+
+        sprintf(event_data, "%d", events[i].actor);
+        xmlNewChild(event_node, NULL, BAD_CAST "actor", BAD_CAST event_data);
+
+        if (events[i].resource >= 0) {
+            sprintf(event_data, "%d", events[i].resource);
+            xmlNewChild(event_node, NULL, BAD_CAST "resource", BAD_CAST event_data);
+        }
+    }
+
+    ms->events_seq = next;
+}
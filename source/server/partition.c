@@ -0,0 +1,213 @@
+/**
+ * @file
+ *
+ * Key-partitioned delivery keeps each producer's resources in order while
+ * still spreading them over many consumers. A partitioned buffer queues
+ * resources in partitionCount partitions, keyed by the producer that made
+ * them, instead of in one list. Each partition is owned by one of the
+ * topic's consumers at a time, and only its owner takes from it.
+ *
+ * Partitions are dealt out round-robin over the topic's consumers, and
+ * dealt out again whenever a consumer joins or leaves. A partition stays
+ * busy from when a resource is taken from it until the consumer has
+ * finished consuming that resource, and nobody takes from a busy
+ * partition, so a partition that changes hands mid-resource isn't served
+ * by its new owner until its old one is done. That is what keeps a key in
+ * order across a rebalance. In ack mode, finished means acked by the
+ * client, or put back for redelivery, so a resource that is redelivered
+ * still goes out before the rest of its key.
+ *
+ * Every function here is called with the buffer's mutex held, except
+ * partition_release() and partition_ack(), which take it.
+ */
+
+#include "server.h"
+
+/**
+ * Return the partition that a resource's key falls in.
+ */
+static int partition_of(ResourceBuffer *rb, Resource *r) {
+    return (unsigned)r->produced_by % rb->partitions;
+}
+
+/**
+ * Wake the owner of a partition if it has a resource ready for it.
+ */
+static void partition_wake(Partition *part) {
+    if (part->owner != NULL && part->count > 0 && !part->busy) {
+        pthread_cond_signal(&part->owner->partitionReady);
+    }
+}
+
+/**
+ * Split a buffer into n partitions. Called before any producer or
+ * consumer uses the buffer.
+ */
+void partition_init(ResourceBuffer *rb, int n) {
+    rb->partitions = n;
+    rb->partition = calloc(n, sizeof(*rb->partition));
+}
+
+/**
+ * Add a chain of n resources, linked from first to last, to their key's
+ * partition, and wake the partition's owner. The chain comes from one
+ * producer, so it is all in one partition.
+ */
+void partition_append(ResourceBuffer *rb, Resource *first, Resource *last, int n) {
+    Partition *part = &rb->partition[partition_of(rb, first)];
+
+    last->next = NULL;
+    if (part->tail != NULL) {
+        part->tail->next = first;
+    }
+    else {
+        part->head = first;
+    }
+    part->tail = last;
+    part->count += n;
+    partition_wake(part);
+}
+
+/**
+ * Put a resource back at the head of its key's partition, to be delivered
+ * again before the rest of its key, and wake the partition's owner. The
+ * partition was kept busy while the resource was in flight, so it is
+ * free again now.
+ */
+void partition_prepend(ResourceBuffer *rb, Resource *r) {
+    Partition *part = &rb->partition[partition_of(rb, r)];
+
+    r->next = part->head;
+    part->head = r;
+    if (part->tail == NULL) {
+        part->tail = r;
+    }
+    part->count++;
+    part->busy = 0;
+    partition_wake(part);
+}
+
+/**
+ * Take the next resource from one of the consumer's partitions that isn't
+ * busy, starting after the partition it took from last so that it serves
+ * its partitions in turn. Returns -1 if none has a resource for it.
+ */
+int partition_take(ResourceBuffer *rb, ConsumerService *cs, Resource **r) {
+    Partition *part;
+    int i, k;
+
+    for (i = 1; i <= rb->partitions; i++) {
+        k = (cs->partition + i + rb->partitions) % rb->partitions;
+        part = &rb->partition[k];
+        if (part->owner != cs || part->count == 0 || part->busy) {
+            continue;
+        }
+        *r = part->head;
+        part->head = (*r)->next;
+        if (part->head == NULL) {
+            part->tail = NULL;
+        }
+        part->count--;
+        part->busy = 1;
+        cs->partition = k;
+
+        rb->count--;
+        if (rb->excess > 0) {
+            rb->excess = rb->count > rb->size ? rb->count - rb->size : 0;
+        }
+        stats_buffer(rb);
+        log_trace("r%d taken from partition %d (count = %d).", (*r)->id, k, rb->count);
+        monitor_push_reports();
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Mark the consumer's partition as no longer busy once it has finished
+ * consuming the resource it took, and wake the partition's owner, which
+ * may be another consumer since a rebalance.
+ */
+void partition_release(ConsumerService *cs) {
+    ResourceBuffer *rb = cs->bufferp;
+    Partition *part;
+
+    if (rb->partitions == 0 || cs->partition < 0) {
+        return;
+    }
+    pthread_mutex_lock(&rb->mutex);
+    part = &rb->partition[cs->partition];
+    part->busy = 0;
+    partition_wake(part);
+    pthread_mutex_unlock(&rb->mutex);
+}
+
+/**
+ * Mark the partition of a resource that was in flight as no longer busy
+ * once its client has acked it, and wake the partition's owner.
+ */
+void partition_ack(ResourceBuffer *rb, Resource *r) {
+    Partition *part;
+
+    if (rb->partitions == 0) {
+        return;
+    }
+    pthread_mutex_lock(&rb->mutex);
+    part = &rb->partition[partition_of(rb, r)];
+    part->busy = 0;
+    partition_wake(part);
+    pthread_mutex_unlock(&rb->mutex);
+}
+
+/**
+ * Deal the partitions out round-robin over the topic's consumers. Called
+ * with the consumerListMutex held as well, whenever a consumer joins or
+ * leaves the consumerList.
+ */
+void partition_rebalance(ResourceBuffer *rb) {
+    ConsumerService *cs, *first = NULL;
+    int k;
+
+    if (rb->partitions == 0) {
+        return;
+    }
+    cs = consumerList->head;
+    for (k = 0; k < rb->partitions; k++) {
+        // the next consumer of this topic, wrapping round at the end
+        while (cs != NULL && cs->bufferp != rb) {
+            cs = cs->next;
+        }
+        if (cs == NULL) {
+            cs = first;
+        }
+        if (first == NULL) {
+            first = cs;
+        }
+        rb->partition[k].owner = cs;
+        partition_wake(&rb->partition[k]);
+        if (cs != NULL) {
+            cs = cs->next;
+        }
+    }
+    log_debug("%s: %d partitions rebalanced", rb->name, rb->partitions);
+}
+
+/**
+ * Return the number of resources the consumer could take now. Reads
+ * without the buffer's mutex, for the watchdog.
+ */
+int partition_available(ResourceBuffer *rb, ConsumerService *cs) {
+    int k, count = 0;
+
+    if (rb->partitions == 0) {
+        return __atomic_load_n(&rb->count, __ATOMIC_RELAXED);
+    }
+    for (k = 0; k < rb->partitions; k++) {
+        Partition *part = &rb->partition[k];
+        if (__atomic_load_n(&part->owner, __ATOMIC_RELAXED) == cs
+            && !__atomic_load_n(&part->busy, __ATOMIC_RELAXED)) {
+            count += __atomic_load_n(&part->count, __ATOMIC_RELAXED);
+        }
+    }
+    return count;
+}
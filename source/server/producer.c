@@ -8,82 +8,368 @@
 
 #include "server.h"
 
-enum { SLEEP, PRODUCING, EXPORT, WAITING };
-
 /**
  * Primary producer loop.
- * This will repeatedly acquire the bufferMutex, and then add a resource 
- * to the buffer. If the buffer is full, the thread will wait until
- * a ConsumerService thread signals that there is room in the buffer for new
- * resources. This waiting is handled by pthread_cond_wait()
+ * This will repeatedly rest, prepare a batch of produceBatch resources,
+ * wait for rate limit tokens for it, publish it to the buffer with
+ * producer_produce_one(), and then spend produceDelay producing each
+ * resource in the batch.
  */
 void *producer_produce(void *pi) {
     Producer *p = (Producer *)pi;
-    while(1) {
+
+    affinity_place(AFFINITY_PRODUCER, p->id);
+    while(!atomic_load_explicit(&p->retiring, memory_order_acquire)) {
+        // hold off while an admin has paused production
+        if (producer_wait_unpaused(p) < 0) {
+            break;
+        }
+
         // time delay between productions
-        p->status = SLEEP;
-        sleep(producerRest);
-        
-        // acquire buffer mutex
-        if(debug.print) printf("producer %d acquiring bufferMutex\n", p->id);
-        pthread_mutex_lock(&bufferMutex);
-        if(debug.print) printf("producer %d acquired bufferMutex\n", p->id);
-
-        // CRITICAL SECTION-------------------------------------------
-        // buffer is full 
-        if (p->bufferp->count == p->bufferp->size) {
-            if(debug.print) printf("producer %d is waiting (%d to %d)...\n", p->id, p->bufferp->count, p->bufferp->size);
-            p->status = WAITING;
-            // wait until there is room in buffer
-            pthread_cond_wait(&bufferHasRoom, &bufferMutex);
+        producer_set_status(p, SLEEP);
+        delay_sleep(&producerRest, &p->delays);
+
+        producer_prepare(p, produceBatch);
+
+        // wait for the rate limits to allow the batch
+        uint64_t wait = producer_throttle(p, produceBatch);
+        if (wait > 0) {
+            producer_set_status(p, THROTTLED);
+            delay_sleep_ns(wait);
+        }
+
+        if (producer_produce_one(p) < 0) {
+            break;
         }
 
-        // enqueue new resource to buffer
-        if(debug.print) printf("producer %d produce to buffer\n", p->id);
-        p->status = EXPORT;
-        resource_buffer_enqueue(p->bufferp, resource_new(p->id));
-        p->resources_produced++;
-        if(debug.print) resource_buffer_print(p->bufferp);
+        // wait to produce more for produceDelay
+        producer_set_status(p, PRODUCING);
+        delay_sleep_ns(producer_batch_delay(p, produceBatch));
+    }
+
+    // retired: every resource this producer published is in the buffer,
+    // and the ones it prepared but never published get no id
+    log_debug("producer %d retired after %d resources", p->id, p->resources_produced);
+    producer_remove(p);
+    pthread_detach(pthread_self());
+    pthread_exit(NULL);
+}
+
+/**
+ * Acquire the buffer's mutex, and then add the producer's prepared resources
+ * to the buffer, or a single new one if it has none prepared.
+ * If the buffer is full, the thread will wait until a ConsumerService
+ * thread signals that there is room in the buffer for new resources.
+ * This waiting is handled by pthread_cond_wait()
+ *
+ * Returns -1, without publishing the rest, if the producer was asked to
+ * retire while it waited.
+ */
+int producer_produce_one(Producer *p) {
+    uint64_t held, waited;
+
+    if (p->prepared == 0) {
+        producer_prepare(p, 1);
+    }
+
+    // acquire buffer mutex
+    log_trace("producer %d acquiring buffer mutex", p->id);
+    pthread_mutex_lock(&p->bufferp->mutex);
+    held = monotonic_ns();
+    log_trace("producer %d acquired buffer mutex", p->id);
+
+    // CRITICAL SECTION-------------------------------------------
+    // publish as much as fits, and wait for room for the rest
+    producer_publish(p);
+    while (p->prepared > 0) {
+        log_debug("producer %d is waiting (%d to %d)...", p->id, p->bufferp->count, p->bufferp->size);
+        producer_set_status(p, WAITING);
+        event_record(EVENT_WAIT_START, EVENT_SOURCE_PRODUCER, p->id, -1);
+        // wait until there is room in buffer
+        counter_add(&p->counters->waits, 1);
+        waited = monotonic_ns();
+        atomic_store_explicit(&p->waiting_since, waited, memory_order_relaxed);
+
+        // a wakeup doesn't promise room: it may be spurious, or another
+        // producer may have filled the space first, so check after each one
+        while (p->bufferp->count >= p->bufferp->size
+            && !atomic_load_explicit(&p->retiring, memory_order_acquire)) {
+            pthread_cond_wait(&p->bufferp->hasRoom, &p->bufferp->mutex);
+        }
+        atomic_store_explicit(&p->waiting_since, 0, memory_order_relaxed);
+        event_record(EVENT_WAIT_END, EVENT_SOURCE_PRODUCER, p->id, -1);
+
+        // asked to retire while waiting; leave without publishing the rest
+        if (p->bufferp->count >= p->bufferp->size) {
+            pthread_mutex_unlock(&p->bufferp->mutex);
+            return -1;
+        }
+
+        // the mutex was released while waiting, so restart the hold clock
+        held = monotonic_ns();
+        latency_record(LATENCY_PRODUCER_WAIT, held - waited);
+        producer_publish(p);
+    }
+
+    // END CRITICAL SECTION---------------------------------------
+
+    // release mutex
+    latency_record(LATENCY_PRODUCER_HOLD, monotonic_ns() - held);
+    pthread_mutex_unlock(&p->bufferp->mutex);
+    log_trace("producer %d released buffer mutex", p->id);
+
+    // the batch is produced once it is in the write-ahead log
+    wal_wait(p->wal_seq);
+    return 0;
+}
+
+/**
+ * Allocate resources until the producer has n prepared. This happens
+ * outside the buffer's mutex; the resources get their id when they are
+ * published.
+ */
+void producer_prepare(Producer *p, int n) {
+    Resource *r;
+
+    for (; p->prepared < n; p->prepared++) {
+        r = malloc(sizeof(*r));
+        r->next = p->batch;
+        p->batch = r;
+    }
+}
+
+/**
+ * Enqueue as many of the producer's prepared resources as there is room
+ * for, in one step. Called with the buffer's mutex held. Returns the number
+ * published.
+ */
+int producer_publish(Producer *p) {
+    ResourceBuffer *rb = p->bufferp;
+    Resource *first = p->batch, *last = NULL, *r = first;
+    uint64_t now;
+    int n = rb->size - rb->count, i, id;
+
+    if (n > p->prepared) {
+        n = p->prepared;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+
+    log_trace("producer %d produce %d to buffer", p->id, n);
+    producer_set_status(p, EXPORT);
+    now = monotonic_ns();
+    // ids are unique across topics, which publish under their own locks
+    id = atomic_fetch_add_explicit(&ridx, n, memory_order_relaxed);
+    for (i = 0; i < n; i++) {
+        r->id = id + i;
+        r->produced_by = p->id;
+        r->produced_at = now;
+        event_record(EVENT_PRODUCE, EVENT_SOURCE_PRODUCER, p->id, r->id);
+        last = r;
+        r = r->next;
+    }
+    p->batch = r;
+    p->prepared -= n;
+    if (rb == globalResourceBuffer) {
+        p->wal_seq = wal_produce(first, n);
+    }
+    resource_buffer_append(rb, first, last, n);
+    p->resources_produced += n;
+    counter_add(&p->counters->produced, n);
+    log_debug("producer %d produced r%d to r%d (count=%d)", p->id, first->id, last->id, rb->count);
+
+    // signal consumers that we have resources available, one per
+    // resource rather than a broadcast that wakes them all
+    for (i = 0; i < n; i++) {
+        pthread_cond_signal(&rb->notEmpty);
+    }
+    return n;
+}
+
+/**
+ * Return the time to spend producing a batch of n resources: a sample of
+ * produceDelay for each.
+ */
+uint64_t producer_batch_delay(Producer *p, int n) {
+    uint64_t delay = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        delay += delay_sample(&produceDelay, &p->delays);
+    }
+    return delay;
+}
+
+/**
+ * Take tokens for n resources from the producer's rate limit and the
+ * global one. Returns how many ns to wait until both allow them.
+ */
+uint64_t producer_throttle(Producer *p, int n) {
+    uint64_t wait = rate_limit_take(&p->rate, n);
+    uint64_t global = rate_limit_take(&productionRate, n);
+    return wait > global ? wait : global;
+}
 
-        // signal producers that we have resources available
-        pthread_cond_signal(&bufferNotEmpty);
+/**
+ * Set the Producer's status, and publish it in the stats page.
+ */
+void producer_set_status(Producer *p, int status) {
+    p->status = status;
+    p->cpu = affinity_cpu();
+    thread_counters_set_status(p->counters, status);
+}
 
-        // tell monitors about update
-        monitor_push_reports();
+/**
+ * Ask a producer to retire. It finishes the production it is in the middle
+ * of, if any, and then removes itself from the producerList and exits.
+ * A producer waiting for room in the buffer leaves without producing.
+ */
+void producer_retire(Producer *p) {
+    atomic_store_explicit(&p->retiring, 1, memory_order_release);
+    if (p->task) {
+        producer_task_retire(p);
+        return;
+    }
 
-        // END CRITICAL SECTION---------------------------------------
+    // wake it if it is waiting for room or paused; the others re-check
+    // and wait again
+    pthread_mutex_lock(&p->bufferp->mutex);
+    pthread_cond_broadcast(&p->bufferp->hasRoom);
+    pthread_mutex_unlock(&p->bufferp->mutex);
+    pthread_mutex_lock(&pauseMutex);
+    pthread_cond_broadcast(&pauseLifted);
+    pthread_mutex_unlock(&pauseMutex);
+}
 
-        // release mutex
-        pthread_mutex_unlock(&bufferMutex);
-        if(debug.print) printf("producer %d released bufferMutex\n", p->id);
-        
-        // wait to produce more for produceDelay seconds
-        p->status = PRODUCING;
-        sleep(produceDelay);
+/**
+ * Pause or resume all producers. Paused producers finish the batch in
+ * hand and then hold before the next one until they are resumed.
+ */
+void producer_pause(int paused) {
+    pthread_mutex_lock(&pauseMutex);
+    atomic_store_explicit(&producersPaused, paused, memory_order_release);
+    if (!paused) {
+        pthread_cond_broadcast(&pauseLifted);
+        producer_tasks_resume();
+    }
+    pthread_mutex_unlock(&pauseMutex);
+}
+
+/**
+ * Block a producer thread while producers are paused. Returns -1 if the
+ * producer was asked to retire instead.
+ */
+int producer_wait_unpaused(Producer *p) {
+    if (atomic_load_explicit(&producersPaused, memory_order_acquire)) {
+        pthread_mutex_lock(&pauseMutex);
+        while (atomic_load_explicit(&producersPaused, memory_order_relaxed)
+            && !atomic_load_explicit(&p->retiring, memory_order_acquire)) {
+            producer_set_status(p, PAUSED);
+            pthread_cond_wait(&pauseLifted, &pauseMutex);
+        }
+        pthread_mutex_unlock(&pauseMutex);
+    }
+    return atomic_load_explicit(&p->retiring, memory_order_acquire) ? -1 : 0;
+}
+
+/**
+ * Remove a Producer from the producerList and free it. Its counts are
+ * kept in serverCounters for metrics.
+ */
+void producer_remove(Producer *p) {
+    pthread_mutex_lock(&producerListMutex);
+
+    // CRITICAL SECTION-------------------------------------------
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    }
+    else {
+        producerList->head = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    }
+    else {
+        producerList->tail = p->prev;
+    }
+    producerList->count--;
+
+    counter_add(&serverCounters->produced_retired.value, counter_get(&p->counters->produced));
+    counter_add(&serverCounters->producer_waits_retired.value, counter_get(&p->counters->waits));
+    thread_counters_free(p->counters);
+    while (p->batch != NULL) {
+        Resource *r = p->batch;
+        p->batch = r->next;
+        free(r);
     }
     free(p);
-    pthread_exit(NULL);
+    // END CRITICAL SECTION---------------------------------------
+
+    pthread_mutex_unlock(&producerListMutex);
+
+    // let monitors know the producer is gone
+    monitor_push_reports();
 }
 
 /**
- * Create a new Producer struct to track a new producer thread.
- * Memory will be allocated for the struct and a thread will be
- * created.
+ * Create a new Producer struct and add it to the producerList,
+ * without starting a thread for it.
  */
-Producer *producer_new(ResourceBuffer *rb) {
+Producer *producer_init(ResourceBuffer *rb) {
     // allocate memory for Producer
     Producer *p = malloc(sizeof(*p));
 
-    // set Producer struct properties and record producer to global array
-    p->id = pidx;
+    // set Producer struct properties
     p->bufferp = rb;
     p->resources_produced = 0;
-    p->status = PRODUCING;
-    producers[pidx] = p;
-    pidx++;
+    p->waiting_since = 0;
+    p->retiring = 0;
+    p->batch = NULL;
+    p->prepared = 0;
+    p->wal_seq = 0;
+    p->next = NULL;
+    p->task = 0;
+    p->task_next = NULL;
+
+    // record producer to global list
+    pthread_mutex_lock(&producerListMutex);
+    p->id = pidx++;
+    p->counters = thread_counters_new(STATS_PRODUCER, p->id);
+    delay_state_init(&p->delays, monotonic_ns() ^ ((uint64_t)p->id << 32));
+    rate_limit_init(&p->rate, producerRate.rate, producerRate.burst);
+    producer_set_status(p, PRODUCING);
+    p->prev = producerList->tail;
+    if (producerList->tail != NULL) {
+        producerList->tail->next = p;
+    }
+    else {
+        producerList->head = p;
+    }
+    producerList->tail = p;
+    producerList->count++;
+    pthread_mutex_unlock(&producerListMutex);
+    return p;
+}
+
+/**
+ * Create a new Producer struct to track a new producer thread.
+ * Memory will be allocated for the struct and a thread will be
+ * created, or a task started if the producer task engine is running.
+ */
+Producer *producer_new(ResourceBuffer *rb) {
+    Producer *p = producer_init(rb);
+
+    if (producerTasks.workers > 0) {
+        producer_task_start(p);
+    }
+    else {
+        // create the producer thread
+        pthread_create(&(p->thread), NULL, producer_produce, (void *)p);
+    }
 
-    // create the producer thread
-    pthread_create(&(p->thread), NULL, producer_produce, (void *)p);
+    // let monitors know about the new producer
+    monitor_push_reports();
 
     // return Producer to caller
     return p;
@@ -0,0 +1,459 @@
+/**
+ * @file
+ *
+ * The producer task engine runs producers as timer-driven tasks on a
+ * small pool of worker threads, so the server can stand in for a fleet
+ * of upstream sources far larger than it could run threads for. A task
+ * never blocks a worker: where a producer thread would sleep, the task
+ * sets a timer and returns; where it would wait for room in the buffer,
+ * it parks until a consumer makes room. Each topic keeps its own parked
+ * tasks, under its own lock. Where it would wait for its batch to be
+ * synced to the write-ahead log, it parks on the log (see wal_park()).
+ *
+ * Timers live in a hashed timer wheel of TASK_WHEEL_SLOTS slots, one per
+ * tick. A timer thread advances the wheel each tick and moves the tasks
+ * that are due to the run queue, where the workers pick them up. Timers
+ * further out than one turn of the wheel stay in their slot until their
+ * turn comes round.
+ *
+ * A task steps through the same states as a producer thread:
+ *
+ *   SLEEP      resting for producerRest; when it's over, prepare a batch
+ *              and publish it
+ *   THROTTLED  waiting for rate limit tokens for the batch, then publish it
+ *   WAITING    parked until there is room for the rest of the batch
+ *   PRODUCING  parked until the batch is synced to the write-ahead log, if
+ *              there is one, then spending produceDelay per resource;
+ *              when it's over, rest
+ *   PAUSED     held by an admin; when resumed, rest
+ */
+
+#include "server.h"
+
+#define TASK_WHEEL_SLOTS 4096
+
+// timer wheel; slot i holds the tasks due on ticks equal to i modulo the
+// wheel size
+static struct {
+    Producer *slots[TASK_WHEEL_SLOTS];
+    // the next tick to fire
+    uint64_t tick;
+    pthread_mutex_t mutex;
+} wheel;
+
+// tasks ready to run
+static struct {
+    Producer *head;
+    Producer *tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+} runQueue;
+
+// tasks held while producers are paused, protected by the pauseMutex
+static struct {
+    Producer *head;
+    Producer *tail;
+} held;
+
+/**
+ * Append a list of tasks, linked by task_next, to the run queue.
+ */
+static void task_run(Producer *head, Producer *tail) {
+    tail->task_next = NULL;
+    pthread_mutex_lock(&runQueue.mutex);
+    if (runQueue.tail != NULL) {
+        runQueue.tail->task_next = head;
+    }
+    else {
+        runQueue.head = head;
+    }
+    runQueue.tail = tail;
+    if (head == tail) {
+        pthread_cond_signal(&runQueue.ready);
+    }
+    else {
+        pthread_cond_broadcast(&runQueue.ready);
+    }
+    pthread_mutex_unlock(&runQueue.mutex);
+}
+
+/**
+ * Run the task again after delay ns.
+ */
+static void task_schedule(Producer *p, uint64_t delay) {
+    uint64_t tick;
+
+    p->task_next = NULL;
+    if (delay == 0) {
+        task_run(p, p);
+        return;
+    }
+    p->task_deadline = monotonic_ns() + delay;
+    tick = p->task_deadline / producerTasks.tick;
+
+    pthread_mutex_lock(&wheel.mutex);
+    // the wheel has already passed this tick
+    if (tick < wheel.tick) {
+        pthread_mutex_unlock(&wheel.mutex);
+        task_run(p, p);
+        return;
+    }
+    p->task_next = wheel.slots[tick % TASK_WHEEL_SLOTS];
+    wheel.slots[tick % TASK_WHEEL_SLOTS] = p;
+    pthread_mutex_unlock(&wheel.mutex);
+}
+
+/**
+ * Timer thread. Fires every tick up to now, then sleeps until the next.
+ */
+static void *task_timer_handler(void *unused) {
+    Producer *head, *tail, **pp, *p;
+    uint64_t now;
+
+    while (1) {
+        now = monotonic_ns();
+        if (wheel.tick * producerTasks.tick > now) {
+            delay_sleep_ns(wheel.tick * producerTasks.tick - now);
+            now = monotonic_ns();
+        }
+
+        // collect the due tasks, and hand them to the workers in one go
+        head = tail = NULL;
+        pthread_mutex_lock(&wheel.mutex);
+        for (; wheel.tick <= now / producerTasks.tick; wheel.tick++) {
+            pp = &wheel.slots[wheel.tick % TASK_WHEEL_SLOTS];
+            while ((p = *pp) != NULL) {
+                if (p->task_deadline / producerTasks.tick > wheel.tick) {
+                    // due on a later turn of the wheel
+                    pp = &p->task_next;
+                    continue;
+                }
+                *pp = p->task_next;
+                p->task_next = NULL;
+                if (tail != NULL) {
+                    tail->task_next = p;
+                }
+                else {
+                    head = p;
+                }
+                tail = p;
+            }
+        }
+        pthread_mutex_unlock(&wheel.mutex);
+
+        if (head != NULL) {
+            task_run(head, tail);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Prepare and publish a batch of resources, parking the task if the
+ * buffer fills before all of it is published.
+ */
+static void task_produce(Producer *p) {
+    ResourceBuffer *rb = p->bufferp;
+    uint64_t held;
+
+    if (p->status != WAITING) {
+        producer_prepare(p, produceBatch);
+    }
+
+    pthread_mutex_lock(&rb->mutex);
+    held = monotonic_ns();
+
+    // CRITICAL SECTION-------------------------------------------
+    if (p->task_woken) {
+        p->task_woken = 0;
+        __atomic_store_n(&rb->parked_woken, rb->parked_woken - 1, __ATOMIC_RELAXED);
+    }
+    if (p->status == WAITING && rb->count < rb->size) {
+        event_record(EVENT_WAIT_END, EVENT_SOURCE_PRODUCER, p->id, -1);
+        latency_record(LATENCY_PRODUCER_WAIT, held - p->task_waited);
+    }
+    producer_publish(p);
+
+    // the buffer is full
+    if (p->prepared > 0) {
+        // asked to retire before it could park; the rest of the batch
+        // is dropped unpublished
+        if (atomic_load_explicit(&p->retiring, memory_order_acquire)) {
+            pthread_mutex_unlock(&rb->mutex);
+            task_run(p, p);
+            return;
+        }
+        if (p->status != WAITING) {
+            log_debug("producer %d is waiting (%d to %d)...", p->id, rb->count, rb->size);
+            producer_set_status(p, WAITING);
+            event_record(EVENT_WAIT_START, EVENT_SOURCE_PRODUCER, p->id, -1);
+            counter_add(&p->counters->waits, 1);
+            p->task_waited = held;
+        }
+        atomic_store_explicit(&p->waiting_since, held, memory_order_relaxed);
+
+        // park until a consumer makes room
+        p->task_next = NULL;
+        if (rb->parked_tail != NULL) {
+            rb->parked_tail->task_next = p;
+        }
+        else {
+            rb->parked_head = p;
+        }
+        rb->parked_tail = p;
+        pthread_mutex_unlock(&rb->mutex);
+        return;
+    }
+
+    // END CRITICAL SECTION---------------------------------------
+
+    latency_record(LATENCY_PRODUCER_HOLD, monotonic_ns() - held);
+    pthread_mutex_unlock(&rb->mutex);
+
+    // the batch is produced once it is in the write-ahead log; park until
+    // the log thread runs the task again, with its wal_seq still set
+    producer_set_status(p, PRODUCING);
+    if (wal_park(p)) {
+        return;
+    }
+    p->wal_seq = 0;
+
+    // wait to produce more for produceDelay
+    task_schedule(p, producer_batch_delay(p, produceBatch));
+}
+
+/**
+ * Hand a list of tasks, linked by task_next, back to the workers. The
+ * write-ahead log calls this for the tasks a commit has synced.
+ */
+void producer_tasks_run(Producer *head, Producer *tail) {
+    task_run(head, tail);
+}
+
+/**
+ * Run one step of a task.
+ */
+static void task_step(Producer *p) {
+    if (atomic_load_explicit(&p->retiring, memory_order_acquire)) {
+        // a task woken for room it won't use passes the wakeup on
+        if (p->task_woken) {
+            pthread_mutex_lock(&p->bufferp->mutex);
+            __atomic_store_n(&p->bufferp->parked_woken, p->bufferp->parked_woken - 1, __ATOMIC_RELAXED);
+            producer_tasks_wake(p->bufferp);
+            pthread_mutex_unlock(&p->bufferp->mutex);
+        }
+        log_debug("producer %d retired after %d resources", p->id, p->resources_produced);
+        producer_remove(p);
+        return;
+    }
+
+    // a task back from the write-ahead log goes on to produceDelay
+    if (p->status == PRODUCING && p->wal_seq != 0) {
+        p->wal_seq = 0;
+        task_schedule(p, producer_batch_delay(p, produceBatch));
+        return;
+    }
+
+    // a task between batches holds while producers are paused
+    if (p->status != WAITING && p->status != THROTTLED
+        && atomic_load_explicit(&producersPaused, memory_order_acquire)
+        && producer_task_pause(p)) {
+        return;
+    }
+
+    if (p->status == PRODUCING || p->status == PAUSED) {
+        // time delay between productions
+        producer_set_status(p, SLEEP);
+        task_schedule(p, delay_sample(&producerRest, &p->delays));
+        return;
+    }
+    if (p->status == SLEEP) {
+        // wait for the rate limits to allow the batch
+        uint64_t wait;
+        producer_prepare(p, produceBatch);
+        if ((wait = producer_throttle(p, produceBatch)) > 0) {
+            producer_set_status(p, THROTTLED);
+            task_schedule(p, wait);
+            return;
+        }
+    }
+    task_produce(p);
+}
+
+/**
+ * Worker loop. Runs tasks from the run queue.
+ */
+static void *task_worker_handler(void *index) {
+    Producer *p;
+
+    affinity_place(AFFINITY_PRODUCER, (int)(intptr_t)index);
+
+    while (1) {
+        pthread_mutex_lock(&runQueue.mutex);
+        while (runQueue.head == NULL) {
+            pthread_cond_wait(&runQueue.ready, &runQueue.mutex);
+        }
+        p = runQueue.head;
+        runQueue.head = p->task_next;
+        if (runQueue.head == NULL) {
+            runQueue.tail = NULL;
+        }
+        pthread_mutex_unlock(&runQueue.mutex);
+
+        p->task_next = NULL;
+        task_step(p);
+    }
+    return NULL;
+}
+
+/**
+ * Wake the tasks that have waited longest for room in the buffer, one for
+ * each free slot that no woken task is on its way to fill. Called with the
+ * buffer's mutex held after each dequeue.
+ */
+void producer_tasks_wake(ResourceBuffer *rb) {
+    Producer *p;
+
+    while ((p = rb->parked_head) != NULL
+        && rb->parked_woken + rb->count < rb->size) {
+        rb->parked_head = p->task_next;
+        if (rb->parked_head == NULL) {
+            rb->parked_tail = NULL;
+        }
+        p->task_woken = 1;
+        __atomic_store_n(&rb->parked_woken, rb->parked_woken + 1, __ATOMIC_RELAXED);
+        atomic_store_explicit(&p->waiting_since, 0, memory_order_relaxed);
+        task_run(p, p);
+    }
+}
+
+/**
+ * Return the number of tasks woken for room in the buffer that haven't
+ * taken it yet. The watchdog counts that room as taken.
+ */
+int producer_tasks_woken(ResourceBuffer *rb) {
+    return __atomic_load_n(&rb->parked_woken, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start a Producer as a task. It begins by resting, as a producer thread
+ * does.
+ */
+void producer_task_start(Producer *p) {
+    p->task = 1;
+    p->task_woken = 0;
+    producer_set_status(p, SLEEP);
+    task_schedule(p, delay_sample(&producerRest, &p->delays));
+}
+
+/**
+ * Remove a task from a list linked by task_next. Returns 0 if it wasn't
+ * on the list.
+ */
+static int task_unlink(Producer **head, Producer **tail, Producer *p) {
+    Producer *q, *prev = NULL;
+
+    for (q = *head; q != NULL && q != p; q = q->task_next) {
+        prev = q;
+    }
+    if (q == NULL) {
+        return 0;
+    }
+    if (prev != NULL) {
+        prev->task_next = p->task_next;
+    }
+    else {
+        *head = p->task_next;
+    }
+    if (*tail == p) {
+        *tail = prev;
+    }
+    return 1;
+}
+
+/**
+ * Make a retiring task notice. A parked or held task is run again; any
+ * other task notices at its next step.
+ */
+void producer_task_retire(Producer *p) {
+    int found;
+
+    pthread_mutex_lock(&p->bufferp->mutex);
+    found = task_unlink(&p->bufferp->parked_head, &p->bufferp->parked_tail, p);
+    if (found) {
+        atomic_store_explicit(&p->waiting_since, 0, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&p->bufferp->mutex);
+    if (!found) {
+        pthread_mutex_lock(&pauseMutex);
+        found = task_unlink(&held.head, &held.tail, p);
+        pthread_mutex_unlock(&pauseMutex);
+    }
+    if (found) {
+        task_run(p, p);
+    }
+}
+
+/**
+ * Hold a task while producers are paused. Returns 0, leaving the task to
+ * carry on, if they were resumed in the meantime.
+ */
+int producer_task_pause(Producer *p) {
+    pthread_mutex_lock(&pauseMutex);
+    if (!atomic_load_explicit(&producersPaused, memory_order_relaxed)) {
+        pthread_mutex_unlock(&pauseMutex);
+        return 0;
+    }
+    producer_set_status(p, PAUSED);
+    p->task_next = NULL;
+    if (held.tail != NULL) {
+        held.tail->task_next = p;
+    }
+    else {
+        held.head = p;
+    }
+    held.tail = p;
+    pthread_mutex_unlock(&pauseMutex);
+    return 1;
+}
+
+/**
+ * Hand every held task back to the workers. Called with the pauseMutex
+ * held when producers are resumed.
+ */
+void producer_tasks_resume() {
+    if (held.head != NULL) {
+        task_run(held.head, held.tail);
+        held.head = held.tail = NULL;
+    }
+}
+
+/**
+ * Start the timer thread and the workers, if producerTasks.workers is set.
+ */
+int producer_tasks_start() {
+    pthread_t thread;
+    int i;
+
+    if (producerTasks.workers == 0) {
+        return 0;
+    }
+    pthread_mutex_init(&wheel.mutex, NULL);
+    pthread_mutex_init(&runQueue.mutex, NULL);
+    pthread_cond_init(&runQueue.ready, NULL);
+    wheel.tick = monotonic_ns() / producerTasks.tick;
+
+    if (pthread_create(&thread, NULL, task_timer_handler, NULL) < 0) {
+        log_error("could not create task timer thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    for (i = 0; i < producerTasks.workers; i++) {
+        if (pthread_create(&thread, NULL, task_worker_handler, (void *)(intptr_t)i) < 0) {
+            log_error("could not create task worker thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
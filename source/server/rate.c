@@ -0,0 +1,78 @@
+/**
+ * @file
+ *
+ * Token-bucket rate limits for production. A RateLimit lets through a
+ * given number of items per second, with bursts of up to burst items
+ * after an idle spell.
+ *
+ * The bucket is kept as a single theoretical arrival time (TAT): the
+ * time at which the next item would be on schedule. Taking n tokens
+ * moves the TAT on by n intervals with a compare-and-swap, so refilling
+ * needs no lock, and the taker learns at once how long it must wait for
+ * its tokens instead of polling for them. Times are kept in 1/RATE_SCALE
+ * ns so that rates that don't divide a second evenly stay exact.
+ *
+ * A taker that oversleeps is treated like one that was idle: it gets at
+ * most burst items' worth of credit back. So at rates where an interval
+ * is close to how long a sleep overshoots, a burst of 1 runs below the
+ * rate, and a larger burst is what absorbs the overshoot.
+ */
+
+#include "server.h"
+
+#define RATE_SCALE 16
+
+/**
+ * Parse a rate such as "5000" or "5000:64" (items per second, then an
+ * optional burst size). Returns -1 if the string isn't a rate.
+ */
+int rate_parse(const char *s, double *rate, int *burst) {
+    char *end;
+
+    *rate = strtod(s, &end);
+    if (end == s || *rate <= 0) {
+        return -1;
+    }
+    *burst = 1;
+    if (*end == ':') {
+        s = end + 1;
+        *burst = strtol(s, &end, 10);
+        if (end == s || *burst < 1) {
+            return -1;
+        }
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/**
+ * Set up a RateLimit for rate items per second, with bursts of up to
+ * burst items. A rate of 0 means no limit.
+ */
+void rate_limit_init(RateLimit *rl, double rate, int burst) {
+    rl->rate = rate;
+    rl->interval = rate > 0 ? (uint64_t)(RATE_SCALE * 1e9 / rate + 0.5) : 0;
+    rl->tolerance = rl->interval * (burst > 1 ? burst - 1 : 0);
+    atomic_init(&rl->tat, 0);
+}
+
+/**
+ * Take n tokens, and return how many ns the caller must wait before they
+ * are available (0 if they are available now).
+ */
+uint64_t rate_limit_take(RateLimit *rl, int n) {
+    uint64_t now, ready, tat;
+
+    if (rl->interval == 0) {
+        return 0;
+    }
+    now = monotonic_ns() * RATE_SCALE;
+    tat = atomic_load_explicit(&rl->tat, memory_order_relaxed);
+    do {
+        // a bucket left idle fills up to the burst size and no further,
+        // however the idle time came about
+        ready = tat + rl->tolerance < now ? now - rl->tolerance : tat;
+    } while (!atomic_compare_exchange_weak_explicit(&rl->tat, &tat,
+        ready + n * rl->interval, memory_order_relaxed, memory_order_relaxed));
+
+    return ready > now ? (ready - now) / RATE_SCALE : 0;
+}
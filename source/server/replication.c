@@ -0,0 +1,477 @@
+/**
+ * @file
+ *
+ * Replication keeps a standby server ready to take over from a primary.
+ * The primary, run with --replicate=<port>, accepts one standby at a time
+ * on that local port. The standby, run with --standby=<port>, attaches and
+ * keeps a replica of the default topic's buffer until the primary goes
+ * away, then puts the replica in its own buffer and starts serving on the
+ * application port in the primary's place.
+ *
+ * The standby doesn't take over just because the stream closed. It tries
+ * to attach again, and only takes over once the replication port can't
+ * be reached and nothing accepts on the application port either. A
+ * primary that is up but hung, or cut off from the standby some other
+ * way, isn't detected; there is no fencing.
+ *
+ * The stream is the write-ahead log's records (see wal.c), after a header
+ * and a snapshot:
+ *
+ *   "PCRP"  version (1 byte)  ridx (4 bytes)  snapshot count (4 bytes)
+ *   count produce records, one per resource in the buffer on attach
+ *   produce and consume records as they happen
+ *
+ * Replication is asynchronous. Records are copied into a bounded ring,
+ * under a lock of its own, by the threads that make them, and a sender
+ * thread writes them to the standby. Nothing on the produce path waits
+ * for the standby: if it falls so far behind that the ring fills, the
+ * primary drops it with a WAL_RESYNC record, and it attaches again for a
+ * fresh snapshot. So the replica is never more than REPLICATION_RING
+ * records, plus what the socket buffers hold, behind.
+ *
+ * Like the log, the replica holds what was produced and not yet consumed
+ * (acked, in ack mode), so resources in flight when the primary dies are
+ * delivered again by the standby. Resources already in flight when the
+ * standby attaches aren't in its snapshot.
+ */
+
+#include "server.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define REPLICATION_MAGIC "PCRP"
+#define REPLICATION_VERSION 1
+#define REPLICATION_RING 65536
+#define REPLICATION_HEADER 13
+#define REPLICATION_RETRY_NS 100000000ull
+#define REPLICATION_PROBES 3
+
+static pthread_mutex_t replicationMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replicationReady = PTHREAD_COND_INITIALIZER;
+// records not yet sent to the standby are ring[sent..appended)
+static WalRecord ring[REPLICATION_RING];
+static uint64_t sent;
+static uint64_t appended;
+static _Atomic int attached;
+static int lagged;
+
+// the standby's replica: resources in the order they were produced
+static Resource *replicaHead;
+static Resource *replicaTail;
+static int replicaCount;
+static int replicaRidx;
+
+/**
+ * Add records for n resources, linked by next from r, to the ring for the
+ * standby. Never blocks on the standby: a full ring drops it instead.
+ */
+void replication_append(int type, Resource *r, int n) {
+    int i;
+
+    if (!atomic_load_explicit(&attached, memory_order_relaxed)) {
+        return;
+    }
+    pthread_mutex_lock(&replicationMutex);
+    for (i = 0; i < n && !lagged; i++, r = r->next) {
+        if (appended - sent == REPLICATION_RING) {
+            lagged = 1;
+            break;
+        }
+        ring[appended % REPLICATION_RING].type = type;
+        ring[appended % REPLICATION_RING].id = r->id;
+        ring[appended % REPLICATION_RING].produced_by = r->produced_by;
+        appended++;
+    }
+    pthread_cond_signal(&replicationReady);
+    pthread_mutex_unlock(&replicationMutex);
+}
+
+/**
+ * Return the number of records waiting to be sent to the standby.
+ */
+int replication_lag() {
+    int lag;
+
+    pthread_mutex_lock(&replicationMutex);
+    lag = (int)(appended - sent);
+    pthread_mutex_unlock(&replicationMutex);
+    return lag;
+}
+
+/**
+ * Write all of a buffer to the standby. Returns -1 if it has gone.
+ */
+static int replication_write(int sock, const void *data, size_t length) {
+    const char *p = data;
+    ssize_t n;
+
+    while (length > 0) {
+        if ((n = write(sock, p, length)) <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Read all of a buffer from the primary. Returns -1 if it has gone.
+ */
+static int replication_read(int sock, void *data, size_t length) {
+    char *p = data;
+    ssize_t n;
+
+    while (length > 0) {
+        if ((n = read(sock, p, length)) <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Send a newly attached standby the header and a snapshot of the default
+ * topic's buffer. The snapshot is taken under the buffer's mutex, which
+ * produce records are also added under, so the stream carries on exactly
+ * where the snapshot ends.
+ */
+static int replication_attach(int sock) {
+    ResourceBuffer *rb = globalResourceBuffer;
+    WalRecord *snapshot;
+    char header[REPLICATION_HEADER] = REPLICATION_MAGIC;
+    int32_t id, count = 0;
+    Resource *r;
+    int k, result;
+
+    pthread_mutex_lock(&rb->mutex);
+    pthread_mutex_lock(&replicationMutex);
+    snapshot = malloc((rb->count + 1) * sizeof(*snapshot));
+    for (r = resource_buffer_walk(rb, NULL, &k); r != NULL; r = resource_buffer_walk(rb, r, &k)) {
+        snapshot[count].type = WAL_PRODUCE;
+        snapshot[count].id = r->id;
+        snapshot[count].produced_by = r->produced_by;
+        count++;
+    }
+    id = atomic_load(&ridx);
+    sent = appended = 0;
+    lagged = 0;
+    atomic_store(&attached, 1);
+    pthread_mutex_unlock(&replicationMutex);
+    pthread_mutex_unlock(&rb->mutex);
+
+    header[4] = REPLICATION_VERSION;
+    memcpy(header + 5, &id, 4);
+    memcpy(header + 9, &count, 4);
+    result = replication_write(sock, header, sizeof(header));
+    if (result == 0) {
+        result = replication_write(sock, snapshot, count * sizeof(*snapshot));
+    }
+    free(snapshot);
+    log_info("standby attached, %d resources in its snapshot", count);
+    return result;
+}
+
+/**
+ * Send records to the standby as they come, until it goes or falls too
+ * far behind. The records are written straight from the ring, without
+ * the lock: appenders don't reuse a slot until sent has moved past it,
+ * and only this thread moves sent, once the write is done.
+ */
+static void replication_stream(int sock) {
+    WalRecord resync = { WAL_RESYNC, -1, -1 };
+    uint64_t from, n, first;
+    int result;
+
+    while (1) {
+        pthread_mutex_lock(&replicationMutex);
+        while (sent == appended && !lagged) {
+            pthread_cond_wait(&replicationReady, &replicationMutex);
+        }
+        if (lagged) {
+            atomic_store(&attached, 0);
+            pthread_mutex_unlock(&replicationMutex);
+            log_error("standby fell %d records behind; resyncing it", REPLICATION_RING);
+            replication_write(sock, &resync, sizeof(resync));
+            return;
+        }
+        from = sent;
+        n = appended - sent;
+        pthread_mutex_unlock(&replicationMutex);
+
+        // ring[from..from + n) may wrap around the end of the ring
+        first = REPLICATION_RING - from % REPLICATION_RING;
+        if (first > n) {
+            first = n;
+        }
+        result = replication_write(sock, ring + from % REPLICATION_RING, first * sizeof(*ring));
+        if (result == 0 && n > first) {
+            result = replication_write(sock, ring, (n - first) * sizeof(*ring));
+        }
+
+        pthread_mutex_lock(&replicationMutex);
+        sent = from + n;
+        pthread_mutex_unlock(&replicationMutex);
+        if (result < 0) {
+            atomic_store(&attached, 0);
+            log_error("standby detached");
+            return;
+        }
+    }
+}
+
+/**
+ * Primary's replication listener. Serves one standby at a time.
+ */
+static void *replication_listen(void *sockp) {
+    int listen_sock = (int)(intptr_t)sockp, sock;
+
+    while ((sock = accept(listen_sock, NULL, NULL)) >= 0) {
+        if (replication_attach(sock) == 0) {
+            replication_stream(sock);
+        }
+        else {
+            atomic_store(&attached, 0);
+        }
+        close(sock);
+    }
+    perror("replication accept");
+    return NULL;
+}
+
+/**
+ * Start accepting a standby on replication.port, if it is set. Called
+ * once the default topic's buffer is ready.
+ */
+int replication_start() {
+    struct sockaddr_in server;
+    pthread_t thread;
+    int sock, opt = 1;
+
+    if (replication.port == 0) {
+        return 0;
+    }
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("replication socket");
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(replication.port);
+    if (bind(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+        perror("replication bind");
+        close(sock);
+        return -1;
+    }
+    listen(sock, 1);
+    if (pthread_create(&thread, NULL, replication_listen, (void *)(intptr_t)sock) != 0) {
+        log_error("could not create replication thread");
+        close(sock);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Drop the standby's replica, for a fresh snapshot.
+ */
+static void replica_clear() {
+    Resource *r;
+
+    while ((r = replicaHead) != NULL) {
+        replicaHead = r->next;
+        free(r);
+    }
+    replicaTail = NULL;
+    replicaCount = 0;
+}
+
+/**
+ * Apply one record to the standby's replica. Consumes are nearly always
+ * of the oldest resources, so the search for one rarely goes far.
+ */
+static void replica_apply(WalRecord *record) {
+    Resource *r, *prev = NULL;
+
+    if (record->id >= replicaRidx) {
+        replicaRidx = record->id + 1;
+    }
+    if (record->type == WAL_PRODUCE) {
+        r = malloc(sizeof(*r));
+        r->id = record->id;
+        r->produced_by = record->produced_by;
+        r->next = NULL;
+        if (replicaTail != NULL) {
+            replicaTail->next = r;
+        }
+        else {
+            replicaHead = r;
+        }
+        replicaTail = r;
+        replicaCount++;
+        return;
+    }
+    // a consume of a resource taken before the snapshot has nothing to do
+    for (r = replicaHead; r != NULL; prev = r, r = r->next) {
+        if (r->id == record->id) {
+            if (prev != NULL) {
+                prev->next = r->next;
+            }
+            else {
+                replicaHead = r->next;
+            }
+            if (replicaTail == r) {
+                replicaTail = prev;
+            }
+            replicaCount--;
+            free(r);
+            return;
+        }
+    }
+}
+
+/**
+ * Connect to a local port. Returns the socket, or -1.
+ */
+static int replica_connect(int port) {
+    struct sockaddr_in server;
+    int sock;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Check that the primary is gone, and not just its replication stream:
+ * it is only taken to be gone once nothing accepts on the application
+ * port it serves, REPLICATION_PROBES times running.
+ */
+static int replica_primary_gone() {
+    int sock, i;
+
+    for (i = 0; i < REPLICATION_PROBES; i++) {
+        if ((sock = replica_connect(APPLICATION_PORT)) >= 0) {
+            close(sock);
+            return 0;
+        }
+        delay_sleep_ns(REPLICATION_RETRY_NS);
+    }
+    return 1;
+}
+
+/**
+ * Follow the primary on replication.standby, keeping a replica of its
+ * default topic, and return once it is gone. Waits for the primary to
+ * come up, and attaches again after a resync or whenever the stream
+ * closes while the primary is still up. Returns -1 if the primary speaks
+ * something else.
+ */
+int replication_follow() {
+    char header[REPLICATION_HEADER];
+    WalRecord records[256];
+    int32_t id, count;
+    int sock, followed = 0, i, n;
+    size_t have;
+    ssize_t got;
+
+    printf("Standby: following the primary on port %d\n", replication.standby);
+    fflush(stdout);
+    while (1) {
+        // the primary may not be up yet; once it has been, one that can't
+        // be reached may be gone, but is only taken over from once it is
+        // no longer serving clients either
+        while ((sock = replica_connect(replication.standby)) < 0) {
+            if (followed && replica_primary_gone()) {
+                return 0;
+            }
+            delay_sleep_ns(REPLICATION_RETRY_NS);
+        }
+        if (replication_read(sock, header, sizeof(header)) < 0) {
+            close(sock);
+            continue;
+        }
+        if (memcmp(header, REPLICATION_MAGIC, 4) != 0 || header[4] != REPLICATION_VERSION) {
+            fprintf(stderr, "port %d is not a primary's replication port\n", replication.standby);
+            close(sock);
+            return -1;
+        }
+        followed = 1;
+        memcpy(&id, header + 5, 4);
+        memcpy(&count, header + 9, 4);
+        replica_clear();
+        replicaRidx = id;
+        log_info("attached to the primary, %d resources in the snapshot", count);
+
+        // the snapshot, then records as they come, until the primary goes
+        // or asks for a resync
+        have = 0;
+        while ((got = read(sock, (char *)records + have, sizeof(records) - have)) > 0) {
+            have += got;
+            n = have / sizeof(*records);
+            for (i = 0; i < n; i++) {
+                if (records[i].type == WAL_RESYNC) {
+                    break;
+                }
+                replica_apply(&records[i]);
+            }
+            if (i < n) {
+                break;
+            }
+            have -= n * sizeof(*records);
+            memmove(records, (char *)records + n * sizeof(*records), have);
+        }
+        close(sock);
+        if (got <= 0) {
+            // the stream closed: attach again, or take over if the primary
+            // has gone
+            log_error("standby lost the primary's stream");
+            continue;
+        }
+        log_error("standby resyncing with the primary");
+    }
+}
+
+/**
+ * Put the standby's replica in the default topic's buffer, and carry ridx
+ * on from the primary's. Called after replication_follow() returns, before
+ * any producer or consumer starts. Returns the number of resources.
+ */
+int replication_restore(ResourceBuffer *rb) {
+    Resource *r;
+    int restored = replicaCount;
+
+    if (replication.standby == 0) {
+        return 0;
+    }
+    while ((r = replicaHead) != NULL) {
+        replicaHead = r->next;
+        r->produced_at = monotonic_ns();
+        resource_buffer_append(rb, r, r, 1);
+    }
+    replicaTail = NULL;
+    replicaCount = 0;
+
+    // the buffer may be smaller than the primary's; consumers drain the excess
+    rb->excess = rb->count > rb->size ? rb->count - rb->size : 0;
+    atomic_store(&ridx, replicaRidx);
+    counter_add(&serverCounters->recovered.value, restored);
+    printf("Standby: took over from the primary with %d resources\n", restored);
+    return restored;
+}
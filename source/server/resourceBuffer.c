@@ -16,9 +16,37 @@ ResourceBuffer *resource_buffer_new(int bufferSize) {
     ResourceBuffer *rb = malloc(sizeof(*rb));
     rb->count = 0;
     rb->size = bufferSize;
+    rb->head = NULL;
+    rb->tail = NULL;
+    rb->excess = 0;
+    rb->name = NULL;
+    rb->producers = 0;
+    rb->parked_head = NULL;
+    rb->parked_tail = NULL;
+    rb->parked_woken = 0;
+    rb->partitions = 0;
+    rb->partition = NULL;
+    rb->next = NULL;
+    pthread_mutex_init(&rb->mutex, NULL);
+    pthread_cond_init(&rb->hasRoom, NULL);
+    pthread_cond_init(&rb->notEmpty, NULL);
     return rb;
 }
 
+/**
+ * Find a topic by name. Returns NULL if there is no such topic.
+ */
+ResourceBuffer *resource_buffer_find(const char *name) {
+    ResourceBuffer *rb;
+
+    for (rb = topics; rb != NULL; rb = rb->next) {
+        if (strcmp(rb->name, name) == 0) {
+            return rb;
+        }
+    }
+    return NULL;
+}
+
 /**
  * Allocate memory for a resource, intialize the resource. Note that a 
  * global increment (ridx) is used to assign unique id's to each 
@@ -27,7 +55,8 @@ ResourceBuffer *resource_buffer_new(int bufferSize) {
 Resource *resource_new(int i) {
     Resource *r = malloc(sizeof(*r));
     r->produced_by = i;
-    r->id = ridx++;
+    r->id = atomic_fetch_add_explicit(&ridx, 1, memory_order_relaxed);
+    r->produced_at = monotonic_ns();
     r->next = NULL;
     return r;
 }
@@ -40,26 +69,30 @@ Resource *resource_new(int i) {
  * updated.
  */
 int resource_buffer_enqueue(ResourceBuffer *rb, Resource *r) {
+    if (rb->partitions > 0 && rb->count < rb->size) {
+        resource_buffer_append(rb, r, r, 1);
+        return 0;
+    }
     if (rb->count == 0) {
         rb->head = r;
+        rb->tail = r;
         rb->count++;
-        if (debug.print) printf("enqueued r%d (count=%d)\n", r->id, rb->count);
+        stats_buffer(rb);
+        log_trace("enqueued r%d (count=%d)", r->id, rb->count);
         monitor_push_reports();
         return 0;
     }
     else if (rb->count < rb->size) {
-        Resource *temp = rb->head;
-        while (temp->next != NULL) {
-            temp = temp->next;
-        }
-        temp->next = r;
+        rb->tail->next = r;
+        rb->tail = r;
         rb->count++;
-        if (debug.print) printf("enqueued r%d (count=%d)\n", r->id, rb->count);
+        stats_buffer(rb);
+        log_trace("enqueued r%d (count=%d)", r->id, rb->count);
         monitor_push_reports();
         return 0;
     }
     else {
-        if (debug.print) printf("refusing to enqueue r%d\n", r->id);
+        log_debug("refusing to enqueue r%d", r->id);
         return -1;
     }
 }
@@ -76,23 +109,122 @@ int resource_buffer_dequeue(ResourceBuffer *rb, Resource **r) {
         return -1;
     }
     else {
-        if (debug.print) printf("setting *r to head\n");
+        log_trace("setting *r to head");
         *r = rb->head;
         if (rb->count > 1) {
             rb->head = rb->head->next;
         }
         else {
             rb->head = NULL;
+            rb->tail = NULL;
         }
     }
     rb->count--;
+    if (rb->excess > 0) {
+        rb->excess = rb->count > rb->size ? rb->count - rb->size : 0;
+    }
+    stats_buffer(rb);
 
-    if (debug.print) printf("r%d dequeued (count = %d).\n", (*r)->id, rb->count);
+    log_trace("r%d dequeued (count = %d).", (*r)->id, rb->count);
     
     monitor_push_reports();
     return 0;
 }
 
+/**
+ * Add a chain of n resources, linked from first to last, to the end of
+ * the ResourceBuffer in one step, or of their partition if the buffer is
+ * partitioned. The caller makes sure they fit.
+ * Note that mutex protection should be handled by the caller.
+ */
+void resource_buffer_append(ResourceBuffer *rb, Resource *first, Resource *last, int n) {
+    if (rb->partitions > 0) {
+        partition_append(rb, first, last, n);
+    }
+    else {
+        last->next = NULL;
+        if (rb->count == 0) {
+            rb->head = first;
+        }
+        else {
+            rb->tail->next = first;
+        }
+        rb->tail = last;
+    }
+    rb->count += n;
+    stats_buffer(rb);
+    log_trace("enqueued r%d to r%d (count=%d)", first->id, last->id, rb->count);
+    monitor_push_reports();
+}
+
+/**
+ * Change the size of the ResourceBuffer. Growing takes effect at once.
+ * Shrinking below the current count keeps every resource: consumers
+ * drain the excess, and producers find the buffer full until they have.
+ * Note that mutex protection should be handled by the caller, who should
+ * also wake producers waiting for room.
+ */
+void resource_buffer_resize(ResourceBuffer *rb, int size) {
+    rb->size = size;
+    rb->excess = rb->count > size ? rb->count - size : 0;
+    stats_buffer(rb);
+    log_debug("buffer resized to %d (count=%d)", size, rb->count);
+    monitor_push_reports();
+}
+
+/**
+ * Put a resource that was delivered but never acked back at the head of
+ * the ResourceBuffer, or of its partition, so it is delivered again next.
+ * It was already counted once in the buffer, so it goes back even if the
+ * buffer is full, and counts as excess until consumers drain it.
+ * Note that mutex protection should be handled by the caller, who should
+ * also wake a consumer.
+ */
+void resource_buffer_requeue(ResourceBuffer *rb, Resource *r) {
+    if (rb->partitions > 0) {
+        partition_prepend(rb, r);
+    }
+    else {
+        r->next = rb->head;
+        rb->head = r;
+        if (rb->tail == NULL) {
+            rb->tail = r;
+        }
+    }
+    rb->count++;
+    rb->excess = rb->count > rb->size ? rb->count - rb->size : 0;
+    stats_buffer(rb);
+    log_trace("requeued r%d (count=%d)", r->id, rb->count);
+    monitor_push_reports();
+}
+
+/**
+ * Step through the resources in the ResourceBuffer: pass NULL for the
+ * first, then the previous one for each next. A partitioned buffer is
+ * walked one partition after another, with k tracking the partition.
+ * Returns NULL after the last.
+ */
+Resource *resource_buffer_walk(ResourceBuffer *rb, Resource *r, int *k) {
+    if (rb->partitions == 0) {
+        return r == NULL ? rb->head : r->next;
+    }
+    if (r == NULL) {
+        *k = 0;
+    }
+    else if (r->next != NULL) {
+        return r->next;
+    }
+    else {
+        (*k)++;
+    }
+    for (; *k < rb->partitions; (*k)++) {
+        if (rb->partition[*k].head != NULL) {
+            return rb->partition[*k].head;
+        }
+    }
+    return NULL;
+}
+
 /**
  * This debugging function will print the given ResourceBuffer's contents
  * into stdout.
@@ -103,10 +235,11 @@ void resource_buffer_print(ResourceBuffer *rb) {
         printf("empty\n");
     }
     else {
-        Resource *temp = rb->head;
+        int k;
+        Resource *temp = resource_buffer_walk(rb, NULL, &k);
         while (temp != NULL) {
             printf("r%d in buffer\n", temp->id);
-            temp = temp->next;
+            temp = resource_buffer_walk(rb, temp, &k);
         }
     }
     printf("-------------------\n");
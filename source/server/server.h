@@ -11,19 +11,76 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "stats.h"
 
 #define APPLICATION_PORT 60118
-#define MAX_PRODUCERS 128
+#define METRICS_PORT 60119
+
+// Delays with an arrival distribution and nanosecond resolution
+enum { DELAY_FIXED, DELAY_EXPONENTIAL, DELAY_BURST };
+typedef struct _Delay Delay;
+struct _Delay {
+    int kind;
+    uint64_t mean;
+    int burst;
+    // odd while delay_publish() is changing the delay
+    _Atomic unsigned seq;
+};
+// per-thread random state for drawing delays
+typedef struct _DelayState DelayState;
+struct _DelayState {
+    uint64_t rng;
+    int burst_pos;
+};
+int delay_parse(const char *, Delay *);
+void delay_set(Delay *, uint64_t ns);
+char *delay_format(const Delay *, char *, size_t);
+void delay_publish(Delay *, const Delay *);
+void delay_state_init(DelayState *, uint64_t seed);
+uint64_t delay_sample(const Delay *, DelayState *);
+void delay_sleep_ns(uint64_t ns);
+void delay_sleep(const Delay *, DelayState *);
+// delays shorter than this are busy-waited rather than slept
+_Atomic uint64_t spinThreshold;
+
+// Token-bucket rate limits
+typedef struct _RateLimit RateLimit;
+struct _RateLimit {
+    // items per second, as configured; 0 means no limit
+    double rate;
+    // theoretical arrival time of the next item, in 1/16 ns
+    _Atomic uint64_t tat;
+    // time per item, and how far ahead of schedule a burst may run
+    uint64_t interval;
+    uint64_t tolerance;
+};
+int rate_parse(const char *, double *, int *);
+void rate_limit_init(RateLimit *, double rate, int burst);
+uint64_t rate_limit_take(RateLimit *, int n);
 
 // behavioral settings
-int consumeDelay;
-int consumerRest;
-int produceDelay;
-int producerRest;
+Delay consumeDelay;
+Delay consumerRest;
+Delay produceDelay;
+Delay producerRest;
 int bufferSize;
 int numProducers;
+// resources a producer prepares and publishes per lock acquisition
+int produceBatch;
+// limit on production by all producers together
+RateLimit productionRate;
+// limit on production by each producer; a rate of 0 means no limit
+struct {
+    double rate;
+    int burst;
+} producerRate;
+// in-process consumers that take resources without a client socket
+int virtualConsumers;
 
-int reset();
+// apply a changed bufferSize to the running buffer
+int reset(int);
 
 
 // Resource data
@@ -32,30 +89,96 @@ struct _Resource {
     int id;
     int produced_by;
     int consumed_by;
+    uint64_t produced_at;
+    // ack mode: the topic it was delivered from, and when it goes back
+    // there unless it is acked
+    struct _ResourceBuffer *bufferp;
+    uint64_t deadline;
     Resource *next;
 };
 Resource *resource_new(int);
-int ridx;
+_Atomic int ridx;
 
 
-// ResourceBuffer linked list structure
+// A key partition of a ResourceBuffer: a queue of its own, the consumer
+// that owns it, and whether a resource from it is being consumed
+typedef struct _Partition Partition;
+struct _Partition {
+    Resource *head;
+    Resource *tail;
+    int count;
+    struct _ConsumerService *owner;
+    int busy;
+};
+
+// ResourceBuffer linked list structure. Each named topic has a buffer of
+// its own, with its own lock, so topics don't contend with each other
 typedef struct _ResourceBuffer ResourceBuffer;
 struct _ResourceBuffer {
     int size;
     int count;
     Resource *head;
+    Resource *tail;
+    // resources over size left after the buffer shrank, still draining
+    int excess;
+    // the topic's name, and the producers started for it
+    char *name;
+    int producers;
+    // protects the buffer, and is waited on for room or resources
+    pthread_mutex_t mutex;
+    pthread_cond_t hasRoom;
+    pthread_cond_t notEmpty;
+    // producer tasks waiting for room, and the number woken for room
+    // that haven't run yet
+    struct _Producer *parked_head;
+    struct _Producer *parked_tail;
+    int parked_woken;
+    // in partitioned mode, resources are queued by key in partitions
+    // rather than in the list at head
+    int partitions;
+    Partition *partition;
+    ResourceBuffer *next;
 };
 ResourceBuffer *resource_buffer_new(int);
+ResourceBuffer *resource_buffer_find(const char *);
+int resource_buffer_enqueue(ResourceBuffer*, Resource*);
+int resource_buffer_dequeue(ResourceBuffer*, Resource**);
+void resource_buffer_append(ResourceBuffer*, Resource*, Resource*, int);
+void resource_buffer_resize(ResourceBuffer*, int);
+Resource *resource_buffer_walk(ResourceBuffer*, Resource*, int *);
+void resource_buffer_requeue(ResourceBuffer*, Resource*);
+// the default topic, which is also the head of the topic list
 ResourceBuffer *globalResourceBuffer;
+/**
+ * topics lists every topic, the default first. Topics are made at startup
+ * and never removed, so the list is walked without a lock. A thread that
+ * holds more than one topic's mutex takes them in list order.
+ */
+ResourceBuffer *topics;
 void resource_buffer_test(ResourceBuffer*);
 void resource_buffer_print(ResourceBuffer*);
+void stats_buffer(ResourceBuffer*);
 int initialize_producers(ResourceBuffer*, int);
-pthread_mutex_t bufferMutex;
-pthread_cond_t bufferHasRoom;
-pthread_cond_t bufferNotEmpty;
+
+
+// Shared-memory stats page and per-thread counters
+enum { STATS_PRODUCER, STATS_CONSUMER };
+ServerCounters *serverCounters;
+int stats_open();
+void stats_close();
+const char *stats_name();
+ThreadCounters *thread_counters_new(int kind, int id);
+void thread_counters_free(ThreadCounters *);
+void thread_counters_set_status(ThreadCounters *, int);
+void counter_add(_Atomic uint64_t *, uint64_t);
+uint64_t counter_get(_Atomic uint64_t *);
+int metrics_start();
 
 
 // Producer
+// producer states: resting, producing, exporting to the buffer, waiting for
+// room, waiting for rate limit tokens, held by an admin
+enum { SLEEP, PRODUCING, EXPORT, WAITING, THROTTLED, PAUSED };
 typedef struct _Producer Producer;
 struct _Producer {
     int id;
@@ -63,13 +186,124 @@ struct _Producer {
     pthread_t thread;
     ResourceBuffer *bufferp;
     int status;
+    ThreadCounters *counters;
+    DelayState delays;
+    RateLimit rate;
+    // the core the producer last ran on
+    int cpu;
+    // when the producer started waiting for room, or 0
+    _Atomic uint64_t waiting_since;
+    // set to ask the producer to finish up and exit
+    _Atomic int retiring;
+    // resources prepared but not yet published to the buffer
+    Resource *batch;
+    int prepared;
+    Producer *next;
+    Producer *prev;
+    // run as a task by the producer task engine rather than on a thread
+    int task;
+    // task engine: the next task in a timer wheel slot, the run queue or
+    // the tasks waiting for room; when its timer fires; when it started
+    // waiting for room
+    Producer *task_next;
+    uint64_t task_deadline;
+    uint64_t task_waited;
+    // woken for room in the buffer and not yet run
+    int task_woken;
+    // the write-ahead log commit its last published resources wait for
+    uint64_t wal_seq;
+};
+// Producer linked list
+typedef struct _ProducerList ProducerList;
+struct _ProducerList {
+    Producer *head;
+    Producer *tail;
+    int count;
 };
 /**
- * producers helps us track all of our Producer instances
+ * producerList helps us track all of our live Producer instances.
+ * Producers come and go at runtime, so it is protected by mutex.
  */ 
-Producer *producers[MAX_PRODUCERS];
+ProducerList *producerList;
+pthread_mutex_t producerListMutex;
 int pidx;
 Producer *producer_new(ResourceBuffer*);
+Producer *producer_init(ResourceBuffer*);
+int producer_produce_one(Producer *);
+void producer_prepare(Producer *, int);
+int producer_publish(Producer *);
+uint64_t producer_batch_delay(Producer *, int);
+uint64_t producer_throttle(Producer *, int);
+void producer_set_status(Producer *, int);
+void producer_retire(Producer *);
+void producer_remove(Producer *);
+// set while an admin holds all producers before their next batch
+_Atomic int producersPaused;
+pthread_mutex_t pauseMutex;
+pthread_cond_t pauseLifted;
+void producer_pause(int);
+int producer_wait_unpaused(Producer *);
+
+
+// Producer task engine
+// run producers as timer-driven tasks on this many worker threads instead
+// of a thread each; 0 uses threads. Timers fire on ticks of tick ns
+struct {
+    int workers;
+    uint64_t tick;
+} producerTasks;
+int producer_tasks_start();
+void producer_task_start(Producer *);
+void producer_task_retire(Producer *);
+void producer_tasks_wake(ResourceBuffer *);
+int producer_tasks_woken(ResourceBuffer *);
+int producer_task_pause(Producer *);
+void producer_tasks_resume();
+void producer_tasks_run(Producer *, Producer *);
+
+
+// Thread placement
+enum { AFFINITY_NONE, AFFINITY_SPREAD, AFFINITY_COMPACT, AFFINITY_SPLIT };
+enum { AFFINITY_PRODUCER, AFFINITY_CONSUMER };
+struct {
+    int policy;
+    // cpu list for the housekeeping threads, or NULL for the first core
+    char *housekeeping;
+} affinity;
+int affinity_parse(const char *);
+int affinity_init();
+void affinity_place(int role, int index);
+void affinity_housekeep();
+int affinity_cpu();
+
+
+// Autoscaler
+// producers are kept between min and max; max of 0 disables autoscaling
+struct {
+    int min;
+    int max;
+    uint64_t interval;
+} autoscale;
+int autoscale_start(ResourceBuffer *);
+
+
+// Latency histograms
+// one bucket per value below 16, then 16 buckets per power of two
+#define LATENCY_BUCKETS 976
+enum { LATENCY_PRODUCER_WAIT, LATENCY_CONSUMER_WAIT,
+    LATENCY_PRODUCER_HOLD, LATENCY_CONSUMER_HOLD,
+    LATENCY_PRODUCE_TO_CONSUME, LATENCY_KINDS };
+typedef struct _LatencyHistogram LatencyHistogram;
+struct _LatencyHistogram {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+extern const char *latency_names[LATENCY_KINDS];
+void latency_record(int kind, uint64_t ns);
+void latency_snapshot(int kind, LatencyHistogram *);
+uint64_t latency_percentile(LatencyHistogram *, double q);
+void latency_dump(FILE *);
 
 
 // Environmental variables for various thread arguments
@@ -79,17 +313,53 @@ struct _environment {
     ResourceBuffer *bufferp;
 };
 Environment *env;
+// accept client connections until the socket fails
+int server_listen(Environment *);
+
+
+// Event ring
+#define EVENT_RING_SIZE 4096
+enum { EVENT_PRODUCE, EVENT_CONSUME, EVENT_WAIT_START, EVENT_WAIT_END,
+    EVENT_CONNECT, EVENT_DISCONNECT };
+enum { EVENT_SOURCE_PRODUCER, EVENT_SOURCE_CONSUMER };
+typedef struct _Event Event;
+struct _Event {
+    uint64_t seq;
+    uint64_t time;
+    int type;
+    int source;
+    int actor;
+    int resource;
+};
+uint64_t monotonic_ns();
+void event_record(int type, int source, int actor, int resource);
+uint64_t event_ring_head();
+int event_ring_read(uint64_t since, Event *, int max, uint64_t *next, uint64_t *dropped);
 
 
 // ConsumerService thread data
+// consumer states: resting, waiting for a resource, consuming one
+enum { SLEEPING, HUNGRY, CONSUMING };
 typedef struct _ConsumerService ConsumerService;
 struct _ConsumerService {
     int id;
     Environment* env;
     int client_sock;
+    // the topic it consumes from
+    ResourceBuffer *bufferp;
     pthread_t thread;
     int resources_consumed;
     int status;
+    ThreadCounters *counters;
+    DelayState delays;
+    // the core the consumer last ran on
+    int cpu;
+    // when the consumer started waiting for a resource, or 0
+    _Atomic uint64_t waiting_since;
+    // partitioned mode: signalled when one of its partitions has a
+    // resource for it; the partition it is consuming from, or -1
+    pthread_cond_t partitionReady;
+    int partition;
     ConsumerService *next;
     ConsumerService *prev;
 };
@@ -106,9 +376,39 @@ struct _ConsumerServiceList {
  * This is accessed from multiples threads, and is protected by mutex.
  */ 
 ConsumerServiceList *consumerList;
-int consumer_service_new(Environment *, int client_socket);
+// a client_socket of -1 starts a virtual consumer with no client
+int consumer_service_new(Environment *, int client_socket, ResourceBuffer *);
+ConsumerService *consumer_service_init(Environment *, int client_socket, ResourceBuffer *);
+void consumer_service_add(ConsumerService *);
 int consumer_service_remove(ConsumerService *);
-int consumer_service_get_resource(Environment *, Resource **);
+int consumer_service_get_resource(ConsumerService *, Resource **);
+
+
+// Key-partitioned delivery
+// split each topic's buffer into this many partitions by producer; 0 is
+// off, and every consumer takes from the whole buffer
+int partitionCount;
+void partition_init(ResourceBuffer *, int);
+void partition_append(ResourceBuffer *, Resource *, Resource *, int);
+void partition_prepend(ResourceBuffer *, Resource *);
+int partition_take(ResourceBuffer *, ConsumerService *, Resource **);
+void partition_release(ConsumerService *);
+void partition_ack(ResourceBuffer *, Resource *);
+void partition_rebalance(ResourceBuffer *);
+int partition_available(ResourceBuffer *, ConsumerService *);
+
+
+// Acknowledgements
+// resources delivered to a client stay in flight until it acks them, and
+// go back to their buffer if it doesn't within ackTimeout; 0 is off, and
+// delivered resources are freed at once
+uint64_t ackTimeout;
+int ack_start();
+void inflight_add(ConsumerService *, Resource *);
+int inflight_ack(ConsumerService *, int id);
+void inflight_requeue_consumer(ConsumerService *);
+int inflight_count();
+void consumer_service_set_status(ConsumerService *, int);
 pthread_mutex_t consumerListMutex;
 
 
@@ -122,6 +422,9 @@ struct _MonitorService {
     int deleted;
     int waiting;
     int has_queued_send : 1;
+    uint64_t events_seq;
+    // room to read the event ring into, for this monitor's reports
+    Event *events;
     pthread_mutex_t hasQueuedSendMutex;
     pthread_mutex_t monitorReadyMutex;
     pthread_cond_t monitorNowReady;
@@ -148,6 +451,98 @@ void monitor_push_reports();
 pthread_mutex_t monitorListMutex;
 
 
+// AdminService
+// live tuning of delays, tracing and production over "handshake:admin"
+int admin_service_new(Environment *, int);
+
+
+// Asynchronous log
+enum { LOG_LEVEL_ERROR, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG, LOG_LEVEL_TRACE };
+#define LOG_MAX_ARGS 4
+// LOG() calls above this level are compiled out entirely
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+// LOG() calls above this level are skipped at run time
+_Atomic int logLevel;
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(format, a, b, c, d, n, ...) n
+/**
+ * Log a message from a hot path. The format must be a string literal
+ * and takes at most LOG_MAX_ARGS arguments, checked against it like
+ * printf's; see log.c for what a record can carry.
+ */
+#define LOG(level, ...) do { \
+    if ((level) <= LOG_COMPILE_LEVEL \
+        && (level) <= atomic_load_explicit(&logLevel, memory_order_relaxed)) \
+        log_write((level), LOG_NARGS(__VA_ARGS__), __VA_ARGS__); \
+} while (0)
+#define log_error(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG(LOG_LEVEL_TRACE, __VA_ARGS__)
+void log_write(int level, int nargs, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+int log_flush();
+int log_start();
+
+
+// Trace recording and replay
+struct {
+    const char *record;  // file to record events into, or NULL
+    const char *replay;  // file to replay instead of running producers, or NULL
+    double speed;        // replay speed; 1.0 is the recorded pace
+} trace;
+int trace_record_start(const char *path);
+void trace_record_stop();
+int trace_replay_start(Environment *, const char *path, double speed);
+
+
+// Write-ahead log. Its records are also what replication streams
+enum { WAL_PRODUCE = 1, WAL_CONSUME = 2, WAL_RESYNC = 3 };
+typedef struct _WalRecord WalRecord;
+struct _WalRecord {
+    int32_t type;
+    int32_t id;
+    int32_t produced_by;
+};
+struct {
+    const char *path;  // file to log the default topic in, or NULL
+} wal;
+int wal_start();
+uint64_t wal_produce(Resource *first, int n);
+void wal_consume(ResourceBuffer *, Resource *);
+void wal_wait(uint64_t seq);
+int wal_park(Producer *);
+
+
+// Primary/standby replication of the default topic
+struct {
+    int port;     // primary: port a standby attaches to, or 0
+    int standby;  // standby: the primary's replication port, or 0
+} replication;
+int replication_start();
+void replication_append(int type, Resource *, int n);
+int replication_lag();
+int replication_follow();
+int replication_restore(ResourceBuffer *);
+
+
+// Watchdog
+// how often to check the server's invariants; 0 disables the watchdog
+uint64_t watchdogInterval;
+int watchdog_start();
+
+
+// Discrete-event simulation
+struct {
+    uint64_t duration;  // virtual nanoseconds to simulate; 0 runs the server
+    uint64_t seed;
+    int consumers;
+} simulation;
+int simulate_run();
+
+
 // global debugger flag
 struct {
     unsigned int print : 1;
@@ -0,0 +1,352 @@
+/**
+ * @file
+ *
+ * Simulate runs producers, the ResourceBuffer and consumers against a
+ * virtual clock in a single thread, instead of as live threads that
+ * sleep in real time. Hours of server behaviour take seconds to replay,
+ * and the same seed always gives the same run, which makes it useful for
+ * capacity planning offline.
+ *
+ * Producers and consumers go through the same states as the live server
+ * (SLEEP/PRODUCING/EXPORT/WAITING and SLEEPING/HUNGRY/CONSUMING), draw
+ * their delays from the same distributions with delay_sample(), and move
+ * resources through a real ResourceBuffer. A thread blocked on a
+ * condition variable becomes an entry in a FIFO wait queue, and is woken
+ * by the first enqueue or dequeue that would have signalled it.
+ *
+ * Simulated waits and produce-to-consume times are recorded into the
+ * latency histograms, which are dumped at the end of the run.
+ */
+
+#include "server.h"
+
+enum {
+    SIM_PRODUCER_READY,     // rest is over; try to put a resource in the buffer
+    SIM_PRODUCER_PRODUCED,  // production delay is over; go back to resting
+    SIM_CONSUMER_READY,     // rest is over; ask for a resource
+    SIM_CONSUMER_CONSUMED   // consumption delay is over; go back to resting
+};
+
+typedef struct _SimEvent SimEvent;
+struct _SimEvent {
+    uint64_t time;
+    uint64_t seq;   // breaks ties in time so runs are reproducible
+    int type;
+    int actor;
+};
+
+typedef struct _SimActor SimActor;
+struct _SimActor {
+    int status;
+    DelayState delays;
+    uint64_t waited;
+};
+
+// FIFO of actors blocked on a condition variable
+typedef struct _SimQueue SimQueue;
+struct _SimQueue {
+    int *items;
+    int capacity;
+    int head;
+    int count;
+};
+
+static struct {
+    uint64_t now;
+    uint64_t seq;
+    SimEvent *heap;
+    int heap_count;
+    int heap_capacity;
+    SimActor *producers;
+    SimActor *consumers;
+    SimQueue producers_waiting;
+    SimQueue consumers_waiting;
+    ResourceBuffer *buffer;
+
+    // totals for the summary
+    uint64_t events;
+    uint64_t produced;
+    uint64_t consumed;
+    uint64_t producer_waits;
+    uint64_t consumer_waits;
+    uint64_t occupancy;     // integral of buffer count over virtual time
+    uint64_t last_change;
+    uint64_t time_full;
+    uint64_t time_empty;
+} sim;
+
+/**
+ * Schedule an event delay nanoseconds from now.
+ */
+static void sim_schedule(uint64_t delay, int type, int actor) {
+    SimEvent e;
+    int i, parent;
+
+    if (sim.heap_count == sim.heap_capacity) {
+        sim.heap_capacity *= 2;
+        sim.heap = realloc(sim.heap, sim.heap_capacity * sizeof(*sim.heap));
+    }
+    e.time = sim.now + delay;
+    e.seq = sim.seq++;
+    e.type = type;
+    e.actor = actor;
+
+    // sift up
+    for (i = sim.heap_count++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (sim.heap[parent].time < e.time
+            || (sim.heap[parent].time == e.time && sim.heap[parent].seq < e.seq)) {
+            break;
+        }
+        sim.heap[i] = sim.heap[parent];
+    }
+    sim.heap[i] = e;
+}
+
+/**
+ * Remove the earliest event from the heap.
+ */
+static SimEvent sim_next() {
+    SimEvent top = sim.heap[0];
+    SimEvent last = sim.heap[--sim.heap_count];
+    int i = 0, child;
+
+    // sift down
+    while ((child = 2 * i + 1) < sim.heap_count) {
+        if (child + 1 < sim.heap_count
+            && (sim.heap[child + 1].time < sim.heap[child].time
+                || (sim.heap[child + 1].time == sim.heap[child].time
+                    && sim.heap[child + 1].seq < sim.heap[child].seq))) {
+            child++;
+        }
+        if (last.time < sim.heap[child].time
+            || (last.time == sim.heap[child].time && last.seq < sim.heap[child].seq)) {
+            break;
+        }
+        sim.heap[i] = sim.heap[child];
+        i = child;
+    }
+    sim.heap[i] = last;
+    return top;
+}
+
+static void sim_queue_init(SimQueue *q, int capacity) {
+    q->items = malloc(capacity * sizeof(*q->items));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+}
+
+static void sim_queue_push(SimQueue *q, int actor) {
+    q->items[(q->head + q->count) % q->capacity] = actor;
+    q->count++;
+}
+
+static int sim_queue_pop(SimQueue *q) {
+    int actor = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    return actor;
+}
+
+/**
+ * Account for the time the buffer spent at its current count. Called
+ * before every change to the buffer and at the end of the run.
+ */
+static void sim_buffer_elapsed() {
+    uint64_t elapsed = sim.now - sim.last_change;
+
+    sim.occupancy += elapsed * sim.buffer->count;
+    if (sim.buffer->count == sim.buffer->size) {
+        sim.time_full += elapsed;
+    }
+    if (sim.buffer->count == 0) {
+        sim.time_empty += elapsed;
+    }
+    sim.last_change = sim.now;
+}
+
+static void sim_consume(int id);
+
+/**
+ * Producer id puts a resource in the buffer, which has room.
+ */
+static void sim_produce(int id) {
+    SimActor *p = &sim.producers[id];
+    Resource *r;
+
+    p->status = EXPORT;
+    sim_buffer_elapsed();
+    r = resource_new(id);
+    r->produced_at = sim.now;
+    resource_buffer_enqueue(sim.buffer, r);
+    sim.produced++;
+
+    p->status = PRODUCING;
+    sim_schedule(delay_sample(&produceDelay, &p->delays), SIM_PRODUCER_PRODUCED, id);
+
+    // bufferNotEmpty
+    if (sim.consumers_waiting.count > 0) {
+        int c = sim_queue_pop(&sim.consumers_waiting);
+        latency_record(LATENCY_CONSUMER_WAIT, sim.now - sim.consumers[c].waited);
+        sim_consume(c);
+    }
+}
+
+/**
+ * Consumer id takes a resource from the buffer, which isn't empty.
+ */
+static void sim_consume(int id) {
+    SimActor *c = &sim.consumers[id];
+    Resource *r;
+
+    sim_buffer_elapsed();
+    resource_buffer_dequeue(sim.buffer, &r);
+    latency_record(LATENCY_PRODUCE_TO_CONSUME, sim.now - r->produced_at);
+    free(r);
+    sim.consumed++;
+
+    c->status = CONSUMING;
+    sim_schedule(delay_sample(&consumeDelay, &c->delays), SIM_CONSUMER_CONSUMED, id);
+
+    // bufferHasRoom
+    if (sim.producers_waiting.count > 0) {
+        int p = sim_queue_pop(&sim.producers_waiting);
+        latency_record(LATENCY_PRODUCER_WAIT, sim.now - sim.producers[p].waited);
+        sim_produce(p);
+    }
+}
+
+/**
+ * Apply one event at the current virtual time.
+ */
+static void sim_handle(SimEvent *e) {
+    SimActor *a;
+
+    switch (e->type) {
+        case SIM_PRODUCER_READY:
+            a = &sim.producers[e->actor];
+            if (sim.buffer->count >= sim.buffer->size) {
+                a->status = WAITING;
+                a->waited = sim.now;
+                sim.producer_waits++;
+                sim_queue_push(&sim.producers_waiting, e->actor);
+            }
+            else {
+                sim_produce(e->actor);
+            }
+            break;
+        case SIM_PRODUCER_PRODUCED:
+            a = &sim.producers[e->actor];
+            a->status = SLEEP;
+            sim_schedule(delay_sample(&producerRest, &a->delays), SIM_PRODUCER_READY, e->actor);
+            break;
+        case SIM_CONSUMER_READY:
+            a = &sim.consumers[e->actor];
+            a->status = HUNGRY;
+            if (sim.buffer->count == 0) {
+                a->waited = sim.now;
+                sim.consumer_waits++;
+                sim_queue_push(&sim.consumers_waiting, e->actor);
+            }
+            else {
+                sim_consume(e->actor);
+            }
+            break;
+        case SIM_CONSUMER_CONSUMED:
+            a = &sim.consumers[e->actor];
+            a->status = SLEEPING;
+            sim_schedule(delay_sample(&consumerRest, &a->delays), SIM_CONSUMER_READY, e->actor);
+            break;
+    }
+}
+
+/**
+ * Print a duration in the largest unit that keeps it readable.
+ */
+static void sim_print_duration(uint64_t ns) {
+    if (ns >= 3600000000000ull) {
+        printf("%.2fh", ns / 3600e9);
+    }
+    else if (ns >= 1000000000ull) {
+        printf("%.2fs", ns / 1e9);
+    }
+    else {
+        printf("%.2fms", ns / 1e6);
+    }
+}
+
+/**
+ * Run the simulation described by the behaviour settings and the
+ * simulation struct, print a summary and the latency histograms.
+ */
+int simulate_run() {
+    uint64_t started, wall;
+    Resource *r;
+    SimEvent e;
+    int i;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.buffer = resource_buffer_new(bufferSize);
+    sim.heap_capacity = numProducers + simulation.consumers + 1;
+    sim.heap = malloc(sim.heap_capacity * sizeof(*sim.heap));
+    sim.producers = calloc(numProducers, sizeof(*sim.producers));
+    sim.consumers = calloc(simulation.consumers, sizeof(*sim.consumers));
+    sim_queue_init(&sim.producers_waiting, numProducers);
+    sim_queue_init(&sim.consumers_waiting, simulation.consumers);
+
+    // everyone starts out resting, as the live threads do
+    for (i = 0; i < numProducers; i++) {
+        delay_state_init(&sim.producers[i].delays, simulation.seed ^ ((uint64_t)i << 32));
+        sim.producers[i].status = SLEEP;
+        sim_schedule(delay_sample(&producerRest, &sim.producers[i].delays), SIM_PRODUCER_READY, i);
+    }
+    for (i = 0; i < simulation.consumers; i++) {
+        delay_state_init(&sim.consumers[i].delays, simulation.seed ^ ((uint64_t)i << 32) ^ 0x5bd1e995);
+        sim.consumers[i].status = SLEEPING;
+        sim_schedule(delay_sample(&consumerRest, &sim.consumers[i].delays), SIM_CONSUMER_READY, i);
+    }
+
+    started = monotonic_ns();
+    while (sim.heap_count > 0 && sim.heap[0].time <= simulation.duration) {
+        e = sim_next();
+        sim.now = e.time;
+        sim_handle(&e);
+        sim.events++;
+    }
+    sim.now = simulation.duration;
+    sim_buffer_elapsed();
+    wall = monotonic_ns() - started;
+
+    printf("simulated ");
+    sim_print_duration(simulation.duration);
+    printf(" in ");
+    sim_print_duration(wall);
+    printf(": %llu events (%.0f/s), seed %llu\n",
+        (unsigned long long)sim.events,
+        wall > 0 ? sim.events / (wall / 1e9) : 0.0,
+        (unsigned long long)simulation.seed);
+    printf("%d producers, %d consumers, buffer size %d\n",
+        numProducers, simulation.consumers, bufferSize);
+    printf("produced %llu, consumed %llu, producer waits %llu, consumer waits %llu\n",
+        (unsigned long long)sim.produced, (unsigned long long)sim.consumed,
+        (unsigned long long)sim.producer_waits, (unsigned long long)sim.consumer_waits);
+    printf("throughput %.2f/s, mean occupancy %.2f, full %.1f%%, empty %.1f%%\n",
+        sim.consumed / (simulation.duration / 1e9),
+        (double)sim.occupancy / simulation.duration,
+        100.0 * sim.time_full / simulation.duration,
+        100.0 * sim.time_empty / simulation.duration);
+    latency_dump(stdout);
+    fflush(stdout);
+
+    while (resource_buffer_dequeue(sim.buffer, &r) == 0) {
+        free(r);
+    }
+    free(sim.buffer);
+    free(sim.heap);
+    free(sim.producers);
+    free(sim.consumers);
+    free(sim.producers_waiting.items);
+    free(sim.consumers_waiting.items);
+    return 0;
+}
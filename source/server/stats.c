@@ -0,0 +1,161 @@
+/**
+ * @file
+ *
+ * The stats page publishes live counters in shared memory so tools can
+ * watch the server without connecting a monitor. Producer and
+ * ConsumerService ThreadCounters are handed out from slots in the page,
+ * so the counters metrics reads are the same ones external tools map.
+ *
+ * If the page can't be created, ThreadCounters fall back to the heap and
+ * the server runs as before.
+ *
+ * @see stats.h for the page layout
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "server.h"
+
+static StatsPage *statsPage;
+static char statsName[64];
+static ServerCounters heapServerCounters;
+
+/**
+ * Create and map the stats page, and point serverCounters into it.
+ */
+int stats_open() {
+    int fd;
+
+    serverCounters = &heapServerCounters;
+
+    snprintf(statsName, sizeof(statsName), "%s.%d", STATS_NAME, (int)getpid());
+    fd = shm_open(statsName, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("stats shm_open");
+        return -1;
+    }
+    // truncate to 0 first so a stale page from an old run is zeroed
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(StatsPage)) < 0) {
+        perror("stats ftruncate");
+        close(fd);
+        return -1;
+    }
+    statsPage = mmap(NULL, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (statsPage == MAP_FAILED) {
+        perror("stats mmap");
+        statsPage = NULL;
+        return -1;
+    }
+
+    statsPage->version = STATS_VERSION;
+    statsPage->page_size = sizeof(StatsPage);
+    statsPage->slot_size = sizeof(ThreadCounters);
+    statsPage->producer_slots = STATS_PRODUCER_SLOTS;
+    statsPage->consumer_slots = STATS_CONSUMER_SLOTS;
+    statsPage->pid = getpid();
+    statsPage->start_time = monotonic_ns();
+    serverCounters = &statsPage->counters;
+
+    // readers trust the page once they see the magic number
+    atomic_store_explicit(&statsPage->magic, STATS_MAGIC, memory_order_release);
+    return 0;
+}
+
+/**
+ * Remove the stats page. Called when the server shuts down.
+ */
+void stats_close() {
+    if (statsPage != NULL) {
+        atomic_store_explicit(&statsPage->magic, 0, memory_order_relaxed);
+        munmap(statsPage, sizeof(StatsPage));
+        statsPage = NULL;
+        shm_unlink(statsName);
+    }
+}
+
+/**
+ * Return the stats page's shared-memory name, or NULL if there is none.
+ */
+const char *stats_name() {
+    return statsPage != NULL ? statsName : NULL;
+}
+
+/**
+ * Claim a free slot from the given array of ThreadCounters.
+ */
+static ThreadCounters *stats_claim_slot(ThreadCounters *slots, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        int32_t free_slot = 0;
+        if (atomic_load_explicit(&slots[i].in_use, memory_order_relaxed) == 0
+            && atomic_compare_exchange_strong(&slots[i].in_use, &free_slot, 1)) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a zeroed ThreadCounters for a producer or consumer with the
+ * given id. The counters come from the stats page when there is a free
+ * slot, and from the heap otherwise.
+ */
+ThreadCounters *thread_counters_new(int kind, int id) {
+    ThreadCounters *c = NULL;
+
+    if (statsPage != NULL) {
+        if (kind == STATS_PRODUCER) {
+            c = stats_claim_slot(statsPage->producers, STATS_PRODUCER_SLOTS);
+        }
+        else {
+            c = stats_claim_slot(statsPage->consumers, STATS_CONSUMER_SLOTS);
+        }
+    }
+    if (c == NULL) {
+        if (posix_memalign((void **)&c, CACHE_LINE_SIZE, sizeof(*c)) != 0) {
+            return NULL;
+        }
+        atomic_init(&c->in_use, 1);
+    }
+
+    atomic_store_explicit(&c->produced, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->consumed, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->waits, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->status, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->id, id, memory_order_release);
+    return c;
+}
+
+/**
+ * Release a ThreadCounters. Slots in the stats page are marked free.
+ */
+void thread_counters_free(ThreadCounters *c) {
+    if (statsPage != NULL && (char *)c >= (char *)statsPage
+        && (char *)c < (char *)statsPage + sizeof(StatsPage)) {
+        atomic_store_explicit(&c->in_use, 0, memory_order_release);
+    }
+    else {
+        free(c);
+    }
+}
+
+/**
+ * Publish a thread's state in its counters.
+ */
+void thread_counters_set_status(ThreadCounters *c, int status) {
+    atomic_store_explicit(&c->status, status, memory_order_relaxed);
+}
+
+/**
+ * Publish the default topic's fill level. Called with the buffer's mutex
+ * held whenever a buffer changes.
+ */
+void stats_buffer(ResourceBuffer *rb) {
+    if (statsPage != NULL && rb == globalResourceBuffer) {
+        atomic_store_explicit(&statsPage->buffer_count, rb->count, memory_order_relaxed);
+        atomic_store_explicit(&statsPage->buffer_size, rb->size, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,88 @@
+/**
+ * @file
+ *
+ * Layout of the shared-memory stats page. The server publishes its live
+ * counters in a StatsPage at /dev/shm/pc_server_stats.<pid>, so servers
+ * running side by side each have their own; the server prints the name at
+ * startup. External tools can map it read-only and poll it without making
+ * a syscall or talking to the server.
+ *
+ * A reader should check that magic is STATS_MAGIC and that version is
+ * STATS_VERSION before trusting the rest of the page. The server writes
+ * magic last, after the rest of the header is filled in. Every live value
+ * is a naturally aligned atomic written with relaxed ordering. A reader
+ * sees each field whole, but two fields may come from different moments.
+ * Slots with in_use == 0 are free and should be skipped.
+ *
+ * This header depends only on the C standard library so that tools can
+ * include it on its own.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// the page is STATS_NAME.<pid>
+#define STATS_NAME "/pc_server_stats"
+#define STATS_MAGIC 0x54534350
+#define STATS_VERSION 5
+#define STATS_PRODUCER_SLOTS 1024
+#define STATS_CONSUMER_SLOTS 4096
+#define CACHE_LINE_SIZE 64
+
+// Per-thread counters and state, each set on its own cache line
+typedef struct _ThreadCounters ThreadCounters;
+struct _ThreadCounters {
+    _Atomic uint64_t produced;
+    _Atomic uint64_t consumed;
+    _Atomic uint64_t waits;
+    _Atomic int32_t in_use;
+    _Atomic int32_t id;
+    _Atomic int32_t status;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// a server-wide counter, padded so it doesn't share a line with another
+typedef struct _PaddedCounter PaddedCounter;
+struct _PaddedCounter {
+    _Atomic uint64_t value;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef struct _ServerCounters ServerCounters;
+struct _ServerCounters {
+    PaddedCounter produced_retired;
+    PaddedCounter producer_waits_retired;
+    PaddedCounter consumed_retired;
+    PaddedCounter consumer_waits_retired;
+    PaddedCounter consumer_connections;
+    PaddedCounter monitor_connections;
+    PaddedCounter monitor_report_bytes;
+    PaddedCounter invariant_violations;
+    // ack mode: resources acked, and put back for redelivery
+    PaddedCounter acked;
+    PaddedCounter redelivered;
+    // write-ahead log: syncs, records synced, and resources replayed
+    PaddedCounter wal_commits;
+    PaddedCounter wal_records;
+    PaddedCounter recovered;
+};
+
+typedef struct _StatsPage StatsPage;
+struct _StatsPage {
+    _Atomic uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t slot_size;
+    uint32_t producer_slots;
+    uint32_t consumer_slots;
+    int32_t pid;
+    uint64_t start_time;
+    _Atomic int64_t buffer_count;
+    _Atomic int64_t buffer_size;
+    ServerCounters counters;
+    ThreadCounters producers[STATS_PRODUCER_SLOTS];
+    ThreadCounters consumers[STATS_CONSUMER_SLOTS];
+};
+
+#endif
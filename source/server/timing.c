@@ -0,0 +1,259 @@
+/**
+ * @file
+ *
+ * Timing handles the production and consumption delays. A Delay is a
+ * duration with nanosecond resolution and an arrival distribution:
+ *
+ *   fixed        every delay is the same            "2", "250ms", "40us"
+ *   exponential  Poisson arrivals with a given mean "exp:10ms"
+ *   bursty       N delays of zero, then one gap     "burst:8:100ms"
+ *
+ * A bare number is a count of seconds, so the old whole-second command
+ * line arguments still mean what they used to.
+ *
+ * Delays are slept with clock_nanosleep() against CLOCK_MONOTONIC. Delays
+ * shorter than spinThreshold are busy-waited instead, since the scheduler
+ * can't reliably wake a thread after only a few microseconds.
+ *
+ * The global delays can be changed while the server runs, so they are
+ * guarded by a sequence lock: delay_publish() makes the sequence odd while
+ * it writes, and readers take a copy, trying again if the sequence was odd
+ * or moved under them. Readers never block, and never see half of an old
+ * delay and half of a new one.
+ */
+
+#include "server.h"
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax()
+#endif
+
+// serializes writers of the global delays
+static pthread_mutex_t delayPublishMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Parse a duration such as "2", "1.5s", "250ms", "40us", "100ns", "5m" or
+ * "1h" into nanoseconds. Returns -1 if the string isn't a duration.
+ */
+static int64_t duration_parse(const char *s) {
+    char *unit;
+    double value = strtod(s, &unit);
+
+    if (unit == s || value < 0) {
+        return -1;
+    }
+    if (*unit == '\0' || strcmp(unit, "s") == 0) {
+        return (int64_t)(value * 1e9);
+    }
+    if (strcmp(unit, "h") == 0) {
+        return (int64_t)(value * 3600e9);
+    }
+    if (strcmp(unit, "m") == 0) {
+        return (int64_t)(value * 60e9);
+    }
+    if (strcmp(unit, "ms") == 0) {
+        return (int64_t)(value * 1e6);
+    }
+    if (strcmp(unit, "us") == 0) {
+        return (int64_t)(value * 1e3);
+    }
+    if (strcmp(unit, "ns") == 0) {
+        return (int64_t)value;
+    }
+    return -1;
+}
+
+/**
+ * Parse a Delay from the command line. Returns -1 (leaving d untouched)
+ * if the string isn't a valid delay.
+ */
+int delay_parse(const char *s, Delay *d) {
+    int64_t ns;
+    int burst;
+
+    if (strncmp(s, "exp:", 4) == 0) {
+        if ((ns = duration_parse(s + 4)) < 0) {
+            return -1;
+        }
+        d->kind = DELAY_EXPONENTIAL;
+        d->mean = ns;
+        d->burst = 0;
+        return 0;
+    }
+    if (strncmp(s, "burst:", 6) == 0) {
+        char *gap;
+        burst = (int)strtol(s + 6, &gap, 10);
+        if (burst < 1 || *gap != ':' || (ns = duration_parse(gap + 1)) < 0) {
+            return -1;
+        }
+        d->kind = DELAY_BURST;
+        d->mean = ns;
+        d->burst = burst;
+        return 0;
+    }
+    if ((ns = duration_parse(s)) < 0) {
+        return -1;
+    }
+    d->kind = DELAY_FIXED;
+    d->mean = ns;
+    d->burst = 0;
+    return 0;
+}
+
+/**
+ * Set a fixed delay of the given number of nanoseconds.
+ */
+void delay_set(Delay *d, uint64_t ns) {
+    d->kind = DELAY_FIXED;
+    d->mean = ns;
+    d->burst = 0;
+}
+
+/**
+ * Take a consistent copy of a Delay that may be published to at any time.
+ */
+static void delay_load(const Delay *d, Delay *copy) {
+    unsigned seq;
+
+    do {
+        seq = atomic_load_explicit(&d->seq, memory_order_acquire);
+        copy->kind = __atomic_load_n(&d->kind, __ATOMIC_RELAXED);
+        copy->mean = __atomic_load_n(&d->mean, __ATOMIC_RELAXED);
+        copy->burst = __atomic_load_n(&d->burst, __ATOMIC_RELAXED);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&d->seq, memory_order_relaxed) != seq);
+}
+
+/**
+ * Replace a Delay that other threads may be sampling.
+ */
+void delay_publish(Delay *d, const Delay *value) {
+    unsigned seq;
+
+    pthread_mutex_lock(&delayPublishMutex);
+    seq = atomic_load_explicit(&d->seq, memory_order_relaxed);
+    atomic_store_explicit(&d->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    __atomic_store_n(&d->kind, value->kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->mean, value->mean, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->burst, value->burst, __ATOMIC_RELAXED);
+    atomic_store_explicit(&d->seq, seq + 2, memory_order_release);
+    pthread_mutex_unlock(&delayPublishMutex);
+}
+
+/**
+ * Write a Delay back out in the form delay_parse() accepts.
+ */
+char *delay_format(const Delay *delay, char *out, size_t size) {
+    char duration[32];
+    Delay copy, *d = &copy;
+
+    delay_load(delay, &copy);
+
+    if (d->mean % 1000000000ull == 0) {
+        snprintf(duration, sizeof(duration), "%llus", (unsigned long long)(d->mean / 1000000000ull));
+    }
+    else if (d->mean % 1000000ull == 0) {
+        snprintf(duration, sizeof(duration), "%llums", (unsigned long long)(d->mean / 1000000ull));
+    }
+    else if (d->mean % 1000ull == 0) {
+        snprintf(duration, sizeof(duration), "%lluus", (unsigned long long)(d->mean / 1000ull));
+    }
+    else {
+        snprintf(duration, sizeof(duration), "%lluns", (unsigned long long)d->mean);
+    }
+
+    switch (d->kind) {
+        case DELAY_EXPONENTIAL:
+            snprintf(out, size, "exp:%s", duration);
+            break;
+        case DELAY_BURST:
+            snprintf(out, size, "burst:%d:%s", d->burst, duration);
+            break;
+        default:
+            snprintf(out, size, "%s", duration);
+            break;
+    }
+    return out;
+}
+
+/**
+ * Seed a thread's delay state. The same seed always gives the same
+ * sequence of delays.
+ */
+void delay_state_init(DelayState *s, uint64_t seed) {
+    // splitmix64 so that neighbouring seeds give unrelated sequences
+    seed += 0x9e3779b97f4a7c15ull;
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+    s->rng = (seed ^ (seed >> 31)) | 1;
+    s->burst_pos = 0;
+}
+
+/**
+ * Return a uniform random number in (0, 1] from the thread's state.
+ */
+static double delay_uniform(DelayState *s) {
+    // xorshift64*
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return ((s->rng * 0x2545f4914f6cdd1dull) >> 11) * (1.0 / 9007199254740992.0) + 0x1p-53;
+}
+
+/**
+ * Draw the next delay, in nanoseconds, from the given distribution.
+ */
+uint64_t delay_sample(const Delay *delay, DelayState *s) {
+    Delay copy, *d = &copy;
+
+    delay_load(delay, &copy);
+    switch (d->kind) {
+        case DELAY_EXPONENTIAL:
+            return (uint64_t)(-log(delay_uniform(s)) * d->mean);
+        case DELAY_BURST:
+            if (++s->burst_pos < d->burst) {
+                return 0;
+            }
+            s->burst_pos = 0;
+            return d->mean;
+        default:
+            return d->mean;
+    }
+}
+
+/**
+ * Block the calling thread for ns nanoseconds.
+ */
+void delay_sleep_ns(uint64_t ns) {
+    struct timespec deadline;
+    uint64_t until;
+
+    if (ns == 0) {
+        return;
+    }
+    until = monotonic_ns() + ns;
+    if (ns < atomic_load_explicit(&spinThreshold, memory_order_relaxed)) {
+        while (monotonic_ns() < until) {
+            cpu_relax();
+        }
+        return;
+    }
+    deadline.tv_sec = until / 1000000000ull;
+    deadline.tv_nsec = until % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+        // interrupted; the absolute deadline makes retrying safe
+    }
+}
+
+/**
+ * Draw the next delay from d and sleep for it.
+ */
+void delay_sleep(const Delay *d, DelayState *s) {
+    delay_sleep_ns(delay_sample(d, s));
+}
@@ -0,0 +1,429 @@
+/**
+ * @file
+ *
+ * Traces capture the stream of produces, consumes, connects and
+ * disconnects from the event ring into a compact binary file, and replay
+ * that stream against the server later, at its recorded pace or faster.
+ *
+ * A trace file starts with a header:
+ *
+ *   "PCTR"  version (1 byte)  start time (varint, monotonic ns)
+ *
+ * followed by one record per event:
+ *
+ *   tag (1 byte)        event type in the low 4 bits, source in bit 4
+ *   time (varint)       nanoseconds since the previous record
+ *   actor (varint)      producer or consumer id
+ *   resource (varint)   produces and consumes only: zigzag encoded
+ *                       difference from the previous resource id
+ *
+ * A tag of TRACE_DROPPED is followed by a varint count of events that
+ * were overwritten in the ring before the recorder could read them.
+ * Records are usually 4 to 6 bytes.
+ *
+ * Replay creates a producer or a consumer for every actor in the trace
+ * and hands each recorded produce or consume to that actor at its
+ * recorded time. Actors then go through the real buffer, waiting on it
+ * just as live threads do, so the replay shows how the current buffer
+ * and scheduling code copes with the recorded traffic. A consume is
+ * replayed at the time it was served, since that is when it was recorded.
+ */
+
+#include "server.h"
+
+#define TRACE_MAGIC "PCTR"
+#define TRACE_VERSION 1
+#define TRACE_DROPPED 0xff
+#define TRACE_BATCH 256
+
+static FILE *traceFile;
+static pthread_t traceThread;
+static _Atomic int traceStopping;
+static uint64_t traceSeq;
+static uint64_t traceLastTime;
+static int traceLastResource;
+
+/**
+ * Write an unsigned LEB128 varint.
+ */
+static void trace_put_varint(FILE *f, uint64_t v) {
+    while (v >= 0x80) {
+        fputc((int)(v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc((int)v, f);
+}
+
+/**
+ * Read an unsigned LEB128 varint. Returns -1 at the end of the file.
+ */
+static int trace_get_varint(FILE *f, uint64_t *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = fgetc(f)) == EOF || shift > 63) {
+            return -1;
+        }
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+/**
+ * Append one event to the trace file.
+ */
+static void trace_write_event(Event *e) {
+    int delta;
+
+    switch (e->type) {
+        case EVENT_PRODUCE:
+        case EVENT_CONSUME:
+        case EVENT_CONNECT:
+        case EVENT_DISCONNECT:
+            break;
+        default:
+            return;
+    }
+
+    // timestamps are taken after the sequence number is claimed, so
+    // neighbouring events can be very slightly out of order
+    if (e->time < traceLastTime) {
+        e->time = traceLastTime;
+    }
+
+    fputc(e->type | (e->source << 4), traceFile);
+    trace_put_varint(traceFile, e->time - traceLastTime);
+    trace_put_varint(traceFile, (uint64_t)e->actor);
+    if (e->type == EVENT_PRODUCE || e->type == EVENT_CONSUME) {
+        delta = e->resource - traceLastResource;
+        trace_put_varint(traceFile, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+        traceLastResource = e->resource;
+    }
+    traceLastTime = e->time;
+}
+
+/**
+ * Copy everything new in the event ring into the trace file. Returns the
+ * number of events read.
+ */
+static int trace_drain() {
+    Event events[TRACE_BATCH];
+    uint64_t dropped = 0;
+    int n, i;
+
+    n = event_ring_read(traceSeq, events, TRACE_BATCH, &traceSeq, &dropped);
+    if (dropped > 0) {
+        fputc(TRACE_DROPPED, traceFile);
+        trace_put_varint(traceFile, dropped);
+        log_error("trace recorder fell behind, %d events lost", (int)dropped);
+    }
+    for (i = 0; i < n; i++) {
+        trace_write_event(&events[i]);
+    }
+    return n;
+}
+
+/**
+ * Recorder thread. Tails the event ring until trace_record_stop().
+ */
+void *trace_record_handler(void *unused) {
+    while (!atomic_load_explicit(&traceStopping, memory_order_acquire)) {
+        if (trace_drain() == 0) {
+            delay_sleep_ns(1000000);
+        }
+    }
+    while (trace_drain() > 0) {
+        ;
+    }
+    fclose(traceFile);
+    return NULL;
+}
+
+/**
+ * Start recording events to the given file. Returns -1 if the file
+ * can't be created.
+ */
+int trace_record_start(const char *path) {
+    if ((traceFile = fopen(path, "wb")) == NULL) {
+        perror("could not open trace file");
+        return -1;
+    }
+    traceSeq = event_ring_head();
+    traceLastTime = monotonic_ns();
+    traceLastResource = 0;
+
+    fwrite(TRACE_MAGIC, 1, 4, traceFile);
+    fputc(TRACE_VERSION, traceFile);
+    trace_put_varint(traceFile, traceLastTime);
+
+    if (pthread_create(&traceThread, NULL, trace_record_handler, NULL) < 0) {
+        fclose(traceFile);
+        traceFile = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop recording, writing out any events still in the ring.
+ */
+void trace_record_stop() {
+    if (traceFile == NULL) {
+        return;
+    }
+    atomic_store_explicit(&traceStopping, 1, memory_order_release);
+    pthread_join(traceThread, NULL);
+    traceFile = NULL;
+}
+
+// a producer or consumer being driven by the replay
+typedef struct _ReplayActor ReplayActor;
+struct _ReplayActor {
+    int source;
+    Producer *producer;
+    ConsumerService *consumer;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    int pending;    // recorded requests not yet carried out
+    int closed;     // disconnected; finish pending requests, then exit
+};
+
+typedef struct _ReplayActors ReplayActors;
+struct _ReplayActors {
+    ReplayActor **actors;
+    int capacity;
+};
+
+static struct {
+    FILE *file;
+    double speed;
+    ReplayActors producers;
+    ReplayActors consumers;
+} replay;
+
+/**
+ * Replay thread for one actor. Carries out each request handed to it.
+ */
+void *trace_replay_actor_handler(void *ap) {
+    ReplayActor *a = (ReplayActor *)ap;
+    Resource *r;
+
+    if (a->source == EVENT_SOURCE_PRODUCER) {
+        affinity_place(AFFINITY_PRODUCER, a->producer->id);
+    }
+    else {
+        affinity_place(AFFINITY_CONSUMER, a->consumer->id);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&a->mutex);
+        while (a->pending == 0 && !a->closed) {
+            pthread_cond_wait(&a->ready, &a->mutex);
+        }
+        if (a->pending == 0) {
+            pthread_mutex_unlock(&a->mutex);
+            break;
+        }
+        a->pending--;
+        pthread_mutex_unlock(&a->mutex);
+
+        if (a->source == EVENT_SOURCE_PRODUCER) {
+            producer_produce_one(a->producer);
+            producer_set_status(a->producer, SLEEP);
+            continue;
+        }
+
+        // the recorded consume time already includes the client's pacing,
+        // so a replayed consumer doesn't sleep for consumeDelay
+        consumer_service_set_status(a->consumer, HUNGRY);
+        if (consumer_service_get_resource(a->consumer, &r) == 0) {
+            latency_record(LATENCY_PRODUCE_TO_CONSUME, monotonic_ns() - r->produced_at);
+            a->consumer->resources_consumed++;
+            wal_consume(a->consumer->bufferp, r);
+            free(r);
+            // the resource is consumed, so the next one with its key may go
+            partition_release(a->consumer);
+        }
+        consumer_service_set_status(a->consumer, SLEEPING);
+        monitor_push_reports();
+    }
+
+    if (a->consumer != NULL) {
+        consumer_service_remove(a->consumer);
+    }
+    pthread_mutex_destroy(&a->mutex);
+    pthread_cond_destroy(&a->ready);
+    free(a);
+    return NULL;
+}
+
+/**
+ * Find the replay actor for a recorded id, creating it (and its producer
+ * or consumer) the first time the id is seen. Returns NULL if no thread
+ * can be created for it.
+ */
+static ReplayActor *trace_replay_actor(Environment *env, int source, int id) {
+    ReplayActors *list = source == EVENT_SOURCE_PRODUCER ? &replay.producers : &replay.consumers;
+    ReplayActor *a;
+
+    if (id < 0) {
+        return NULL;
+    }
+    if (id >= list->capacity) {
+        int capacity = list->capacity > 0 ? list->capacity : 16;
+        while (capacity <= id) {
+            capacity *= 2;
+        }
+        list->actors = realloc(list->actors, capacity * sizeof(*list->actors));
+        memset(list->actors + list->capacity, 0, (capacity - list->capacity) * sizeof(*list->actors));
+        list->capacity = capacity;
+    }
+    if (list->actors[id] != NULL) {
+        return list->actors[id];
+    }
+
+    a = calloc(1, sizeof(*a));
+    a->source = source;
+    pthread_mutex_init(&a->mutex, NULL);
+    pthread_cond_init(&a->ready, NULL);
+    if (source == EVENT_SOURCE_PRODUCER) {
+        a->producer = producer_init(env->bufferp);
+        producer_set_status(a->producer, SLEEP);
+    }
+    else {
+        a->consumer = consumer_service_init(env, -1, env->bufferp);
+        consumer_service_add(a->consumer);
+    }
+    if (pthread_create(&a->thread, NULL, trace_replay_actor_handler, (void *)a) < 0) {
+        log_error("could not create replay thread");
+        free(a);
+        return NULL;
+    }
+    pthread_detach(a->thread);
+    list->actors[id] = a;
+    return a;
+}
+
+/**
+ * Stop an actor once it has carried out the requests it was given.
+ */
+static void trace_replay_close(ReplayActor *a) {
+    pthread_mutex_lock(&a->mutex);
+    a->closed = 1;
+    pthread_cond_signal(&a->ready);
+    pthread_mutex_unlock(&a->mutex);
+}
+
+/**
+ * Replay thread. Reads the trace and hands every produce and consume to
+ * its actor at the recorded time, divided by the replay speed.
+ */
+void *trace_replay_handler(void *ep) {
+    Environment *env = (Environment *)ep;
+    uint64_t start, elapsed = 0, delta, actor, resource, now, due;
+    uint64_t replayed = 0, dropped = 0;
+    ReplayActor *a;
+    int tag, type, source, i;
+
+    start = monotonic_ns();
+    while ((tag = fgetc(replay.file)) != EOF) {
+        if (tag == TRACE_DROPPED) {
+            if (trace_get_varint(replay.file, &delta) < 0) {
+                break;
+            }
+            dropped += delta;
+            continue;
+        }
+        type = tag & 0x0f;
+        source = tag >> 4;
+        if (trace_get_varint(replay.file, &delta) < 0
+            || trace_get_varint(replay.file, &actor) < 0) {
+            break;
+        }
+        if ((type == EVENT_PRODUCE || type == EVENT_CONSUME)
+            && trace_get_varint(replay.file, &resource) < 0) {
+            break;
+        }
+
+        // wait until the event is due
+        elapsed += delta;
+        due = start + (uint64_t)(elapsed / replay.speed);
+        if ((now = monotonic_ns()) < due) {
+            delay_sleep_ns(due - now);
+        }
+
+        switch (type) {
+            case EVENT_PRODUCE:
+            case EVENT_CONSUME:
+                if ((a = trace_replay_actor(env, source, (int)actor)) == NULL) {
+                    break;
+                }
+                pthread_mutex_lock(&a->mutex);
+                a->pending++;
+                pthread_cond_signal(&a->ready);
+                pthread_mutex_unlock(&a->mutex);
+                replayed++;
+                break;
+            case EVENT_CONNECT:
+                trace_replay_actor(env, source, (int)actor);
+                break;
+            case EVENT_DISCONNECT:
+                if (source == EVENT_SOURCE_CONSUMER && (int)actor < replay.consumers.capacity
+                    && replay.consumers.actors[actor] != NULL) {
+                    trace_replay_close(replay.consumers.actors[actor]);
+                    replay.consumers.actors[actor] = NULL;
+                }
+                break;
+        }
+    }
+    fclose(replay.file);
+
+    // consumers still connected at the end of the trace go away; producers
+    // stay, idle, so the server's producer ids remain stable
+    for (i = 0; i < replay.consumers.capacity; i++) {
+        if (replay.consumers.actors[i] != NULL) {
+            trace_replay_close(replay.consumers.actors[i]);
+        }
+    }
+    free(replay.consumers.actors);
+    replay.consumers.actors = NULL;
+    replay.consumers.capacity = 0;
+
+    printf("replay finished: %llu requests in %.2fs, %llu events were lost when recording\n",
+        (unsigned long long)replayed, (monotonic_ns() - start) / 1e9,
+        (unsigned long long)dropped);
+    fflush(stdout);
+    return NULL;
+}
+
+/**
+ * Start replaying the given trace file at the given speed (1.0 for the
+ * recorded pace). Returns -1 if the file can't be read.
+ */
+int trace_replay_start(Environment *env, const char *path, double speed) {
+    char magic[4];
+    uint64_t start;
+    pthread_t thread;
+
+    if ((replay.file = fopen(path, "rb")) == NULL) {
+        perror("could not open trace file");
+        return -1;
+    }
+    if (fread(magic, 1, 4, replay.file) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0
+        || fgetc(replay.file) != TRACE_VERSION || trace_get_varint(replay.file, &start) < 0) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        fclose(replay.file);
+        return -1;
+    }
+    replay.speed = speed;
+
+    if (pthread_create(&thread, NULL, trace_replay_handler, (void *)env) < 0) {
+        fclose(replay.file);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,366 @@
+/**
+ * @file
+ *
+ * The write-ahead log keeps the default topic's buffered resources across
+ * a restart. Every resource published to the default topic is logged as
+ * a produce record, and every one consumed (or, in ack mode, acked) as a
+ * consume record. On startup the log is replayed: each resource produced
+ * and never consumed goes back in the buffer, and ridx carries on after
+ * the highest id logged.
+ *
+ * A log file starts with a header:
+ *
+ *   "PCWL"  version (1 byte)
+ *
+ * followed by fixed-size records:
+ *
+ *   type (4 bytes)         WAL_PRODUCE or WAL_CONSUME
+ *   id (4 bytes)           resource id
+ *   produced_by (4 bytes)  producer id, for the resource's partition key
+ *
+ * Records are only copied into a pending buffer by the threads that make
+ * them. A log thread writes out everything pending with one write and one
+ * fdatasync, however many threads added to it meanwhile (group commit),
+ * so the cost of a sync is shared by everyone waiting on it. Each append
+ * gets a commit sequence number; a producer waits, after it lets go of
+ * the buffer's mutex, until its own sequence has been synced, never on
+ * other producers. A producer task doesn't hold its worker while it
+ * waits: it parks on the log's commit waiters, and the log thread hands
+ * it back to the workers once its sequence is synced. Consumers don't
+ * wait at all: a consume record lost in a crash only means the resource
+ * is delivered again.
+ *
+ * Produce records are added under the buffer's mutex, so the log has them
+ * in buffer order, and a resource's consume record always follows its
+ * produce record. A resource can be taken by a consumer before its
+ * produce record is synced; if the server then crashes, both records are
+ * lost together and the resource has still been delivered once.
+ *
+ * Replay writes the live resources out to a fresh log, so the log holds
+ * no more than the buffer did at each restart, plus what the run adds.
+ *
+ * The same records are streamed to a standby, if one is attached; see
+ * replication.c.
+ */
+
+#include "server.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#define WAL_MAGIC "PCWL"
+#define WAL_VERSION 1
+
+static int walFd = -1;
+// records waiting for the log thread, and their commit sequence
+static pthread_mutex_t walMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walPending = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t walCommitted = PTHREAD_COND_INITIALIZER;
+static WalRecord *walBuffer;
+static size_t walLength;
+static size_t walCapacity;
+static uint64_t walAppended;
+static uint64_t walSynced;
+// producer tasks parked until their wal_seq is synced, linked by task_next
+static Producer *walWaiters;
+
+/**
+ * Add a record to the pending buffer. Called with walMutex held.
+ */
+static void wal_put(int type, Resource *r) {
+    if (walLength == walCapacity) {
+        walCapacity = walCapacity > 0 ? walCapacity * 2 : 1024;
+        walBuffer = realloc(walBuffer, walCapacity * sizeof(*walBuffer));
+    }
+    walBuffer[walLength].type = type;
+    walBuffer[walLength].id = r->id;
+    walBuffer[walLength].produced_by = r->produced_by;
+    walLength++;
+}
+
+/**
+ * Write all of a buffer to the log, retrying short writes. Returns -1 on
+ * an error.
+ */
+static int wal_write(int fd, const void *data, size_t length) {
+    const char *p = data;
+    ssize_t n;
+
+    while (length > 0) {
+        if ((n = write(fd, p, length)) < 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Log n resources, linked by next from first, as produced to the default
+ * topic. Called with the buffer's mutex held. Returns the commit sequence
+ * to pass to wal_wait(), or 0 if there is no log.
+ */
+uint64_t wal_produce(Resource *first, int n) {
+    uint64_t seq;
+    int i;
+
+    replication_append(WAL_PRODUCE, first, n);
+    if (walFd < 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&walMutex);
+    for (i = 0; i < n; i++, first = first->next) {
+        wal_put(WAL_PRODUCE, first);
+    }
+    seq = ++walAppended;
+    pthread_cond_signal(&walPending);
+    pthread_mutex_unlock(&walMutex);
+    return seq;
+}
+
+/**
+ * Log a resource as consumed, if it came from the default topic. Doesn't
+ * wait for the record to be synced.
+ */
+void wal_consume(ResourceBuffer *rb, Resource *r) {
+    if (rb != globalResourceBuffer) {
+        return;
+    }
+    replication_append(WAL_CONSUME, r, 1);
+    if (walFd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&walMutex);
+    wal_put(WAL_CONSUME, r);
+    walAppended++;
+    pthread_cond_signal(&walPending);
+    pthread_mutex_unlock(&walMutex);
+}
+
+/**
+ * Wait until everything up to commit sequence seq is synced to disk.
+ */
+void wal_wait(uint64_t seq) {
+    if (walFd < 0 || seq == 0) {
+        return;
+    }
+    pthread_mutex_lock(&walMutex);
+    while (walSynced < seq) {
+        pthread_cond_wait(&walCommitted, &walMutex);
+    }
+    pthread_mutex_unlock(&walMutex);
+}
+
+/**
+ * Park a producer task until its last published resources are synced,
+ * rather than block its worker in wal_wait(). Returns 0, leaving the task
+ * to carry on, if they already are.
+ */
+int wal_park(Producer *p) {
+    if (walFd < 0 || p->wal_seq == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&walMutex);
+    if (walSynced >= p->wal_seq) {
+        pthread_mutex_unlock(&walMutex);
+        return 0;
+    }
+    p->task_next = walWaiters;
+    walWaiters = p;
+    pthread_mutex_unlock(&walMutex);
+    return 1;
+}
+
+/**
+ * Log thread. Takes everything pending, writes and syncs it in one go,
+ * and wakes the producers waiting on it.
+ */
+static void *wal_handler(void *unused) {
+    WalRecord *batch = NULL, *full;
+    size_t length, capacity = 0, c;
+    uint64_t seq;
+    Producer **pp, *p, *head, *tail;
+
+    while (1) {
+        pthread_mutex_lock(&walMutex);
+        while (walLength == 0) {
+            pthread_cond_wait(&walPending, &walMutex);
+        }
+
+        // swap buffers, so threads keep appending while this one syncs
+        length = walLength;
+        seq = walAppended;
+        full = walBuffer;
+        walBuffer = batch;
+        batch = full;
+        c = walCapacity;
+        walCapacity = capacity;
+        capacity = c;
+        walLength = 0;
+        pthread_mutex_unlock(&walMutex);
+
+        if (wal_write(walFd, batch, length * sizeof(*batch)) < 0 || fdatasync(walFd) < 0) {
+            // nothing after this can be made durable, so stop rather than
+            // let producers believe it was
+            perror("could not write the write-ahead log");
+            exit(EXIT_FAILURE);
+        }
+        counter_add(&serverCounters->wal_commits.value, 1);
+        counter_add(&serverCounters->wal_records.value, length);
+
+        pthread_mutex_lock(&walMutex);
+        walSynced = seq;
+        pthread_cond_broadcast(&walCommitted);
+
+        // take the parked tasks this commit covers
+        head = tail = NULL;
+        pp = &walWaiters;
+        while ((p = *pp) != NULL) {
+            if (p->wal_seq > seq) {
+                pp = &p->task_next;
+                continue;
+            }
+            *pp = p->task_next;
+            p->task_next = head;
+            head = p;
+            if (tail == NULL) {
+                tail = p;
+            }
+        }
+        pthread_mutex_unlock(&walMutex);
+
+        if (head != NULL) {
+            producer_tasks_run(head, tail);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Compare resource ids, for qsort() and bsearch().
+ */
+static int wal_compare_ids(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Read the log at path and put every resource produced and never consumed
+ * back in the buffer. Returns the number of resources recovered, or -1 if
+ * the file isn't a log. A torn record at the end, from a crash mid-write,
+ * is ignored.
+ */
+static int wal_replay(const char *path, ResourceBuffer *rb) {
+    FILE *f;
+    char magic[5];
+    WalRecord record;
+    int *consumed = NULL, ncons = 0, capacity = 0, recovered = 0, maxId = -1;
+    Resource *r;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        return 0;
+    }
+    if (fread(magic, 1, 5, f) != 5 || memcmp(magic, WAL_MAGIC, 4) != 0
+        || magic[4] != WAL_VERSION) {
+        fclose(f);
+        return -1;
+    }
+
+    // the consumed ids first, so the produce records can be checked
+    // against them in order
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        if (record.id > maxId) {
+            maxId = record.id;
+        }
+        if (record.type == WAL_CONSUME) {
+            if (ncons == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 1024;
+                consumed = realloc(consumed, capacity * sizeof(*consumed));
+            }
+            consumed[ncons++] = record.id;
+        }
+    }
+    qsort(consumed, ncons, sizeof(*consumed), wal_compare_ids);
+
+    fseek(f, 5, SEEK_SET);
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        if (record.type != WAL_PRODUCE
+            || (ncons > 0 && bsearch(&record.id, consumed, ncons, sizeof(*consumed), wal_compare_ids) != NULL)) {
+            continue;
+        }
+        r = malloc(sizeof(*r));
+        r->id = record.id;
+        r->produced_by = record.produced_by;
+        r->produced_at = monotonic_ns();
+        resource_buffer_append(rb, r, r, 1);
+        recovered++;
+    }
+    fclose(f);
+    free(consumed);
+
+    // the buffer may be smaller than it was; consumers drain the excess
+    rb->excess = rb->count > rb->size ? rb->count - rb->size : 0;
+    atomic_store(&ridx, maxId + 1);
+    return recovered;
+}
+
+/**
+ * Write the resources in the buffer to a fresh log at path, replacing the
+ * old one, and leave it open for appending.
+ */
+static int wal_rewrite(const char *path, ResourceBuffer *rb) {
+    char temp[4096], header[5] = WAL_MAGIC;
+    Resource *r;
+    int fd, k;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&walMutex);
+    for (r = resource_buffer_walk(rb, NULL, &k); r != NULL; r = resource_buffer_walk(rb, r, &k)) {
+        wal_put(WAL_PRODUCE, r);
+    }
+    header[4] = WAL_VERSION;
+    if (wal_write(fd, header, sizeof(header)) < 0
+        || wal_write(fd, walBuffer, walLength * sizeof(*walBuffer)) < 0
+        || fsync(fd) < 0 || rename(temp, path) < 0) {
+        pthread_mutex_unlock(&walMutex);
+        close(fd);
+        return -1;
+    }
+    walLength = 0;
+    pthread_mutex_unlock(&walMutex);
+    walFd = fd;
+    return 0;
+}
+
+/**
+ * Replay the log at wal.path into the default topic, if there is one, and
+ * start logging to it. Called before any producer or consumer starts.
+ * Returns -1 if the log can't be read or written.
+ */
+int wal_start() {
+    pthread_t thread;
+    int recovered;
+
+    if (wal.path == NULL) {
+        return 0;
+    }
+    if ((recovered = wal_replay(wal.path, globalResourceBuffer)) < 0) {
+        fprintf(stderr, "%s is not a write-ahead log\n", wal.path);
+        return -1;
+    }
+    counter_add(&serverCounters->recovered.value, recovered);
+    if (wal_rewrite(wal.path, globalResourceBuffer) < 0) {
+        perror("could not write the write-ahead log");
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, wal_handler, NULL) != 0) {
+        log_error("could not create write-ahead log thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    log_info("recovered %d resources from %s", recovered, wal.path);
+    return 0;
+}
@@ -0,0 +1,183 @@
+/**
+ * @file
+ *
+ * The watchdog checks the server's invariants every watchdogInterval while
+ * it runs, so long soak runs catch corruption when it happens rather than
+ * at the end:
+ *
+ *   - each topic's buffer count is between 0 and the buffer size (or,
+ *     while a shrunk buffer drains, what is left of the excess)
+ *   - each buffer list holds exactly count resources
+ *   - every resource produced has been consumed or is still in a buffer
+ *     (none lost, none handed out twice except to redeliver it)
+ *   - no producer waits for room, and no consumer waits for a resource,
+ *     while the buffer has been able to satisfy it for a whole interval
+ *
+ * Each violation is logged and counted in the invariant_violations
+ * counter, which is published in the stats page and in the metrics.
+ */
+
+#include "server.h"
+
+// how long a thread must keep waiting for a condition that already holds
+// before it counts as stuck, once it has waited a whole interval
+#define WATCHDOG_GRACE_NS 10000000ull
+
+/**
+ * Record one invariant violation.
+ */
+static void watchdog_violation() {
+    counter_add(&serverCounters->invariant_violations.value, 1);
+}
+
+/**
+ * Check the buffers and the produced/consumed totals. The list mutexes are
+ * held so that no producer's or consumer's counts move to the retired
+ * counters mid-check, and every topic's mutex so that the buffers and the
+ * counts agree.
+ */
+static void watchdog_check_buffer() {
+    ResourceBuffer *rb;
+    uint64_t produced, consumed, redelivered;
+    ConsumerService *cs;
+    Producer *p;
+    Resource *r;
+    int length, buffered = 0, k;
+
+    pthread_mutex_lock(&producerListMutex);
+    pthread_mutex_lock(&consumerListMutex);
+    for (rb = topics; rb != NULL; rb = rb->next) {
+        pthread_mutex_lock(&rb->mutex);
+    }
+
+    for (rb = topics; rb != NULL; rb = rb->next) {
+        if (rb->count < 0 || rb->count > rb->size + rb->excess) {
+            log_error("watchdog: %s buffer count %d is outside 0 to %d", rb->name, rb->count, rb->size + rb->excess);
+            watchdog_violation();
+        }
+        length = 0;
+        for (r = resource_buffer_walk(rb, NULL, &k); r != NULL && length <= rb->count;
+            r = resource_buffer_walk(rb, r, &k)) {
+            length++;
+        }
+        if (rb->count > 0 && length != rb->count) {
+            log_error("watchdog: %s buffer count is %d but the list holds %d", rb->name, rb->count, length);
+            watchdog_violation();
+        }
+        buffered += rb->count;
+    }
+
+    // resources replayed from the write-ahead log count as produced
+    produced = counter_get(&serverCounters->produced_retired.value)
+        + counter_get(&serverCounters->recovered.value);
+    for (p = producerList->head; p != NULL; p = p->next) {
+        produced += counter_get(&p->counters->produced);
+    }
+    consumed = counter_get(&serverCounters->consumed_retired.value);
+    for (cs = consumerList->head; cs != NULL; cs = cs->next) {
+        consumed += counter_get(&cs->counters->consumed);
+    }
+    // a redelivered resource is consumed once more than it was produced
+    redelivered = counter_get(&serverCounters->redelivered.value);
+    if (produced - consumed + redelivered != (uint64_t)buffered) {
+        log_error("watchdog: %llu produced, %llu consumed, %llu redelivered, but %d in the buffers",
+            (unsigned long long)produced, (unsigned long long)consumed,
+            (unsigned long long)redelivered, buffered);
+        watchdog_violation();
+    }
+
+    for (rb = topics; rb != NULL; rb = rb->next) {
+        pthread_mutex_unlock(&rb->mutex);
+    }
+    pthread_mutex_unlock(&consumerListMutex);
+    pthread_mutex_unlock(&producerListMutex);
+}
+
+/**
+ * Return the room a producer could take in the buffer, or the resources
+ * the given consumer could take from it.
+ */
+static int watchdog_available(ResourceBuffer *rb, ConsumerService *cs) {
+    if (cs != NULL) {
+        return partition_available(rb, cs);
+    }
+    // room that producer tasks have been woken to fill is already taken
+    return rb->size - __atomic_load_n(&rb->count, __ATOMIC_RELAXED) - producer_tasks_woken(rb);
+}
+
+/**
+ * Return 1 if a thread that started waiting at since on the given buffer
+ * is still waiting, for a wait of the same start time, after a grace
+ * period in which the condition it waits for still holds. cs is the
+ * waiting consumer, or NULL for a producer.
+ */
+static int watchdog_stuck(ResourceBuffer *rb, ConsumerService *cs, _Atomic uint64_t *waiting_since, uint64_t since) {
+    if (since == 0 || monotonic_ns() - since < watchdogInterval) {
+        return 0;
+    }
+    if (watchdog_available(rb, cs) <= 0) {
+        return 0;
+    }
+    delay_sleep_ns(WATCHDOG_GRACE_NS);
+    if (watchdog_available(rb, cs) <= 0) {
+        return 0;
+    }
+    return atomic_load_explicit(waiting_since, memory_order_relaxed) == since;
+}
+
+/**
+ * Look for producers and consumers that missed their wakeup.
+ */
+static void watchdog_check_waiters() {
+    ConsumerService *cs;
+    Producer *p;
+
+    pthread_mutex_lock(&producerListMutex);
+    for (p = producerList->head; p != NULL; p = p->next) {
+        uint64_t since = atomic_load_explicit(&p->waiting_since, memory_order_relaxed);
+        if (watchdog_stuck(p->bufferp, NULL, &p->waiting_since, since)) {
+            log_error("watchdog: producer %d is stuck waiting for room", p->id);
+            watchdog_violation();
+        }
+    }
+    pthread_mutex_unlock(&producerListMutex);
+
+    pthread_mutex_lock(&consumerListMutex);
+    for (cs = consumerList->head; cs != NULL; cs = cs->next) {
+        uint64_t since = atomic_load_explicit(&cs->waiting_since, memory_order_relaxed);
+        if (watchdog_stuck(cs->bufferp, cs, &cs->waiting_since, since)) {
+            log_error("watchdog: consumer %d is stuck waiting for a resource", cs->id);
+            watchdog_violation();
+        }
+    }
+    pthread_mutex_unlock(&consumerListMutex);
+}
+
+/**
+ * Watchdog loop.
+ */
+void *watchdog_handler(void *unused) {
+    while (1) {
+        delay_sleep_ns(watchdogInterval);
+        watchdog_check_buffer();
+        watchdog_check_waiters();
+    }
+    return NULL;
+}
+
+/**
+ * Start the watchdog thread, if watchdogInterval is set.
+ */
+int watchdog_start() {
+    pthread_t thread;
+
+    if (watchdogInterval == 0) {
+        return 0;
+    }
+    if (pthread_create(&thread, NULL, watchdog_handler, NULL) < 0) {
+        log_error("could not create watchdog thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}